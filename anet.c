@@ -62,6 +62,7 @@
 #include <fcntl.h>
 #include <string.h>
 #include <netdb.h>
+#include <linux/net_tstamp.h>
 #include <errno.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -118,6 +119,42 @@ int anetSetSendBuffer(char *err, int fd, int buffsize)
     return ANET_OK;
 }
 
+int anetSetZeroCopy(char *err, int fd)
+{
+#ifdef SO_ZEROCOPY
+    int yes = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, (void*)&yes, sizeof(yes)) == -1)
+    {
+        anetSetError(err, "setsockopt SO_ZEROCOPY: %s", strerror(errno));
+        return ANET_ERR;
+    }
+    return ANET_OK;
+#else
+    (void) fd;
+    anetSetError(err, "SO_ZEROCOPY not supported");
+    return ANET_ERR;
+#endif
+}
+
+// Ask the kernel to report when each received segment arrived
+// (SCM_TIMESTAMPING, software receive timestamps)
+int anetSetRxTimestamping(char *err, int fd)
+{
+#ifdef SO_TIMESTAMPING
+    int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+    if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, (void*)&flags, sizeof(flags)) == -1)
+    {
+        anetSetError(err, "setsockopt SO_TIMESTAMPING: %s", strerror(errno));
+        return ANET_ERR;
+    }
+    return ANET_OK;
+#else
+    (void) fd;
+    anetSetError(err, "SO_TIMESTAMPING not supported");
+    return ANET_ERR;
+#endif
+}
+
 int anetTcpKeepAlive(char *err, int fd)
 {
     int yes = 1;
@@ -128,6 +165,49 @@ int anetTcpKeepAlive(char *err, int fd)
     return ANET_OK;
 }
 
+/* Enable keepalive and set how soon (idle seconds) and how often (interval
+ * seconds, count probes) a silent peer is probed before the connection is
+ * dropped */
+int anetTcpKeepAliveTune(char *err, int fd, int idle, int interval, int count)
+{
+    if (anetTcpKeepAlive(err, fd) == ANET_ERR)
+        return ANET_ERR;
+
+#ifdef TCP_KEEPIDLE
+    if (setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, (void*)&idle, sizeof(idle)) == -1) {
+        anetSetError(err, "setsockopt TCP_KEEPIDLE: %s", strerror(errno));
+        return ANET_ERR;
+    }
+    if (setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, (void*)&interval, sizeof(interval)) == -1) {
+        anetSetError(err, "setsockopt TCP_KEEPINTVL: %s", strerror(errno));
+        return ANET_ERR;
+    }
+    if (setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, (void*)&count, sizeof(count)) == -1) {
+        anetSetError(err, "setsockopt TCP_KEEPCNT: %s", strerror(errno));
+        return ANET_ERR;
+    }
+#else
+    (void) idle; (void) interval; (void) count;
+#endif
+    return ANET_OK;
+}
+
+/* Drop the connection if sent data stays unacknowledged for this long */
+int anetTcpUserTimeout(char *err, int fd, unsigned int ms)
+{
+#ifdef TCP_USER_TIMEOUT
+    if (setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, (void*)&ms, sizeof(ms)) == -1) {
+        anetSetError(err, "setsockopt TCP_USER_TIMEOUT: %s", strerror(errno));
+        return ANET_ERR;
+    }
+    return ANET_OK;
+#else
+    (void) fd; (void) ms;
+    anetSetError(err, "TCP_USER_TIMEOUT not supported");
+    return ANET_ERR;
+#endif
+}
+
 static int anetCreateSocket(char *err, int domain)
 {
     int s, on = 1;
@@ -260,6 +340,27 @@ static int anetListen(char *err, int s, struct sockaddr *sa, socklen_t len) {
 }
 
 int anetTcpServer(char *err, char *service, char *bindaddr, int *fds, int nfds)
+{
+    return anetTcpServerEx(err, service, bindaddr, fds, nfds, ANET_SERVER_NONE);
+}
+
+static int anetSetReusePort(char *err, int s)
+{
+#ifdef SO_REUSEPORT
+    int on = 1;
+    if (setsockopt(s, SOL_SOCKET, SO_REUSEPORT, (void*)&on, sizeof(on)) == -1) {
+        anetSetError(err, "setsockopt SO_REUSEPORT: %s", strerror(errno));
+        return ANET_ERR;
+    }
+    return ANET_OK;
+#else
+    (void) s;
+    anetSetError(err, "SO_REUSEPORT not supported");
+    return ANET_ERR;
+#endif
+}
+
+int anetTcpServerEx(char *err, char *service, char *bindaddr, int *fds, int nfds, int flags)
 {
     int s;
     int i = 0;
@@ -286,6 +387,11 @@ int anetTcpServer(char *err, char *service, char *bindaddr, int *fds, int nfds)
         if ((s = anetCreateSocket(err, p->ai_family)) == ANET_ERR)
             continue;
 
+        if ((flags & ANET_SERVER_REUSEPORT) && anetSetReusePort(err, s) == ANET_ERR) {
+            close(s);
+            continue;
+        }
+
         if (anetListen(err, s, p->ai_addr, p->ai_addrlen) == ANET_ERR) {
             continue;
         }
@@ -297,6 +403,45 @@ int anetTcpServer(char *err, char *service, char *bindaddr, int *fds, int nfds)
     return (i > 0 ? i : ANET_ERR);
 }
 
+static int anetReusePortListen(char *err, struct sockaddr *sa, socklen_t len)
+{
+    int s;
+
+    if ((s = anetCreateSocket(err, sa->sa_family)) == ANET_ERR)
+        return ANET_ERR;
+
+    if (anetSetReusePort(err, s) == ANET_ERR) {
+        close(s);
+        return ANET_ERR;
+    }
+
+    if (anetListen(err, s, sa, len) == ANET_ERR)
+        return ANET_ERR;
+
+    return s;
+}
+
+/* Open another listening socket on the same address as 'fd' with
+ * SO_REUSEPORT set, so the kernel spreads incoming connections across all
+ * the sockets sharing the address. If 'fd' itself was not created with
+ * ANET_SERVER_REUSEPORT it can't share, so pass replace=1 to close it and
+ * open its replacement in its place. */
+int anetTcpServerClone(char *err, int fd, int replace)
+{
+    struct sockaddr_storage ss;
+    socklen_t sslen = sizeof(ss);
+
+    if (getsockname(fd, (struct sockaddr*)&ss, &sslen) == -1) {
+        anetSetError(err, "getsockname: %s", strerror(errno));
+        return ANET_ERR;
+    }
+
+    if (replace)
+        close(fd);
+
+    return anetReusePortListen(err, (struct sockaddr*)&ss, sslen);
+}
+
 static int anetGenericAccept(char *err, int s, struct sockaddr *sa, socklen_t *len)
 {
     int fd;
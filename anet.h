@@ -58,6 +58,9 @@
 #define ANET_ERR -1
 #define ANET_ERR_LEN 256
 
+#define ANET_SERVER_NONE 0
+#define ANET_SERVER_REUSEPORT 1
+
 #if defined(__sun)
 #define AF_LOCAL AF_UNIX
 #endif
@@ -66,11 +69,17 @@ int anetTcpConnect(char *err, char *addr, char *service);
 int anetTcpNonBlockConnect(char *err, char *addr, char *service);
 int anetRead(int fd, char *buf, int count);
 int anetTcpServer(char *err, char *service, char *bindaddr, int *fds, int nfds);
+int anetTcpServerEx(char *err, char *service, char *bindaddr, int *fds, int nfds, int flags);
+int anetTcpServerClone(char *err, int fd, int replace);
 int anetTcpAccept(char *err, int serversock);
 int anetWrite(int fd, char *buf, int count);
 int anetNonBlock(char *err, int fd);
 int anetTcpNoDelay(char *err, int fd);
 int anetTcpKeepAlive(char *err, int fd);
+int anetTcpKeepAliveTune(char *err, int fd, int idle, int interval, int count);
+int anetTcpUserTimeout(char *err, int fd, unsigned int ms);
 int anetSetSendBuffer(char *err, int fd, int buffsize);
+int anetSetZeroCopy(char *err, int fd);
+int anetSetRxTimestamping(char *err, int fd);
 
 #endif
@@ -80,14 +80,26 @@ static void faupInitConfig(void) {
 
 	// Now initialise things that should not be 0/NULL to their defaults
 	Modes.nfix_crc = 1;
-	Modes.check_crc = 1;
+	Modes.check_crc = 0;    // a repeater passes frames on as received unless --check-crc
+	Modes.mode_ac = 1;
+	Modes.forward_mlat = 1;
 	Modes.net = 1;
 	Modes.net_heartbeat_interval = MODES_NET_HEARTBEAT_INTERVAL;
 	Modes.maxRange = 1852 * 360; // 360NM default max range; this also disables receiver-relative positions
 	Modes.quiet = 1;
-	Modes.net_output_flush_size = 1024;
-	Modes.net_output_flush_interval = 50; // milliseconds
-	Modes.net_bind_address = "0.0.0.0";
+	Modes.net_output_flush_size = MODES_NET_FLUSH_SIZE;
+	Modes.net_output_flush_interval = MODES_NET_FLUSH_INTERVAL;
+	Modes.net_output_flush_policy = NET_FLUSH_LATENCY;
+	Modes.net_output_queue_size = MODES_NET_OUTQ_SIZE;
+	Modes.net_output_queue_age = MODES_NET_OUTQ_AGE;
+	Modes.net_output_drop_policy = NET_DROP_DISCONNECT;
+	Modes.net_output_thin_limit = 1;
+	Modes.net_reconnect_min = MODES_NET_RECONNECT_MIN;
+	Modes.net_reconnect_max = MODES_NET_RECONNECT_MAX;
+	Modes.net_input_timeout = MODES_NET_INPUT_TIMEOUT;
+	Modes.net_keepalive = MODES_NET_KEEPALIVE;
+	Modes.net_udp_ttl = 1;
+	Modes.net_bind_address = strdup("0.0.0.0"); // replaced (and freed) by --net-bind-address
 }
 
 //
@@ -102,20 +114,76 @@ printf(
 		"--outConnect <host>:<port>     Host and port for output connector\n"
 		"--inServer <port>              Input server\n"
 		"--outServer <port>             Output server\n"
+		"--inUdp <port>                 Take Beast datagrams (from --outUdp or plain Beast) on this port\n"
+		"--outUdp <host>:<port>[,...]   Send datagrams to a multicast group or a list of unicast targets\n"
+		"--udp-ttl <n>                  TTL of multicast --outUdp datagrams (default 1)\n"
 		"--net-bind-address <ip>        IP address to bind to (default 0.0.0.0, use 127.0.0.1 for private)\n"
+		"--net-zerocopy                 Send output with MSG_ZEROCOPY (helps large fan-outs)\n"
+		"--io-uring                     Drive the main thread's sockets through io_uring (Linux 6.0 or later)\n"
+		"--out-workers <n>              Spread --outServer clients over n worker threads (default 0)\n"
+		"--in-readers <n>               Read --inServer/--inConnect clients on n reader threads (default 0)\n"
+		"--net-reuseport                Let each worker accept for itself using SO_REUSEPORT\n"
+		"--reconnect-delay <ms>         First delay before reconnecting a connector (default %d)\n"
+		"--reconnect-max <ms>           Ceiling for the exponential reconnect backoff (default %d)\n"
+		"--in-timeout <ms>              Reconnect an --inConnect input silent this long, 0 = never (default %d)\n"
+		"--tcp-keepalive <s>            Keepalive idle time for connectors, 0 = off (default %d)\n"
+		"--dedup <ms>                   Forward only the first copy of a Mode S frame seen within ms (default off)\n"
+		"--metrics <port>               Serve Prometheus metrics over HTTP on this port\n"
+		"--latency                      Measure forwarding latency (reported by --metrics)\n"
+		"--in-compress                  Ask the preceding --inConnect (or all of them) for a compressed stream,\n"
+		"                               or take one from the preceding --inServer's feeders; other inputs\n"
+		"                               never decompress\n"
+		"--record <file>                Append every ingested frame to a capture file\n"
+		"--inReplay <file>              Play a capture file back as an input\n"
+		"--speed <n>                    Replay at n times real time, 0 = as fast as possible (default 1)\n"
+		"--replay-from <s>              Start the replay this many seconds into the capture\n"
+		"\n"
+		"Output options (apply to the preceding --outServer/--outConnect,\n"
+		"or to all later outputs when given before any of them):\n"
+		"--out-queue-size <bytes>       Max data queued for a slow client (default %d)\n"
+		"--out-queue-time <ms>          Max age of data queued for a slow client, 0 = no limit (default %d)\n"
+		"--out-drop-policy <policy>     On queue overflow: oldest, newest or disconnect (default disconnect)\n"
+		"--out-format <format>          beast (default), raw (AVR \"*<hex>;\" lines) or sbs (BaseStation)\n"
+		"--out-flush <policy>           When to send batched output: latency (every pass of the event loop),\n"
+		"                               throughput (by size or deadline) or adaptive (size set from the\n"
+		"                               message rate to meet the deadline) (default latency)\n"
+		"--out-flush-size <bytes>       Send a batch once it holds this many bytes (default %d)\n"
+		"--out-flush-time <ms>          Throughput/adaptive: longest a message waits in a batch (default %d)\n"
+		"--out-flush-urgent             Send DF17/18 position messages at once, with whatever is batched\n"
+		"--out-rate <bytes/s>           Cap the output at this rate (before compression); when over it,\n"
+		"                               shed Mode A/C and DF11 first, then DF0/4/5, DF17/18 positions last\n"
+		"--out-rate-msgs <n/s>          Cap the output at this many messages a second, shedding the same way\n"
+		"--out-thin <ms>                Send at most --out-thin-count messages per aircraft and kind (position,\n"
+		"                               velocity, callsign, altitude, ...) every ms; an aircraft's first\n"
+		"                               message and any that changes what it says always go (default off)\n"
+		"--out-thin-count <n>           Messages per aircraft and kind per --out-thin interval (default 1)\n"
+		"--out-compress                 Send every client a compressed stream, not only those asking for it\n"
+		"                               (needed for --outConnect to an --inServer)\n"
+		"--out-filter <spec>            Only forward matching frames; spec is terms separated by ';' or spaces:\n"
+		"                                 df=17,18  icao=<hex>,...  icao!=<hex>,...  icao=@<file>\n"
+		"                                 sig=<0-255>  mlat=yes|no|only  modeac=yes|no  crc=yes|no\n"
+		"\n"
+		"Filter defaults:\n"
+		"--no-forward-mlat              Don't forward MLAT results (--forward-mlat to undo)\n"
+		"--no-modeac                    Don't forward Mode A/C (--modeac to undo)\n"
+		"--check-crc                    Drop DF11/17/18 frames with a bad CRC\n"
+		"\n"
 
 		"--help                         Show this help\n"
-		"\n");
+		"\n", MODES_NET_RECONNECT_MIN, MODES_NET_RECONNECT_MAX, MODES_NET_INPUT_TIMEOUT, MODES_NET_KEEPALIVE,
+		MODES_NET_OUTQ_SIZE, MODES_NET_OUTQ_AGE, MODES_NET_FLUSH_SIZE, MODES_NET_FLUSH_INTERVAL);
 }
 
 //
 //=========================================================================
 //
-// This function is called a few times every second by main in order to
-// perform tasks we need to do continuously, like accepting new clients
-// from the net, refreshing the screen in interactive mode, and so forth
+// This function is called by main for every turn of the event loop. It
+// sleeps until a socket is ready or some timed work is due, handles the
+// ready sockets, then does the periodic work (flushes, heartbeats,
+// reconnects) that is due
 //
 static void backgroundTasks(void) {
+modesNetPollEx(modesNetTimeoutEx());
 modesNetPeriodicWorkEx();
 }
 
@@ -141,7 +209,11 @@ int j;
 uint64_t now = mstime();
 struct beastClient *bClient = NULL;
 struct net_writer *writer;
+struct net_writer *lastWriter = NULL; // target of per-output options
+struct net_service *lastInput = NULL; // target of per-input options
 struct net_service *serverService;
+char *record = NULL, *replay = NULL;
+double replay_speed = 1, replay_from = 0;
 
 // Set sane defaults
 faupInitConfig();
@@ -159,6 +231,7 @@ for (j = 1; j < argc; j++) {
 		serverService = makeBeastServerInputServiceEx(
 				handleBeastMessage);
 		serviceListen(serverService, Modes.net_bind_address, argv[++j]);
+		lastInput = serverService;
 
 	} else if (!strcmp(argv[j], "--outServer") && more) {
 		/* create new listen output server */
@@ -169,6 +242,7 @@ for (j = 1; j < argc; j++) {
 			serverService = makeBeastServerOutputServiceEx(
 					writer);
 			serviceListen(serverService, Modes.net_bind_address, argv[++j]);
+			lastWriter = writer;
 		}
 	} else if (!strcmp(argv[j], "--inConnect") && more) {
 		bClient = newBeastClient();
@@ -179,17 +253,205 @@ for (j = 1; j < argc; j++) {
 			bClient->isInput = true;			
 			bClient->ipaddr = extractHostPort(argv[++j], &bClient->ipport);			
 			beastClients = bClient;
+			lastInput = bClient->serviceHandle;
 		}
 	} else if (!strcmp(argv[j], "--outConnect") && more) {
 		bClient = newBeastClient();
-		if (bClient) {
+		writer = malloc(sizeof(struct net_writer));
+		if (bClient && writer) {
+			memset(writer, 0x00, sizeof(struct net_writer));
 			bClient->next = beastClients;
 			bClient->reconnectTime = now;
-			bClient->serviceHandle = makeBeastOutputServiceEx();			
+			bClient->serviceHandle = makeBeastOutputServiceEx(writer);
 			bClient->isInput = false;			
 			bClient->ipaddr = extractHostPort(argv[++j], &bClient->ipport);			
 			beastClients = bClient;
+			lastWriter = writer;
+		}
+	} else if (!strcmp(argv[j], "--inUdp") && more) {
+		fprintf(stderr, "INPUT: Taking datagrams at %s:%s...\n", Modes.net_bind_address, argv[j+1]);
+		serverService = makeBeastUdpInputServiceEx(handleBeastMessage);
+		serviceUdpInput(serverService, Modes.net_bind_address, argv[++j]);
+	} else if (!strcmp(argv[j], "--outUdp") && more) {
+		fprintf(stderr, "OUTPUT: Sending datagrams to %s...\n", argv[j+1]);
+		writer = malloc(sizeof(struct net_writer));
+		if (writer) {
+			memset(writer, 0x00, sizeof(struct net_writer));
+			serverService = makeBeastUdpOutputServiceEx(writer);
+			serviceUdpOutput(serverService, argv[++j]);
+			lastWriter = writer;
+		}
+	} else if (!strcmp(argv[j], "--udp-ttl") && more) {
+		Modes.net_udp_ttl = atoi(argv[++j]);
+	} else if (!strcmp(argv[j], "--out-queue-size") && more) {
+		int size = atoi(argv[++j]);
+		if (size < MODES_OUT_BUF_SIZE) {
+			fprintf(stderr, "--out-queue-size must be at least %d bytes\n", MODES_OUT_BUF_SIZE);
+			exit(1);
+		}
+		if (lastWriter)
+			lastWriter->queue_limit = size;
+		else
+			Modes.net_output_queue_size = size;
+	} else if (!strcmp(argv[j], "--out-queue-time") && more) {
+		uint64_t age = strtoull(argv[++j], NULL, 10);
+		if (lastWriter)
+			lastWriter->queue_max_age = age;
+		else
+			Modes.net_output_queue_age = age;
+	} else if (!strcmp(argv[j], "--out-drop-policy") && more) {
+		net_drop_policy_t policy;
+		if (parseDropPolicy(argv[++j], &policy) < 0) {
+			fprintf(stderr, "Unknown drop policy '%s' (expected oldest, newest or disconnect)\n", argv[j]);
+			exit(1);
+		}
+		if (lastWriter)
+			lastWriter->drop_policy = policy;
+		else
+			Modes.net_output_drop_policy = policy;
+	} else if (!strcmp(argv[j], "--out-format") && more) {
+		net_format_t format;
+		if (parseOutputFormat(argv[++j], &format) < 0) {
+			fprintf(stderr, "Unknown output format '%s' (expected beast, raw or sbs)\n", argv[j]);
+			exit(1);
+		}
+		if (lastWriter)
+			lastWriter->format = format;
+		else
+			Modes.net_output_format = format;
+	} else if (!strcmp(argv[j], "--out-flush") && more) {
+		net_flush_policy_t policy;
+		if (parseFlushPolicy(argv[++j], &policy) < 0) {
+			fprintf(stderr, "Unknown flush policy '%s' (expected latency, throughput or adaptive)\n", argv[j]);
+			exit(1);
+		}
+		if (lastWriter)
+			lastWriter->flush_policy = policy;
+		else
+			Modes.net_output_flush_policy = policy;
+	} else if (!strcmp(argv[j], "--out-flush-size") && more) {
+		int size = atoi(argv[++j]);
+		if (size < 1) {
+			fprintf(stderr, "--out-flush-size must be at least 1 byte\n");
+			exit(1);
 		}
+		if (lastWriter)
+			lastWriter->flush_size = size;
+		else
+			Modes.net_output_flush_size = size;
+	} else if (!strcmp(argv[j], "--out-flush-time") && more) {
+		uint64_t interval = strtoull(argv[++j], NULL, 10);
+		if (lastWriter)
+			lastWriter->flush_interval = interval;
+		else
+			Modes.net_output_flush_interval = interval;
+	} else if (!strcmp(argv[j], "--out-flush-urgent")) {
+		if (lastWriter)
+			lastWriter->flush_urgent = 1;
+		else
+			Modes.net_output_flush_urgent = 1;
+	} else if (!strcmp(argv[j], "--out-rate") && more) {
+		uint64_t rate = strtoull(argv[++j], NULL, 10);
+		if (rate && rate < MODES_NET_RATE_MIN) {
+			fprintf(stderr, "--out-rate must be 0 or at least %d bytes a second\n", MODES_NET_RATE_MIN);
+			exit(1);
+		}
+		if (lastWriter)
+			lastWriter->rate_bytes = rate;
+		else
+			Modes.net_output_rate = rate;
+	} else if (!strcmp(argv[j], "--out-rate-msgs") && more) {
+		uint64_t rate = strtoull(argv[++j], NULL, 10);
+		if (lastWriter)
+			lastWriter->rate_msgs = rate;
+		else
+			Modes.net_output_rate_msgs = rate;
+	} else if (!strcmp(argv[j], "--out-thin") && more) {
+		uint64_t interval = strtoull(argv[++j], NULL, 10);
+		if (lastWriter)
+			lastWriter->thin_interval = interval;
+		else
+			Modes.net_output_thin_interval = interval;
+	} else if (!strcmp(argv[j], "--out-thin-count") && more) {
+		int count = atoi(argv[++j]);
+		if (count < 1 || count > UINT16_MAX) {
+			fprintf(stderr, "--out-thin-count must be between 1 and %d\n", UINT16_MAX);
+			exit(1);
+		}
+		if (lastWriter)
+			lastWriter->thin_limit = count;
+		else
+			Modes.net_output_thin_limit = count;
+	} else if (!strcmp(argv[j], "--out-compress")) {
+		if (lastWriter)
+			lastWriter->compress = 1;
+		else
+			Modes.net_output_compress = 1;
+	} else if (!strcmp(argv[j], "--in-compress")) {
+		if (lastInput) {
+			// A connector asks for it; a server's feeders decide for
+			// themselves, it only has to be willing
+			if (!lastInput->listener_count)
+				lastInput->request_compression = 1;
+			lastInput->accept_compression = 1;
+		} else
+			Modes.net_input_compress = 1;
+	} else if (!strcmp(argv[j], "--out-filter") && more) {
+		if (lastWriter)
+			lastWriter->filter_spec = argv[++j];
+		else
+			Modes.net_output_filter = argv[++j];
+	} else if (!strcmp(argv[j], "--forward-mlat")) {
+		Modes.forward_mlat = 1;
+	} else if (!strcmp(argv[j], "--no-forward-mlat")) {
+		Modes.forward_mlat = 0;
+	} else if (!strcmp(argv[j], "--modeac")) {
+		Modes.mode_ac = 1;
+	} else if (!strcmp(argv[j], "--no-modeac")) {
+		Modes.mode_ac = 0;
+	} else if (!strcmp(argv[j], "--check-crc")) {
+		Modes.check_crc = 1;
+	} else if (!strcmp(argv[j], "--out-workers") && more) {
+		Modes.net_workers = atoi(argv[++j]);
+		if (Modes.net_workers < 0)
+			Modes.net_workers = 0;
+	} else if (!strcmp(argv[j], "--in-readers") && more) {
+		Modes.net_readers = atoi(argv[++j]);
+		if (Modes.net_readers < 0)
+			Modes.net_readers = 0;
+	} else if (!strcmp(argv[j], "--reconnect-delay") && more) {
+		Modes.net_reconnect_min = strtoull(argv[++j], NULL, 10);
+		if (Modes.net_reconnect_min < 100)
+			Modes.net_reconnect_min = 100;
+	} else if (!strcmp(argv[j], "--reconnect-max") && more) {
+		Modes.net_reconnect_max = strtoull(argv[++j], NULL, 10);
+	} else if (!strcmp(argv[j], "--in-timeout") && more) {
+		Modes.net_input_timeout = strtoull(argv[++j], NULL, 10);
+	} else if (!strcmp(argv[j], "--tcp-keepalive") && more) {
+		Modes.net_keepalive = atoi(argv[++j]);
+		if (Modes.net_keepalive < 0)
+			Modes.net_keepalive = 0;
+	} else if (!strcmp(argv[j], "--dedup") && more) {
+		Modes.dedup_window = strtoull(argv[++j], NULL, 10);
+	} else if (!strcmp(argv[j], "--metrics") && more) {
+		fprintf(stderr, "METRICS: Starting server at %s:%s...\n", Modes.net_bind_address, argv[j+1]);
+		serviceListen(makeMetricsServiceEx(), Modes.net_bind_address, argv[++j]);
+	} else if (!strcmp(argv[j], "--latency")) {
+		Modes.net_latency = 1;
+	} else if (!strcmp(argv[j], "--record") && more) {
+		record = argv[++j];
+	} else if (!strcmp(argv[j], "--inReplay") && more) {
+		replay = argv[++j];
+	} else if (!strcmp(argv[j], "--speed") && more) {
+		replay_speed = atof(argv[++j]);
+	} else if (!strcmp(argv[j], "--replay-from") && more) {
+		replay_from = atof(argv[++j]);
+	} else if (!strcmp(argv[j], "--net-reuseport")) {
+		Modes.net_reuseport = 1;
+	} else if (!strcmp(argv[j], "--net-zerocopy")) {
+		Modes.net_zerocopy = 1;
+	} else if (!strcmp(argv[j], "--io-uring")) {
+		Modes.net_uring = 1;
 	} else if (!strcmp(argv[j],"--net-bind-address") && more) {
 	            free(Modes.net_bind_address);
 	            Modes.net_bind_address = strdup(argv[++j]);
@@ -210,14 +472,51 @@ if (!Modes.clients && !Modes.services) {
 	exit(1);	
 }
 
+if (Modes.net_reconnect_max < Modes.net_reconnect_min)
+	Modes.net_reconnect_max = Modes.net_reconnect_min;
+srandom(time(NULL) ^ getpid()); // reconnect jitter
+
+if (Modes.dedup_window && dedupInit(&Modes.dedup, Modes.dedup_window, MODES_DEDUP_ENTRIES) < 0) {
+	fprintf(stderr, "Out of memory allocating the duplicate filter\n");
+	exit(1);
+}
+
+if (record && !(Modes.capture = captureOpen(record)))
+	exit(1);
+if (replay) {
+	if (!(Modes.replay = replayOpen(replay, replay_speed, replay_from)))
+		exit(1);
+	if (replay_speed > 0)
+		fprintf(stderr, "INPUT: Replaying %s at %g times real time...\n", replay, replay_speed);
+	else
+		fprintf(stderr, "INPUT: Replaying %s as fast as possible...\n", replay);
+}
+
+modesInitFiltersEx();
+netStartWorkers();
+
 // Run it until we've lost either connection
 while (!Modes.exit) {
-	struct timespec r = { 0, 100 * 1000 * 1000 };
 	backgroundTasks();
-	nanosleep(&r, NULL);
 }
 
+netStopWorkers();
 freeBeastClients();
+if (Modes.capture) {
+	struct capture *cap = Modes.capture;
+	Modes.capture = NULL;
+	captureClose(cap);
+}
+if (Modes.replay) {
+	replayClose(Modes.replay);
+	Modes.replay = NULL;
+}
+if (Modes.dedup_window) {
+	fprintf(stderr, "Duplicate filter: %llu frames forwarded, %llu duplicates dropped\n",
+		(unsigned long long) Modes.dedup.unique, (unsigned long long) Modes.dedup.duplicates);
+	dedupFree(&Modes.dedup);
+}
+sbsFree(&Modes.sbs);
 return 0;
 }
 //
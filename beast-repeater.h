@@ -18,6 +18,7 @@
 #include <ctype.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/epoll.h>
 #include <time.h>
 #include <limits.h>
 #include <strings.h>
@@ -26,9 +27,15 @@
 
 #include "anet.h"
 #include "net_io.h"
+#include "dedup.h"
+#include "thin.h"
+#include "filter.h"
+#include "metrics.h"
+#include "capture.h"
+#include "encode.h"
 
 #define MODES_NET_HEARTBEAT_INTERVAL 60000      // milliseconds
-#define MODES_CLIENT_BUF_SIZE 1024
+#define MODES_CLIENT_BUF_SIZE 4096
 
 #define MODES_NON_ICAO_ADDRESS       (1<<24) // Set on addresses to indicate they are not ICAO addresses
 
@@ -37,9 +44,30 @@
 
 #define MODES_NET_HEARTBEAT_INTERVAL 60000      // milliseconds
 
-#define MODES_CLIENT_BUF_SIZE  1024
+#define MODES_CLIENT_BUF_SIZE  4096
 #define MODES_NET_SNDBUF_SIZE (1024*64)
 #define MODES_NET_SNDBUF_MAX  (7)
+#define MODES_NET_OUTQ_SIZE   (256*1024)  // default per-client output queue limit, bytes
+#define MODES_NET_OUTQ_AGE    30000       // default per-client output queue age limit, milliseconds
+#define MODES_NET_FLUSH_SIZE  1024        // default batch size that is sent at once, bytes
+#define MODES_NET_FLUSH_INTERVAL 50       // default longest wait in a throughput batch, milliseconds
+#define MODES_NET_MAX_IOV     64          // max segments written by one system call
+#define MODES_NET_RATE_MIN    256         // lowest --out-rate, bytes a second: a bucket must hold any message
+#define MODES_NET_WORKER_INBOX 4096       // messages queued from the main thread to each worker
+#define MODES_DEDUP_ENTRIES    65536     // payloads the duplicate filter can remember at once
+#define MODES_THIN_AIRCRAFT    8192      // aircraft an --out-thin output can keep track of at once
+#define MODES_NET_RECONNECT_MIN 1000     // ms before the first reconnect attempt
+#define MODES_NET_RECONNECT_MAX 60000    // ms ceiling for the reconnect backoff
+#define MODES_NET_INPUT_TIMEOUT (2 * MODES_NET_HEARTBEAT_INTERVAL) // ms of silence before an input is reconnected
+#define MODES_NET_KEEPALIVE    30        // s of idle before TCP keepalive probes start
+#define MODES_NET_CONNECT_DELAY 250      // ms before racing the next address of an outgoing connection
+#define MODES_NET_CONNECT_TIMEOUT 10000  // ms to resolve and connect before giving up
+#define MODES_NET_RESOLVER_QUEUE 64      // name lookups queued for the resolver thread
+#define MODES_NET_FANOUT_SIZE  65536      // frames queued from the input readers to the main thread
+#define MODES_NET_FANOUT_BATCH 4096       // frames the main thread takes from fanout per pass
+#define MODES_NET_URING_ENTRIES 4096      // --io-uring: submission queue size (completion queue 4x)
+#define MODES_NET_URING_BUFS   1024       // --io-uring: receive buffers shared by all sockets (power of two)
+#define MODES_NET_URING_BUF_SIZE 16384    // --io-uring: bytes per receive buffer
 
 #define MODES_LONG_MSG_BYTES     14
 #define MODES_SHORT_MSG_BYTES    7
@@ -68,6 +96,30 @@ struct _Modes {                             // Internal state
     char           aneterr[ANET_ERR_LEN];
     struct net_service *services;    // Active services
     struct client *clients;          // Our clients
+    int            epfd;             // epoll instance driving the network event loop
+    struct net_worker *workers;      // Output worker threads
+    int   net_workers;               // Number of output worker threads, 0 = everything on the main thread
+    struct net_worker *readers;      // Input reader threads
+    int   net_readers;               // Number of input reader threads, 0 = everything on the main thread
+    int   net_reuseport;             // Workers accept for themselves via SO_REUSEPORT listeners
+    struct mpsc_ring fanout;         // Frames from input readers, consumed by the main thread
+    int   fanoutfd;                  // eventfd signalled when frames are added to fanout
+    struct net_event fanout_ev;
+    struct net_resolver resolver;    // Name lookups for outgoing connections
+    struct uring *uring;             // --io-uring: the main thread's ring, NULL when it uses epoll alone
+    int   uringfd;                   // eventfd signalled when the ring posts completions
+    struct net_event uring_ev;
+    fanout_fn fanout_handler;        // What the main thread does with each frame from fanout
+    atomic_ullong fanout_stalls;     // Times a reader had to wait for room in fanout
+    pthread_mutex_t stats_lock;      // Guards stats_clients and the services' closed-client totals
+    struct net_client_stats *stats_clients; // Counters of every live client, see --metrics
+    int   net_latency;               // Measure forwarding latency (--latency)
+    struct net_latency *latency;     // --latency: per service (by id), recorded by the main thread
+    uint64_t net_ingress;            // --latency: read time of the message being forwarded, 0 = none
+    uint32_t net_ingress_wait;       // --latency: and how long it waited in the kernel
+    atomic_uint next_client_id;      // Last id given to a client
+    struct capture *capture;         // --record: where ingested frames are written, or NULL
+    struct replay *replay;           // --inReplay: capture being played back, or NULL
 
 #ifdef _WIN32
     WSADATA        wsaData;          // Windows socket initialisation
@@ -84,8 +136,21 @@ struct _Modes {                             // Internal state
     int   net;                       // Enable networking
     int   net_only;                  // Enable just networking
     uint64_t net_heartbeat_interval; // TCP heartbeat interval (milliseconds)
-    int   net_output_flush_size;     // Minimum Size of output data
-    uint64_t net_output_flush_interval; // Maximum interval (in milliseconds) between outputwrites
+    int   net_output_flush_size;     // Default: send a batch once it holds this many bytes (--out-flush-size)
+    uint64_t net_output_flush_interval; // Default: longest a batched message waits, in ms (--out-flush-time)
+    int   net_output_queue_size;     // Default per-client output queue limit (bytes)
+    uint64_t net_output_queue_age;   // Default per-client output queue age limit (milliseconds)
+    net_drop_policy_t net_output_drop_policy; // Default action on output queue overflow
+    net_format_t net_output_format;  // Default output encoding (--out-format)
+    int   net_output_compress;       // Default: compress output to every client (--out-compress)
+    net_flush_policy_t net_output_flush_policy; // Default: when outputs send their batch (--out-flush)
+    int   net_output_flush_urgent;   // Default: DF17/18 positions go out at once (--out-flush-urgent)
+    uint64_t net_output_rate;        // Default: output byte rate limit, per second (--out-rate, 0 = none)
+    uint64_t net_output_rate_msgs;   // Default: output message rate limit, per second (--out-rate-msgs, 0 = none)
+    uint64_t net_output_thin_interval; // Default: per-aircraft thinning interval, ms (--out-thin, 0 = none)
+    int   net_output_thin_limit;     // Default: messages per aircraft and category per interval (--out-thin-count)
+    int   net_input_compress;        // Default: --inConnect inputs ask for compression (--in-compress)
+    int   net_udp_ttl;               // Multicast TTL of --outUdp datagrams
     char *net_output_raw_ports;      // List of raw output TCP ports
     char *net_input_raw_ports;       // List of raw input TCP ports
     char *net_output_sbs_ports;      // List of SBS output TCP ports
@@ -94,6 +159,17 @@ struct _Modes {                             // Internal state
     char *net_output_beast_ports;    // List of Beast output TCP ports
     char *net_bind_address;          // Bind address
     int   net_sndbuf_size;           // TCP output buffer size (64Kb * 2^n)
+    int   net_zerocopy;              // Send output with MSG_ZEROCOPY where supported
+    int   net_uring;                 // Drive the main thread's sockets through io_uring (--io-uring)
+    uint64_t net_reconnect_min;      // First reconnect delay for --inConnect/--outConnect (milliseconds)
+    uint64_t net_reconnect_max;      // Ceiling for the exponential reconnect backoff (milliseconds)
+    uint64_t net_input_timeout;      // Reconnect an --inConnect input silent for this long (milliseconds, 0 = never)
+    int   net_keepalive;             // TCP keepalive idle time for outgoing connections (seconds, 0 = off)
+    uint64_t dedup_window;           // Drop repeats of a Mode S frame seen within this long (milliseconds, 0 = off)
+    struct dedup_table dedup;        // Recently forwarded payloads, used by the main thread only
+    char *net_output_filter;         // --out-filter for outputs that don't have their own
+    struct net_filter *filters;      // Every compiled output filter, evaluated once per frame
+    struct sbs_state sbs;            // Aircraft known to the SBS encoder, used by the main thread only
     int   net_verbatim;              // if true, Beast output connections default to verbatim mode
     int   forward_mlat;              // allow forwarding of mlat messages to output ports
     int   quiet;                     // Suppress stdout
@@ -0,0 +1,227 @@
+// Part of dump1090, a Mode S message decoder for RTLSDR devices.
+//
+// beast_scan.c: vectorized scanning of Beast binary input
+//
+// This file is free software: you may copy, redistribute and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation, either version 2 of the License, or (at your
+// option) any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "beast_scan.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BEAST_SCAN_X86
+#elif defined(__ARM_NEON) || defined(__aarch64__)
+#include <arm_neon.h>
+#define BEAST_SCAN_NEON
+#endif
+
+const struct beast_frame_type beastFrameTypes[256] = {
+    ['1']  = { 7,  2 },    // Mode A/C
+    ['2']  = { 7,  7 },    // Mode S short
+    ['3']  = { 7, 14 },    // Mode S long
+    ['4']  = { 7, 14 },    // receiver status
+    ['5']  = { 7, 21 },    // Mode S long with extended data
+    [0xe3] = { 0,  8 },    // receiver id, no timestamp
+};
+
+// Mask for the bytes of a final partial block
+static uint64_t scanTail(const unsigned char *buf, size_t len)
+{
+    uint64_t bits = 0;
+    size_t i;
+
+    for (i = 0; i < len; ++i) {
+        if (buf[i] == 0x1a)
+            bits |= (uint64_t) 1 << i;
+    }
+    return bits;
+}
+
+static void scanScalar(const unsigned char *buf, size_t len, uint64_t *mask)
+{
+    size_t w;
+
+    for (w = 0; w * 64 < len; ++w)
+        mask[w] = scanTail(buf + w * 64, len - w * 64 < 64 ? len - w * 64 : 64);
+}
+
+#ifdef BEAST_SCAN_X86
+static void scanSSE2(const unsigned char *buf, size_t len, uint64_t *mask)
+{
+    const __m128i esc = _mm_set1_epi8(0x1a);
+    size_t w;
+
+    for (w = 0; (w + 1) * 64 <= len; ++w) {
+        const unsigned char *p = buf + w * 64;
+        uint64_t b0 = (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (p +  0)), esc));
+        uint64_t b1 = (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (p + 16)), esc));
+        uint64_t b2 = (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (p + 32)), esc));
+        uint64_t b3 = (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (p + 48)), esc));
+
+        mask[w] = b0 | (b1 << 16) | (b2 << 32) | (b3 << 48);
+    }
+
+    if (w * 64 < len)
+        mask[w] = scanTail(buf + w * 64, len - w * 64);
+}
+
+__attribute__((target("avx2")))
+static void scanAVX2(const unsigned char *buf, size_t len, uint64_t *mask)
+{
+    const __m256i esc = _mm256_set1_epi8(0x1a);
+    size_t w;
+
+    for (w = 0; (w + 1) * 64 <= len; ++w) {
+        const unsigned char *p = buf + w * 64;
+        uint64_t lo = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) p), esc));
+        uint64_t hi = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (p + 32)), esc));
+
+        mask[w] = lo | (hi << 32);
+    }
+
+    if (w * 64 < len)
+        mask[w] = scanTail(buf + w * 64, len - w * 64);
+}
+#endif
+
+#ifdef BEAST_SCAN_NEON
+// NEON has no movemask: weight each lane's compare result by its bit
+// position and add across each half
+static inline uint64_t neonMask16(const unsigned char *p, uint8x16_t esc, uint8x16_t weights)
+{
+    uint8x16_t m = vandq_u8(vceqq_u8(vld1q_u8(p), esc), weights);
+    return (uint64_t) vaddv_u8(vget_low_u8(m)) | ((uint64_t) vaddv_u8(vget_high_u8(m)) << 8);
+}
+
+static void scanNEON(const unsigned char *buf, size_t len, uint64_t *mask)
+{
+    static const uint8_t w8[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+    const uint8x16_t esc = vdupq_n_u8(0x1a);
+    const uint8x16_t weights = vld1q_u8(w8);
+    size_t w;
+
+    for (w = 0; (w + 1) * 64 <= len; ++w) {
+        const unsigned char *p = buf + w * 64;
+
+        mask[w] = neonMask16(p, esc, weights) |
+            (neonMask16(p + 16, esc, weights) << 16) |
+            (neonMask16(p + 32, esc, weights) << 32) |
+            (neonMask16(p + 48, esc, weights) << 48);
+    }
+
+    if (w * 64 < len)
+        mask[w] = scanTail(buf + w * 64, len - w * 64);
+}
+#endif
+
+#if defined(BEAST_SCAN_X86)
+static void (*scanImpl)(const unsigned char *, size_t, uint64_t *) = scanSSE2;
+static const char *scanName = "sse2";
+#elif defined(BEAST_SCAN_NEON)
+static void (*scanImpl)(const unsigned char *, size_t, uint64_t *) = scanNEON;
+static const char *scanName = "neon";
+#else
+static void (*scanImpl)(const unsigned char *, size_t, uint64_t *) = scanScalar;
+static const char *scanName = "scalar";
+#endif
+
+void beastScanInit(void)
+{
+#ifdef BEAST_SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        scanImpl = scanAVX2;
+        scanName = "avx2";
+    }
+#endif
+    // keep the scalar version referenced on every platform
+    (void) scanScalar;
+}
+
+const char *beastScanName(void)
+{
+    return scanName;
+}
+
+void beastScanMask(const unsigned char *buf, size_t len, uint64_t *mask)
+{
+    scanImpl(buf, len, mask);
+}
+
+size_t beastUnescape(const unsigned char *buf, const uint64_t *mask, size_t pos, size_t end, unsigned char *dst)
+{
+    unsigned char *out = dst;
+
+    while (pos < end) {
+        size_t e = beastNextEscape(mask, pos, end);
+
+        // copy the run up to and including the 0x1a, skip its double
+        if (e < end) {
+            memcpy(out, buf + pos, e - pos + 1);
+            out += e - pos + 1;
+            pos = e + 2;
+        } else {
+            memcpy(out, buf + pos, end - pos);
+            out += end - pos;
+            pos = end;
+        }
+    }
+
+    return (size_t) (out - dst);
+}
+
+int beastFrameAt(const unsigned char *buf, const uint64_t *mask, size_t pos, size_t len, struct beast_frame *frame)
+{
+    const struct beast_frame_type *t;
+    size_t payload, end, e;
+
+    if (pos + 1 >= len)
+        return 0;
+
+    t = &beastFrameTypes[buf[pos + 1]];
+    if (!t->payload)
+        return -1;
+
+    // the type byte is never 0x1a, so the escaped part starts right after
+    payload = beastSpan(mask, pos + 2, t->stamped, len);
+    end = beastSpan(mask, payload, t->payload, len);
+    if (end > len)
+        return 0;
+
+    // Every 0x1a inside a frame is doubled. A lone one is the start of the
+    // next frame, so this one was cut short: skip it and resync there.
+    for (e = beastNextEscape(mask, pos + 2, end); e < end; e = beastNextEscape(mask, e + 2, end)) {
+        if (!((mask[(e + 1) / 64] >> ((e + 1) % 64)) & 1))
+            return -1;
+    }
+
+    frame->type = buf[pos + 1];
+    frame->raw = (char *) buf + pos;
+    frame->raw_len = (int) (end - pos);
+    frame->payload_offset = (int) (payload - pos);
+    frame->payload_len = t->payload;
+    return 1;
+}
+
+void beastFramePayload(const struct beast_frame *frame, unsigned char *out)
+{
+    const unsigned char *p = (const unsigned char *) frame->raw + frame->payload_offset;
+    int i;
+
+    for (i = 0; i < frame->payload_len; ++i) {
+        out[i] = *p;
+        p += (*p == 0x1a) ? 2 : 1;
+    }
+}
@@ -0,0 +1,118 @@
+// Part of dump1090, a Mode S message decoder for RTLSDR devices.
+//
+// beast_scan.h: vectorized scanning of Beast binary input
+//
+// This file is free software: you may copy, redistribute and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation, either version 2 of the License, or (at your
+// option) any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef DUMP1090_BEAST_SCAN_H
+#define DUMP1090_BEAST_SCAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// In Beast binary every frame starts with 0x1a, and a 0x1a inside a frame
+// is sent doubled. Rather than look at the input a byte at a time, the
+// scanner marks every 0x1a in a block with one bit per byte (bit i % 64 of
+// word i / 64), a vector compare at a time. Frame starts, frame ends and
+// escapes are then found with bit operations on the mask.
+
+#define BEAST_MASK_WORDS(len) (((len) + 63) / 64)
+
+// Layout of each Beast frame type, indexed by the type byte that follows
+// the leading 0x1a. Types with no payload are not frames.
+struct beast_frame_type {
+    uint8_t stamped;    // bytes of timestamp and signal level ahead of the payload
+    uint8_t payload;    // bytes of payload
+};
+
+extern const struct beast_frame_type beastFrameTypes[256];
+
+// The longest frame possible on the wire, with every byte after the type
+// escaped
+#define BEAST_FRAME_MAX (2 + 2 * (7 + 21))
+
+// One frame, as found in the input by the framer
+struct beast_frame {
+    unsigned char type;
+    char *raw;          // the frame as received, starting with the 0x1a
+    int raw_len;        // escaped length of the whole frame
+    int payload_offset; // offset in raw of the first payload byte
+    int payload_len;    // unescaped length of the payload
+};
+
+// Pick the fastest scanner the CPU supports. Call once before any threads
+// start; until then a baseline implementation is used.
+void beastScanInit(void);
+
+// Name of the scanner in use ("avx2", "sse2", "neon" or "scalar")
+const char *beastScanName(void);
+
+// Mark every 0x1a in buf[0..len) in mask, which must have room for
+// BEAST_MASK_WORDS(len) words. Bits past len are cleared.
+void beastScanMask(const unsigned char *buf, size_t len, uint64_t *mask);
+
+// Offset of the first 0x1a at or after pos, or len if there is none
+static inline size_t beastNextEscape(const uint64_t *mask, size_t pos, size_t len)
+{
+    size_t w = pos / 64;
+    uint64_t bits;
+
+    if (pos >= len)
+        return len;
+
+    bits = mask[w] & (~(uint64_t) 0 << (pos % 64));
+    while (!bits) {
+        if (++w >= BEAST_MASK_WORDS(len))
+            return len;
+        bits = mask[w];
+    }
+
+    pos = w * 64 + (size_t) __builtin_ctzll(bits);
+    return pos < len ? pos : len;
+}
+
+// Offset one past the end of 'n' unescaped bytes starting at pos, taking
+// doubled 0x1a into account. The result may be beyond len, in which case
+// the data is incomplete.
+static inline size_t beastSpan(const uint64_t *mask, size_t pos, size_t n, size_t len)
+{
+    while (n) {
+        size_t e = beastNextEscape(mask, pos, len);
+
+        if (e - pos >= n)
+            return pos + n;
+
+        // bytes up to and including the 0x1a are data, the byte after
+        // it is the doubling
+        n -= e - pos + 1;
+        pos = e + 2;
+    }
+    return pos;
+}
+
+// Describe the frame that starts with the 0x1a at buf[pos].
+// Returns 1 if a whole frame is there, 0 if more data is needed, or -1 if
+// the 0x1a isn't followed by a known frame type or the frame holds a 0x1a
+// that isn't doubled
+int beastFrameAt(const unsigned char *buf, const uint64_t *mask, size_t pos, size_t len, struct beast_frame *frame);
+
+// Copy the unescaped payload of a frame to out, which needs room for
+// frame->payload_len bytes
+void beastFramePayload(const struct beast_frame *frame, unsigned char *out);
+
+// Copy the unescaped bytes of buf[pos..end) to dst, which needs room for
+// end - pos bytes. Returns the number of bytes written.
+size_t beastUnescape(const unsigned char *buf, const uint64_t *mask, size_t pos, size_t end, unsigned char *dst);
+
+#endif
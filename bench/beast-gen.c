@@ -0,0 +1,255 @@
+// Part of dump1090, a Mode S message decoder for RTLSDR devices.
+//
+// beast-gen.c: synthetic Beast traffic generator for benchmarking
+//
+// This file is free software: you may copy, redistribute and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation, either version 2 of the License, or (at your
+// option) any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// Opens a number of connections to a Beast input and feeds them a
+// realistic mix of Mode S and Mode A/C frames at a fixed total rate. The
+// 48-bit timestamp of every frame holds the CLOCK_MONOTONIC time it was
+// sent, in microseconds, so that beast-sink can work out the latency.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "../util.h"
+
+#define GEN_TICK_US     1000    // pacing interval
+#define GEN_AIRCRAFT    500     // distinct addresses in the traffic
+#define GEN_BUF_SIZE    (256 * 1024)
+#define GEN_FRAME_MAX   (2 + 2 * (6 + 1 + 14)) // longest frame, every byte escaped
+
+static volatile sig_atomic_t stop;
+
+static void onSignal(int sig)
+{
+    (void) sig;
+    stop = 1;
+}
+
+static int connectTo(const char *hostport)
+{
+    char host[256], *port;
+    struct addrinfo hints, *res, *ai;
+    int fd = -1, one = 1;
+
+    snprintf(host, sizeof(host), "%s", hostport);
+    if (!(port = strrchr(host, ':'))) {
+        fprintf(stderr, "expected host:port, not %s\n", hostport);
+        exit(1);
+    }
+    *port++ = 0;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &res) != 0) {
+        fprintf(stderr, "can't resolve %s\n", hostport);
+        exit(1);
+    }
+    for (ai = res; ai; ai = ai->ai_next) {
+        if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0)
+            continue;
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+
+    if (fd < 0) {
+        fprintf(stderr, "can't connect to %s: %s\n", hostport, strerror(errno));
+        exit(1);
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+static uint32_t aircraft[GEN_AIRCRAFT];
+
+// Append one frame to out, escaping as we go. Returns the bytes written.
+static int makeFrame(unsigned char *out, uint64_t now, int escapes)
+{
+    unsigned char body[6 + 1 + 14];
+    int r = random() % 100;
+    int type, plen, i, n = 0;
+    uint32_t addr = aircraft[random() % GEN_AIRCRAFT];
+
+    // Roughly what a busy receiver hears: mostly DF17 and DF11, a fair
+    // share of surveillance replies, a little Mode A/C
+    if (r < 40) {
+        type = '3'; plen = 14;
+        body[7] = 0x8d;                         // DF17, CA5
+    } else if (r < 65) {
+        type = '2'; plen = 7;
+        body[7] = 0x5d;                         // DF11, CA5
+    } else if (r < 90) {
+        static const unsigned char dfs[] = { 0x20, 0x28, 0xa0, 0xa8 }; // DF4, 5, 20, 21
+        body[7] = dfs[random() % 4];
+        type = (body[7] & 0x80) ? '3' : '2';
+        plen = (body[7] & 0x80) ? 14 : 7;
+    } else {
+        type = '1'; plen = 2;
+    }
+
+    for (i = 0; i < 6; ++i)
+        body[i] = (now >> (40 - 8 * i)) & 0xff;
+    body[6] = 0x40 + random() % 0xa0;           // signal level
+
+    if (type == '1') {
+        body[7] = random() & 0xff;
+        body[8] = random() & 0xff;
+    } else {
+        body[8] = addr >> 16;
+        body[9] = addr >> 8;
+        body[10] = addr;
+        for (i = 11; i < 7 + plen; ++i)
+            body[i] = random() & 0xff;
+    }
+
+    // Some feeds are full of 0x1a; salt the payload to match
+    if (escapes && (int) (random() % 100) < escapes)
+        body[7 + 1 + random() % (plen - 1)] = 0x1a;
+
+    out[n++] = 0x1a;
+    out[n++] = type;
+    for (i = 0; i < 7 + plen; ++i) {
+        out[n++] = body[i];
+        if (body[i] == 0x1a)
+            out[n++] = 0x1a;
+    }
+    return n;
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "beast-gen [options]\n"
+            "-c <host:port>   Beast input to feed (default 127.0.0.1:30004)\n"
+            "-n <conns>       Connections, each a separate feeder (default 1)\n"
+            "-r <frames/s>    Total rate, 0 = as fast as possible (default 10000)\n"
+            "-d <seconds>     How long to run (default 10)\n"
+            "-e <percent>     Frames with a 0x1a in the payload (default 20)\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    const char *target = "127.0.0.1:30004";
+    int nconns = 1, escapes = 20, seconds = 10;
+    double rate = 10000;
+    int *fds, i, opt;
+    unsigned char *buf;
+    uint64_t start, end, next, sent = 0;
+    double owed = 0;
+
+    while ((opt = getopt(argc, argv, "c:n:r:d:e:h")) != -1) {
+        switch (opt) {
+        case 'c': target = optarg; break;
+        case 'n': nconns = atoi(optarg); break;
+        case 'r': rate = atof(optarg); break;
+        case 'd': seconds = atoi(optarg); break;
+        case 'e': escapes = atoi(optarg); break;
+        default: usage();
+        }
+    }
+    if (nconns < 1 || seconds < 1)
+        usage();
+
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+    signal(SIGPIPE, SIG_IGN);
+    srandom(getpid());
+
+    for (i = 0; i < GEN_AIRCRAFT; ++i)
+        aircraft[i] = random() & 0xffffff;
+
+    if (!(fds = calloc(nconns, sizeof(int))) || !(buf = malloc(GEN_BUF_SIZE))) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    for (i = 0; i < nconns; ++i)
+        fds[i] = connectTo(target);
+
+    start = next = monotonic_usecs();
+    end = start + (uint64_t) seconds * 1000000;
+
+    // Every tick each connection gets its share of the frames owed
+    while (!stop) {
+        uint64_t now = monotonic_usecs();
+        int batch;
+
+        if (now >= end)
+            break;
+
+        if (rate > 0) {
+            struct timespec ts;
+
+            if (now < next) {
+                ts.tv_sec = (next - now) / 1000000;
+                ts.tv_nsec = ((next - now) % 1000000) * 1000;
+                nanosleep(&ts, NULL);
+                now = monotonic_usecs();
+            }
+            owed += rate * (now - (next - GEN_TICK_US)) / 1e6;
+            next = now + GEN_TICK_US;
+        } else {
+            owed = 1000.0 * nconns;
+        }
+
+        batch = (int) (owed / nconns);
+        if (batch < 1)
+            continue;
+        if (batch > GEN_BUF_SIZE / GEN_FRAME_MAX)
+            batch = GEN_BUF_SIZE / GEN_FRAME_MAX;
+        owed -= (double) batch * nconns;
+
+        for (i = 0; i < nconns && !stop; ++i) {
+            size_t len = 0, off = 0;
+            int k;
+
+            for (k = 0; k < batch; ++k)
+                len += makeFrame(buf + len, now, escapes);
+            while (off < len) {
+                ssize_t w = write(fds[i], buf + off, len - off);
+                if (w < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    fprintf(stderr, "write: %s\n", strerror(errno));
+                    return 1;
+                }
+                off += w;
+            }
+            sent += batch;
+        }
+    }
+
+    end = monotonic_usecs();
+    printf("sent=%llu seconds=%.3f rate=%.0f\n", (unsigned long long) sent,
+           (end - start) / 1e6, sent / ((end - start) / 1e6));
+
+    for (i = 0; i < nconns; ++i)
+        close(fds[i]);
+    return 0;
+}
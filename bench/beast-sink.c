@@ -0,0 +1,262 @@
+// Part of dump1090, a Mode S message decoder for RTLSDR devices.
+//
+// beast-sink.c: counting Beast receiver for benchmarking
+//
+// This file is free software: you may copy, redistribute and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation, either version 2 of the License, or (at your
+// option) any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// Opens a number of connections to a Beast output and counts the frames
+// that arrive on them, using the repeater's own framer. Frames stamped by
+// beast-gen (see there) also give the end-to-end latency, which goes into
+// a log-linear histogram.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#include "../util.h"
+#include "../beast_scan.h"
+#include "../hist.h"
+
+#define SINK_BUF_SIZE   (64 * 1024)
+#define SINK_IDLE_US    2000000 // stop this long after the traffic dries up
+
+struct conn {
+    int fd;
+    size_t len;
+    uint64_t frames;
+    unsigned char buf[SINK_BUF_SIZE];
+};
+
+static volatile sig_atomic_t stop;
+static struct hist latency;
+
+static void onSignal(int sig)
+{
+    (void) sig;
+    stop = 1;
+}
+
+static int connectTo(const char *hostport)
+{
+    char host[256], *port;
+    struct addrinfo hints, *res, *ai;
+    int fd = -1;
+
+    snprintf(host, sizeof(host), "%s", hostport);
+    if (!(port = strrchr(host, ':'))) {
+        fprintf(stderr, "expected host:port, not %s\n", hostport);
+        exit(1);
+    }
+    *port++ = 0;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &res) != 0) {
+        fprintf(stderr, "can't resolve %s\n", hostport);
+        exit(1);
+    }
+    for (ai = res; ai; ai = ai->ai_next) {
+        if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0)
+            continue;
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+
+    if (fd < 0) {
+        fprintf(stderr, "can't connect to %s: %s\n", hostport, strerror(errno));
+        exit(1);
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+// Count the complete frames in a connection's buffer, keeping any partial
+// frame for next time
+static void consume(struct conn *c, uint64_t now)
+{
+    uint64_t mask[BEAST_MASK_WORDS(SINK_BUF_SIZE)];
+    struct beast_frame frame;
+    size_t pos = 0, keep = c->len;
+    int found;
+
+    beastScanMask(c->buf, c->len, mask);
+
+    while ((pos = beastNextEscape(mask, pos, c->len)) < c->len) {
+        unsigned char ts[6];
+        uint64_t sent = 0;
+        int i;
+
+        keep = pos;
+        if ((found = beastFrameAt(c->buf, mask, pos, c->len, &frame)) < 0) {
+            ++pos;
+            continue;
+        }
+        if (!found)
+            break;
+
+        beastUnescape(c->buf, mask, pos + 2, beastSpan(mask, pos + 2, 6, c->len), ts);
+        for (i = 0; i < 6; ++i)
+            sent = (sent << 8) | ts[i];
+
+        // heartbeats have a zero timestamp
+        if (sent) {
+            c->frames++;
+            histRecord(&latency, now > sent ? now - sent : 0, 1);
+        }
+
+        pos += frame.raw_len;
+        keep = pos;
+    }
+
+    if (pos >= c->len)
+        keep = c->len;
+    memmove(c->buf, c->buf + keep, c->len - keep);
+    c->len -= keep;
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "beast-sink [options]\n"
+            "-c <host:port>   Beast output to read (default 127.0.0.1:30005)\n"
+            "-n <conns>       Connections (default 1)\n"
+            "-d <seconds>     Give up after this long (default 60)\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    const char *target = "127.0.0.1:30005";
+    int nconns = 1, seconds = 60, epfd, i, opt;
+    struct conn **conns;
+    struct epoll_event events[64];
+    struct hist_snapshot *snap;
+    struct rlimit rl;
+    uint64_t start, first = 0, last = 0, total = 0, minconn = UINT64_MAX;
+
+    while ((opt = getopt(argc, argv, "c:n:d:h")) != -1) {
+        switch (opt) {
+        case 'c': target = optarg; break;
+        case 'n': nconns = atoi(optarg); break;
+        case 'd': seconds = atoi(optarg); break;
+        default: usage();
+        }
+    }
+    if (nconns < 1 || seconds < 1)
+        usage();
+
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+    beastScanInit();
+
+    // a wide fan-out needs more descriptors than the usual soft limit
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    if ((epfd = epoll_create1(0)) < 0 || !(conns = calloc(nconns, sizeof(*conns)))) {
+        fprintf(stderr, "setup failed: %s\n", strerror(errno));
+        return 1;
+    }
+    for (i = 0; i < nconns; ++i) {
+        struct epoll_event ev;
+
+        if (!(conns[i] = calloc(1, sizeof(struct conn)))) {
+            fprintf(stderr, "out of memory\n");
+            return 1;
+        }
+        conns[i]->fd = connectTo(target);
+        ev.events = EPOLLIN;
+        ev.data.ptr = conns[i];
+        epoll_ctl(epfd, EPOLL_CTL_ADD, conns[i]->fd, &ev);
+    }
+
+    // tell whoever started us that everything is connected
+    printf("ready\n");
+    fflush(stdout);
+
+    start = monotonic_usecs();
+    while (!stop) {
+        uint64_t now = monotonic_usecs();
+        int n;
+
+        if (now - start > (uint64_t) seconds * 1000000)
+            break;
+        if (first && now - last > SINK_IDLE_US)
+            break;
+
+        if ((n = epoll_wait(epfd, events, 64, 100)) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        now = monotonic_usecs();
+        for (i = 0; i < n; ++i) {
+            struct conn *c = events[i].data.ptr;
+            ssize_t r;
+
+            while ((r = read(c->fd, c->buf + c->len, SINK_BUF_SIZE - c->len)) > 0) {
+                uint64_t before = c->frames;
+
+                c->len += r;
+                consume(c, now);
+                total += c->frames - before;
+                if (c->frames != before) {
+                    if (!first)
+                        first = now;
+                    last = now;
+                }
+                if (c->len == SINK_BUF_SIZE)
+                    c->len = 0; // garbage; resync
+            }
+            if (r == 0) {
+                epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+                close(c->fd);
+                c->fd = -1;
+            }
+        }
+    }
+
+    for (i = 0; i < nconns; ++i) {
+        if (conns[i]->frames < minconn)
+            minconn = conns[i]->frames;
+    }
+
+    if (!(snap = calloc(1, sizeof(*snap)))) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    histMerge(snap, &latency);
+    printf("received=%llu conns=%d min_per_conn=%llu seconds=%.3f rate=%.0f p50_us=%llu p99_us=%llu p999_us=%llu max_us=%llu\n",
+           (unsigned long long) total, nconns, (unsigned long long) minconn,
+           (last - first) / 1e6, last > first ? total / ((last - first) / 1e6) : 0.0,
+           (unsigned long long) histQuantile(snap, 0.5), (unsigned long long) histQuantile(snap, 0.99),
+           (unsigned long long) histQuantile(snap, 0.999), (unsigned long long) histQuantile(snap, 1.0));
+    return 0;
+}
@@ -0,0 +1,145 @@
+// Part of dump1090, a Mode S message decoder for RTLSDR devices.
+//
+// fuzz-framing.c: fuzz target for the Beast framer and output path
+//
+// This file is free software: you may copy, redistribute and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation, either version 2 of the License, or (at your
+// option) any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// The first byte of each input picks the read size (1 to 256 bytes), so
+// frames get split at every possible point; the rest goes through an
+// input client, through handleBeastMessage() and out to a filtered and an
+// unfiltered Beast output, to AVR raw and SBS outputs and to a compressed
+// output. The input takes compressed streams, as an --in-compress one
+// does, so a 0x1a 'Z' switches it to decompressing the rest. Every frame
+// the framer hands over is checked against the frame-type table
+// independently of the framer, and the program aborts on a mismatch.
+//
+// Built with -DFUZZ_LIBFUZZER this is a libFuzzer target. Otherwise it has
+// a main() that runs each file named on the command line, or stdin, once:
+// that suits AFL, and replaying crashes under gdb.
+
+#include "harness.h"
+
+static struct client *input;
+static struct net_service *service;
+static int feed;
+
+static void fail(const struct beast_frame *frame, const char *why)
+{
+    int i;
+
+    fprintf(stderr, "bad frame (%s):", why);
+    for (i = 0; i < frame->raw_len && i < BEAST_FRAME_MAX; ++i)
+        fprintf(stderr, " %02x", (unsigned char) frame->raw[i]);
+    fprintf(stderr, "\n");
+    abort();
+}
+
+static int checkFrame(struct client *c, const struct beast_frame *frame)
+{
+    const unsigned char *raw = (const unsigned char *) frame->raw;
+    const struct beast_frame_type *t = &beastFrameTypes[frame->type];
+    const char *data = readbufData(&c->rbuf);
+    int i, n = 0;
+
+    if (frame->raw < data || frame->raw + frame->raw_len > data + c->rbuf.len)
+        fail(frame, "outside the read buffer");
+    if (frame->raw_len < 2 || frame->raw_len > BEAST_FRAME_MAX || raw[0] != 0x1a || raw[1] != frame->type)
+        fail(frame, "bad header");
+    if (!t->payload || frame->payload_len != t->payload)
+        fail(frame, "payload length doesn't match the type");
+
+    // Count the unescaped bytes after the type: every 0x1a must be doubled
+    for (i = 2; i < frame->raw_len; ++n) {
+        if (n == t->stamped && i != frame->payload_offset)
+            fail(frame, "payload offset");
+        if (raw[i] == 0x1a) {
+            if (i + 1 >= frame->raw_len || raw[i + 1] != 0x1a)
+                fail(frame, "lone 0x1a");
+            i += 2;
+        } else {
+            ++i;
+        }
+    }
+    if (n != t->stamped + t->payload)
+        fail(frame, "frame length doesn't match the type");
+
+    return handleBeastMessage(c, frame);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    if (!input) {
+        harnessInit();
+        input = harnessInput(checkFrame, &feed);
+        service = input->service;
+        service->accept_compression = 1;
+        harnessOutput(1, NULL);
+        harnessOutput(1, "df=17,18 mlat=no");
+        harnessOutput(1, NULL)->format = NET_FORMAT_RAW;
+        harnessOutput(1, NULL)->format = NET_FORMAT_SBS;
+        Modes.net_output_compress = 1;
+        harnessOutput(1, NULL);
+        Modes.net_output_compress = 0;
+        modesInitFiltersEx();
+    }
+    if (!size)
+        return 0;
+
+    harnessFeed(input, feed, data + 1, size - 1, 1 + data[0]);
+
+    // An input that turned compressed, or was closed for bad compressed
+    // data, is replaced by a new connection
+    if (input->inflate || !input->service) {
+        close(feed);
+        if (input->service)
+            modesReadFromClient(input); // sees the EOF
+        input = harnessConnect(service, &feed);
+    }
+    harnessDrain();
+
+    // Each input starts from an empty buffer
+    readbufConsume(&input->rbuf, input->rbuf.len);
+    return 0;
+}
+
+#ifndef FUZZ_LIBFUZZER
+static void runFile(FILE *f)
+{
+    static uint8_t buf[1 << 20];
+    size_t len = fread(buf, 1, sizeof(buf), f);
+
+    LLVMFuzzerTestOneInput(buf, len);
+}
+
+int main(int argc, char **argv)
+{
+    int i;
+
+    if (argc < 2)
+        runFile(stdin);
+    for (i = 1; i < argc; ++i) {
+        FILE *f = fopen(argv[i], "rb");
+
+        if (!f) {
+            fprintf(stderr, "%s: %s\n", argv[i], strerror(errno));
+            return 1;
+        }
+        runFile(f);
+        fclose(f);
+    }
+    return 0;
+}
+#endif
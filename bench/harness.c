@@ -0,0 +1,200 @@
+// Part of dump1090, a Mode S message decoder for RTLSDR devices.
+//
+// harness.c: drive the repeater's input and output paths in-process
+//
+// This file is free software: you may copy, redistribute and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation, either version 2 of the License, or (at your
+// option) any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <sys/socket.h>
+
+#include "harness.h"
+#include "../util.h"
+
+struct _Modes Modes;
+
+static int *peers;      // far ends of the output subscribers
+static int npeers;
+
+static void harnessSocketpair(int sv[2])
+{
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, sv) < 0) {
+        fprintf(stderr, "socketpair: %s\n", strerror(errno));
+        exit(1);
+    }
+}
+
+void harnessInit(void)
+{
+    // Starting over: the subscribers of earlier outputs go quiet
+    while (npeers)
+        close(peers[--npeers]);
+
+    memset(&Modes, 0, sizeof(Modes));
+    Modes.mode_ac = 1;
+    Modes.forward_mlat = 1;
+    Modes.net = 1;
+    Modes.net_output_flush_size = 1024;
+    Modes.net_output_flush_interval = 50;
+    Modes.net_output_queue_size = MODES_NET_OUTQ_SIZE;
+    Modes.net_output_queue_age = MODES_NET_OUTQ_AGE;
+    Modes.net_output_drop_policy = NET_DROP_DISCONNECT;
+    modesInitNetEx();
+}
+
+struct client *harnessInput(frame_fn handler, int *feed)
+{
+    return harnessConnect(makeBeastServerInputServiceEx(handler), feed);
+}
+
+struct client *harnessConnect(struct net_service *service, int *feed)
+{
+    int sv[2];
+
+    harnessSocketpair(sv);
+    *feed = sv[1];
+    return createSocketClient(service, sv[0]);
+}
+
+struct net_writer *harnessOutput(int subscribers, char *filter)
+{
+    struct net_service *service;
+    struct net_writer *writer;
+    int i, sv[2];
+
+    if (!(writer = calloc(1, sizeof(*writer))) ||
+        !(peers = realloc(peers, (npeers + subscribers) * sizeof(int)))) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    writer->filter_spec = filter;
+    service = makeBeastServerOutputServiceEx(writer);
+
+    for (i = 0; i < subscribers; ++i) {
+        harnessSocketpair(sv);
+        createSocketClient(service, sv[0]);
+        peers[npeers++] = sv[1];
+    }
+    return writer;
+}
+
+int harnessFeed(struct client *c, int feed, const unsigned char *data, size_t len, size_t chunk)
+{
+    while (len) {
+        if (!c->service)
+            return -1;
+
+        ssize_t n = write(feed, data, len < chunk ? len : chunk);
+
+        if (n < 0 && errno != EAGAIN) {
+            fprintf(stderr, "write: %s\n", strerror(errno));
+            exit(1);
+        }
+        if (n > 0) {
+            data += n;
+            len -= n;
+        }
+        modesReadFromClient(c);
+    }
+    return 0;
+}
+
+size_t harnessDrain(void)
+{
+    struct net_service *s;
+    struct epoll_event events[64];
+    char scratch[65536];
+    size_t total = 0, got;
+    ssize_t n;
+    int i;
+
+    for (s = Modes.services; s; s = s->next) {
+        if (s->writer && s->writer->dataUsed)
+            flushWrites(s->writer);
+    }
+
+    // Keep going until the subscribers' queues are empty: reading makes
+    // room in the sockets, and the event loop then sends what was queued
+    do {
+        got = 0;
+        for (i = 0; i < npeers; ++i) {
+            while ((n = read(peers[i], scratch, sizeof(scratch))) > 0)
+                got += n;
+        }
+        if ((n = epoll_wait(Modes.epfd, events, 64, 0)) > 0)
+            netHandleEvents(events, n);
+        total += got;
+    } while (got);
+
+    netReapClients(&Modes.clients, mstime());
+    return total;
+}
+
+static uint64_t harnessRandom(void)
+{
+    static uint64_t x = 0x9e3779b97f4a7c15ULL;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return x;
+}
+
+size_t harnessFrames(unsigned char *buf, size_t size, int escapes, int garbage, size_t *frames)
+{
+    size_t used = 0;
+
+    *frames = 0;
+    for (;;) {
+        unsigned char body[6 + 1 + 14];
+        int r = harnessRandom() % 100;
+        int type, len, junk = 0, i;
+
+        if (r < 40) {
+            type = '3'; len = 7 + 14; body[7] = 0x8d;   // DF17
+        } else if (r < 65) {
+            type = '2'; len = 7 + 7; body[7] = 0x5d;    // DF11
+        } else if (r < 90) {
+            type = '2'; len = 7 + 7; body[7] = 0x20;    // DF4
+        } else {
+            type = '1'; len = 7 + 2; body[7] = harnessRandom();
+        }
+        for (i = 0; i < len; ++i) {
+            if (i != 7)
+                body[i] = harnessRandom();
+            if ((int) (harnessRandom() % 100) < escapes)
+                body[i] = 0x1a;
+        }
+
+        if ((int) (harnessRandom() % 100) < garbage)
+            junk = 1 + harnessRandom() % 32;
+        if (used + junk + 2 + 2 * len > size)
+            return used;
+
+        // A 0x1a in the junk may be followed by anything but a frame type
+        for (i = 0; i < junk; ++i) {
+            unsigned char b = harnessRandom();
+
+            while (i && buf[used - 1] == 0x1a && beastFrameTypes[b].payload)
+                b = harnessRandom();
+            buf[used++] = b;
+        }
+        buf[used++] = 0x1a;
+        buf[used++] = type;
+        for (i = 0; i < len; ++i) {
+            buf[used++] = body[i];
+            if (body[i] == 0x1a)
+                buf[used++] = 0x1a;
+        }
+        ++*frames;
+    }
+}
@@ -0,0 +1,58 @@
+// Part of dump1090, a Mode S message decoder for RTLSDR devices.
+//
+// harness.h: drive the repeater's input and output paths in-process
+//
+// This file is free software: you may copy, redistribute and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation, either version 2 of the License, or (at your
+// option) any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef BENCH_HARNESS_H
+#define BENCH_HARNESS_H
+
+#include "../beast-repeater.h"
+#include "../net_io_ex.h"
+
+// The microbenchmark and the fuzz target link the repeater's own objects
+// and drive them directly: an input client reads from one end of a
+// socketpair that the harness writes to, and output subscribers are
+// socketpairs whose far ends the harness reads and discards. No listeners,
+// threads or event loop are involved.
+
+// Set up Modes the way beast-repeater does with no options
+void harnessInit(void);
+
+// Create an input client whose frames go to 'handler'. *feed is set to
+// the descriptor to write its input to
+struct client *harnessInput(frame_fn handler, int *feed);
+
+// Connect another client to an existing input service
+struct client *harnessConnect(struct net_service *service, int *feed);
+
+// Create a Beast output with 'subscribers' clients, filtered by 'filter'
+// (NULL = everything). Call modesInitFiltersEx() after the last one
+struct net_writer *harnessOutput(int subscribers, char *filter);
+
+// Push data through the input client, 'chunk' bytes per read.
+// Returns 0, or -1 if the client was closed before it had read everything
+int harnessFeed(struct client *c, int feed, const unsigned char *data, size_t len, size_t chunk);
+
+// Flush every output, then read and discard whatever the subscribers
+// have been sent. Returns the bytes discarded
+size_t harnessDrain(void);
+
+// Fill buf with random Beast frames (plus junk between some of them).
+// escapes: percent of body bytes that are 0x1a; garbage: percent of frames
+// preceded by junk. The junk never looks like a frame start, so the framer
+// should find exactly *frames frames. Returns the bytes used
+size_t harnessFrames(unsigned char *buf, size_t size, int escapes, int garbage, size_t *frames);
+
+#endif
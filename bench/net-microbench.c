@@ -0,0 +1,131 @@
+// Part of dump1090, a Mode S message decoder for RTLSDR devices.
+//
+// net-microbench.c: per-frame cost of the framer and of output fan-out
+//
+// This file is free software: you may copy, redistribute and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation, either version 2 of the License, or (at your
+// option) any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// Framing: a buffer of generated traffic is pushed through an input
+// client in 64 KiB reads, with a frame handler that only counts, so the
+// figure is read() plus modesReadFromClient(). Three inputs: clean,
+// garbage between a third of the frames, and a quarter of all body bytes
+// escaped.
+//
+// Fan-out: frames go through handleBeastMessage() to one output with 1 to
+// 256 subscribers; the time covers batching and the sends, not the
+// subscribers reading their copies.
+
+#include "harness.h"
+#include "../util.h"
+
+#define BENCH_BUF_SIZE  (4 * 1024 * 1024)
+#define BENCH_MIN_US    500000  // run each case at least this long
+#define BENCH_ROUND     1000    // frames fanned out between drains
+
+static size_t counted;
+
+static int countFrame(struct client *c, const struct beast_frame *frame)
+{
+    (void) c;
+    (void) frame;
+    ++counted;
+    return 0;
+}
+
+static void benchFraming(const char *name, int escapes, int garbage)
+{
+    static unsigned char buf[BENCH_BUF_SIZE];
+    struct client *c;
+    size_t len, frames, total = 0, bytes = 0;
+    uint64_t start, elapsed;
+    int feed;
+
+    harnessInit();
+    c = harnessInput(countFrame, &feed);
+    len = harnessFrames(buf, sizeof(buf), escapes, garbage, &frames);
+
+    counted = 0;
+    start = monotonic_usecs();
+    do {
+        if (harnessFeed(c, feed, buf, len, 65536) < 0) {
+            fprintf(stderr, "framing %s: the input was closed after %zu of %zu frames\n", name, counted, total + frames);
+            exit(1);
+        }
+        total += frames;
+        bytes += len;
+        elapsed = monotonic_usecs() - start;
+    } while (elapsed < BENCH_MIN_US);
+
+    if (counted != total) {
+        fprintf(stderr, "framing %s: framed %zu of %zu frames\n", name, counted, total);
+        exit(1);
+    }
+
+    printf("framing %-8s %7.1f ns/frame %8.1f MB/s  (%zu frames, %zu framed)\n",
+           name, elapsed * 1000.0 / total, bytes / (double) elapsed, total, counted);
+    close(feed);
+}
+
+static void benchFanout(int subscribers)
+{
+    static unsigned char buf[BENCH_BUF_SIZE / 16];
+    struct client *c;
+    size_t len, frames, total = 0, sent = 0;
+    uint64_t busy = 0, t;
+    int feed;
+
+    harnessInit();
+    c = harnessInput(handleBeastMessage, &feed);
+    harnessOutput(subscribers, NULL);
+    modesInitFiltersEx();
+    len = harnessFrames(buf, sizeof(buf), 0, 0, &frames);
+
+    // Only the frames' trip through the repeater is timed; the subscribers
+    // empty their sockets between rounds
+    while (busy < BENCH_MIN_US) {
+        size_t off = 0;
+
+        while (off < len) {
+            size_t n = len - off < BENCH_ROUND * 24 ? len - off : BENCH_ROUND * 24;
+
+            t = monotonic_usecs();
+            if (harnessFeed(c, feed, buf + off, n, n) < 0) {
+                fprintf(stderr, "fan-out %d subs: the input was closed\n", subscribers);
+                exit(1);
+            }
+            modesNetPeriodicWorkEx();
+            busy += monotonic_usecs() - t;
+            sent += harnessDrain();
+            off += n;
+        }
+        total += frames;
+    }
+
+    printf("fan-out  %4d subs %7.1f ns/frame %7.1f ns/frame/sub  (%zu frames, %.1f MB out)\n",
+           subscribers, busy * 1000.0 / total, busy * 1000.0 / total / subscribers, total, sent / 1e6);
+    close(feed);
+}
+
+int main(void)
+{
+    static const int subs[] = { 1, 4, 16, 64, 256 };
+    unsigned i;
+
+    printf("scanner: %s\n", beastScanName());
+    benchFraming("clean", 0, 0);
+    benchFraming("garbage", 0, 33);
+    benchFraming("escapes", 25, 0);
+    for (i = 0; i < sizeof(subs) / sizeof(subs[0]); ++i)
+        benchFanout(subs[i]);
+    return 0;
+}
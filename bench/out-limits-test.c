@@ -0,0 +1,85 @@
+// Part of dump1090, a Mode S message decoder for RTLSDR devices.
+//
+// out-limits-test.c: check that an output's limits work together
+//
+// This file is free software: you may copy, redistribute and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation, either version 2 of the License, or (at your
+// option) any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// An output with both --out-thin and --out-rate-msgs: a position the rate
+// limit sheds mustn't use up the aircraft's --out-thin allowance, or the
+// next one, sent once the rate allows, would be thinned and the aircraft
+// would go dark for the rest of the interval. Exits non-zero on failure.
+
+#include <inttypes.h>
+
+#include "harness.h"
+
+static int failures;
+
+static void expect(const char *what, uint64_t got, uint64_t want)
+{
+    printf("%-44s %4" PRIu64 " (want %" PRIu64 ")%s\n", what, got, want, got == want ? "" : "  FAILED");
+    if (got != want)
+        ++failures;
+}
+
+// Broadcast a DF17 airborne position from 'addr', as a Beast frame
+static void sendPosition(uint32_t addr)
+{
+    char frame[2 + 7 + 14] = { 0x1a, '3', 0, 0, 0, 0, 0, 1, (char) 0x80,
+                               (char) 0x8d, (char) (addr >> 16), (char) (addr >> 8), (char) addr,
+                               0x58, (char) 0xc3, (char) 0x82, (char) 0xd6, (char) 0x90, (char) 0xc8, (char) 0xac,
+                               0x28, 0x63, (char) 0xa7 };
+
+    broadcastBeastMessage(frame, sizeof(frame));
+}
+
+int main(void)
+{
+    struct net_writer *writer;
+    uint64_t before;
+    uint32_t i;
+
+    harnessInit();
+    Modes.net_output_thin_interval = 60000;
+    Modes.net_output_thin_limit = 1;
+    Modes.net_output_rate_msgs = 10;
+    writer = harnessOutput(1, NULL);
+    modesInitFiltersEx();
+
+    // Use up the burst with ten aircraft's first positions
+    for (i = 0; i < 10; ++i)
+        sendPosition(0x400000 + i);
+    expect("positions shed by the rate limit", writer->service->stats.frames_shed[NET_CLASS_POSITION], 0);
+
+    // The eleventh aircraft's is shed, and not counted by --out-thin
+    sendPosition(0x4abcde);
+    expect("positions shed by the rate limit", writer->service->stats.frames_shed[NET_CLASS_POSITION], 1);
+    expect("positions thinned", writer->thin->thinned, 0);
+    harnessDrain();
+
+    // Once the rate allows, the same position goes out
+    usleep(300000);
+    sendPosition(0x4abcde);
+    before = writer->thin->passed;
+    expect("positions shed by the rate limit", writer->service->stats.frames_shed[NET_CLASS_POSITION], 1);
+    expect("positions thinned", writer->thin->thinned, 0);
+    expect("bytes sent after the refill", harnessDrain() > 0, 1);
+
+    // and now it has, the next one in the interval is thinned
+    sendPosition(0x4abcde);
+    expect("positions thinned", writer->thin->thinned, 1);
+    expect("positions passed", writer->thin->passed, before);
+
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,86 @@
+#!/bin/sh
+#
+# Drive beast-repeater over loopback with beast-gen feeding its input and
+# beast-sink reading its output, and report for each scenario:
+#
+#   in/s, out/s   sustained frames per second fed in and delivered
+#   cpu/Min       repeater CPU seconds per million frames fed in
+#   cpu/Mout      repeater CPU seconds per million frames delivered
+#   rss           repeater peak resident set (kB)
+#   p50/p99/p999  end-to-end latency, generator to sink (microseconds)
+#
+# Scenarios are feeders:subscribers:frames-per-second. Environment:
+#   SCENARIOS      default "1:1:100000 40:1:100000 1:1000:2000"
+#   DURATION       seconds per scenario (default 10)
+#   ESCAPES        percent of frames with a 0x1a in the payload (default 20)
+#   REPEATER_ARGS  extra beast-repeater options, e.g. "--out-workers 4"
+#   IN_PORT, OUT_PORT  loopback ports to use (default 31901, 31902)
+
+set -e
+cd "$(dirname "$0")/.."
+
+SCENARIOS=${SCENARIOS:-"1:1:100000 40:1:100000 1:1000:2000"}
+DURATION=${DURATION:-10}
+ESCAPES=${ESCAPES:-20}
+IN_PORT=${IN_PORT:-31901}
+OUT_PORT=${OUT_PORT:-31902}
+TCK=$(getconf CLK_TCK)
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+cpuTicks() {
+    awk '{ print $14 + $15 }' "/proc/$1/stat"
+}
+
+field() {
+    tr ' ' '\n' < "$1" | sed -n "s/^$2=//p"
+}
+
+printf '%-12s %10s %10s %9s %9s %8s %8s %8s %8s  %s\n' \
+    scenario in/s out/s cpu/Min cpu/Mout rss_kB p50_us p99_us p999_us args
+
+for s in $SCENARIOS; do
+    feeders=${s%%:*}
+    rest=${s#*:}
+    subs=${rest%%:*}
+    rate=${rest#*:}
+
+    # shellcheck disable=SC2086
+    ./beast-repeater --net-bind-address 127.0.0.1 --inServer "$IN_PORT" --outServer "$OUT_PORT" \
+        $REPEATER_ARGS > /dev/null 2>&1 &
+    repeater=$!
+    sleep 0.5
+
+    bench/beast-sink -c "127.0.0.1:$OUT_PORT" -n "$subs" -d $((DURATION + 30)) > "$TMP/sink" &
+    sink=$!
+    while ! grep -q ready "$TMP/sink" 2> /dev/null; do
+        if ! kill -0 $sink 2> /dev/null; then
+            kill $repeater
+            echo "beast-sink failed to connect" >&2
+            exit 1
+        fi
+        sleep 0.1
+    done
+
+    cpu0=$(cpuTicks $repeater)
+    bench/beast-gen -c "127.0.0.1:$IN_PORT" -n "$feeders" -r "$rate" -d "$DURATION" -e "$ESCAPES" > "$TMP/gen"
+    wait $sink
+    cpu1=$(cpuTicks $repeater)
+    rss=$(awk '/^VmHWM/ { print $2 }' "/proc/$repeater/status")
+    kill $repeater
+    wait $repeater 2> /dev/null || true
+
+    sent=$(field "$TMP/gen" sent)
+    received=$(field "$TMP/sink" received)
+    awk -v name="${feeders}->${subs}" -v sent="$sent" -v received="$received" \
+        -v insecs="$(field "$TMP/gen" seconds)" -v outrate="$(field "$TMP/sink" rate)" \
+        -v cpu=$((cpu1 - cpu0)) -v tck="$TCK" -v rss="$rss" \
+        -v p50="$(field "$TMP/sink" p50_us)" -v p99="$(field "$TMP/sink" p99_us)" \
+        -v p999="$(field "$TMP/sink" p999_us)" -v args="$REPEATER_ARGS" 'BEGIN {
+            cpus = cpu / tck
+            printf "%-12s %10.0f %10.0f %9.3f %9.3f %8d %8d %8d %8d  %s\n", name,
+                sent / insecs, outrate,
+                sent ? cpus * 1e6 / sent : 0, received ? cpus * 1e6 / received : 0,
+                rss, p50, p99, p999, args
+        }'
+done
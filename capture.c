@@ -0,0 +1,408 @@
+// Part of dump1090, a Mode S message decoder for RTLSDR devices.
+//
+// capture.c: recording ingested frames to a file and replaying them
+//
+// This file is free software: you may copy, redistribute and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation, either version 2 of the License, or (at your
+// option) any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <endian.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "capture.h"
+#include "util.h"
+
+static size_t putVarint(unsigned char *p, uint64_t v)
+{
+    size_t n = 0;
+
+    while (v >= 0x80) {
+        p[n++] = (unsigned char) (v | 0x80);
+        v >>= 7;
+    }
+    p[n++] = (unsigned char) v;
+    return n;
+}
+
+// Returns 0, or -1 if the varint runs past 'end' or is too long
+static int getVarint(const unsigned char **p, const unsigned char *end, uint64_t *v)
+{
+    const unsigned char *q = *p;
+    uint64_t r = 0;
+    int shift;
+
+    for (shift = 0; shift < 64 && q < end; shift += 7) {
+        r |= (uint64_t) (*q & 0x7f) << shift;
+        if (!(*q++ & 0x80)) {
+            *p = q;
+            *v = r;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+//
+// ================================ Recording ================================
+//
+
+// Write whatever of the current block hasn't been written yet. The
+// records go first and the header (with the new length) after them, so a
+// crash part way leaves a readable file.
+static void captureSync(struct capture *cap)
+{
+    size_t len = cap->used - cap->synced;
+    uint32_t used;
+
+    if (cap->used <= cap->synced || cap->error)
+        return;
+
+    used = htole32((uint32_t) (cap->used - CAPTURE_HEADER_SIZE));
+    memcpy(cap->block + 4, &used, sizeof(used));
+
+    errno = 0;
+    if (pwrite(cap->fd, cap->block + cap->synced, len, cap->offset + cap->synced) != (ssize_t) len ||
+        (cap->synced && pwrite(cap->fd, cap->block, CAPTURE_HEADER_SIZE, cap->offset) != CAPTURE_HEADER_SIZE)) {
+        cap->error = errno ? errno : EIO;
+        fprintf(stderr, "Capture: writing %s failed: %s; recording stopped\n", cap->path, strerror(cap->error));
+        return;
+    }
+    cap->synced = cap->used;
+}
+
+static void captureAppend(struct capture *cap, const struct capture_msg *m)
+{
+    unsigned char rec[10 + 5 + 1 + CAPTURE_FRAME_MAX];
+    uint64_t time = m->time + cap->wall_offset;
+    uint64_t first;
+    size_t n;
+
+    // Frames from different reader threads can be queued slightly out of
+    // order; keep the times in the file monotonic
+    if (time < cap->last_time)
+        time = cap->last_time;
+
+    n = putVarint(rec, cap->used > CAPTURE_HEADER_SIZE ? time - cap->last_time : 0);
+    if (cap->used + n + 5 + 1 + m->len > CAPTURE_BLOCK_SIZE) {
+        captureSync(cap);
+        cap->offset += CAPTURE_BLOCK_SIZE;
+        cap->used = CAPTURE_HEADER_SIZE;
+        cap->synced = 0;
+        n = putVarint(rec, 0);
+    }
+    n += putVarint(rec + n, m->input);
+    rec[n++] = m->len;
+    memcpy(rec + n, m->data, m->len);
+    n += m->len;
+
+    if (cap->used == CAPTURE_HEADER_SIZE) {
+        memcpy(cap->block, CAPTURE_MAGIC, 4);
+        first = htole64(time);
+        memcpy(cap->block + 8, &first, sizeof(first));
+    }
+    memcpy(cap->block + cap->used, rec, n);
+    cap->used += n;
+    cap->last_time = time;
+    atomic_fetch_add_explicit(&cap->frames, 1, memory_order_relaxed);
+}
+
+static void *captureThread(void *arg)
+{
+    struct capture *cap = arg;
+    struct capture_msg m;
+    uint64_t last_sync = mstime();
+
+    for (;;) {
+        int stop = atomic_load(&cap->stop);
+        int n = 0;
+        uint64_t now;
+
+        while (mpscPop(&cap->queue, &m) == 0) {
+            captureAppend(cap, &m);
+            ++n;
+        }
+        if (stop)
+            break;
+
+        now = mstime();
+        if (now >= last_sync + CAPTURE_SYNC_INTERVAL) {
+            captureSync(cap);
+            last_sync = now;
+        }
+
+        if (!n) {
+            struct timespec ts = { 0, 10 * 1000 * 1000 };
+            nanosleep(&ts, NULL);
+        }
+    }
+
+    captureSync(cap);
+    return NULL;
+}
+
+struct capture *captureOpen(const char *path)
+{
+    struct capture *cap;
+    struct timespec wall;
+    struct stat st;
+    int err;
+
+    if (!(cap = calloc(1, sizeof(*cap))) ||
+        !(cap->block = calloc(1, CAPTURE_BLOCK_SIZE)) ||
+        !(cap->path = strdup(path)) ||
+        mpscInit(&cap->queue, CAPTURE_QUEUE, sizeof(struct capture_msg)) < 0) {
+        fprintf(stderr, "Out of memory setting up the capture\n");
+        exit(1);
+    }
+
+    if ((cap->fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644)) < 0 || fstat(cap->fd, &st) < 0) {
+        fprintf(stderr, "Capture: can't open %s: %s\n", path, strerror(errno));
+        goto fail;
+    }
+
+    // Carry on after whatever is there already, in a block of our own
+    cap->offset = (st.st_size + CAPTURE_BLOCK_SIZE - 1) / CAPTURE_BLOCK_SIZE * CAPTURE_BLOCK_SIZE;
+    cap->used = CAPTURE_HEADER_SIZE;
+
+    // Frames are stamped on the monotonic clock, but the file is more use
+    // with wall clock times
+    clock_gettime(CLOCK_REALTIME, &wall);
+    cap->wall_offset = (int64_t) wall.tv_sec * 1000000 + wall.tv_nsec / 1000 - (int64_t) monotonic_usecs();
+
+    if ((err = pthread_create(&cap->thread, NULL, captureThread, cap)) != 0) {
+        fprintf(stderr, "Capture: can't start the writer thread: %s\n", strerror(err));
+        goto fail;
+    }
+    return cap;
+
+ fail:
+    if (cap->fd >= 0)
+        close(cap->fd);
+    mpscFree(&cap->queue);
+    free(cap->path);
+    free(cap->block);
+    free(cap);
+    return NULL;
+}
+
+void captureFrame(struct capture *cap, uint32_t input, uint64_t time, const char *data, int len)
+{
+    struct capture_msg m;
+
+    if (len > CAPTURE_FRAME_MAX)
+        len = CAPTURE_FRAME_MAX;
+    m.time = time;
+    m.input = input;
+    m.len = (uint8_t) len;
+    memcpy(m.data, data, len);
+
+    if (mpscPush(&cap->queue, &m) < 0)
+        atomic_fetch_add_explicit(&cap->dropped, 1, memory_order_relaxed);
+}
+
+void captureClose(struct capture *cap)
+{
+    atomic_store(&cap->stop, 1);
+    pthread_join(cap->thread, NULL);
+    fprintf(stderr, "Capture: %llu frames written to %s, %llu dropped\n",
+            (unsigned long long) cap->frames, cap->path, (unsigned long long) cap->dropped);
+    close(cap->fd);
+    mpscFree(&cap->queue);
+    free(cap->path);
+    free(cap->block);
+    free(cap);
+}
+
+//
+// ================================= Replay ==================================
+//
+
+// Wall time of the first record of block i, or UINT64_MAX if the block
+// isn't there or holds nothing
+static uint64_t replayBlockTime(const struct replay *rp, size_t i)
+{
+    const unsigned char *h;
+    uint32_t used;
+    uint64_t time;
+
+    if (i >= rp->nblocks || i * CAPTURE_BLOCK_SIZE + CAPTURE_HEADER_SIZE > rp->size)
+        return UINT64_MAX;
+    h = rp->map + i * CAPTURE_BLOCK_SIZE;
+    if (memcmp(h, CAPTURE_MAGIC, 4))
+        return UINT64_MAX;
+    memcpy(&used, h + 4, sizeof(used));
+    memcpy(&time, h + 8, sizeof(time));
+    return le32toh(used) ? le64toh(time) : UINT64_MAX;
+}
+
+// Decode the next record into rp->time/input/frame, moving on to the
+// following block when this one runs out. Sets rp->done at the end.
+static void replayNext(struct replay *rp)
+{
+    const unsigned char *p, *end;
+    uint64_t delta, input;
+    uint32_t used;
+
+    for (;;) {
+        p = rp->map + rp->pos;
+        end = rp->map + rp->end;
+        if (p < end &&
+            getVarint(&p, end, &delta) == 0 &&
+            getVarint(&p, end, &input) == 0 &&
+            p < end && *p <= CAPTURE_FRAME_MAX && p + 1 + *p <= end) {
+            rp->time += delta;
+            rp->input = (uint32_t) input;
+            rp->frame_len = *p;
+            rp->frame = p + 1;
+            rp->pos = p + 1 + *p - rp->map;
+            return;
+        }
+
+        // End of the block (or a damaged record): on to the next one
+        if ((rp->time = replayBlockTime(rp, ++rp->block)) == UINT64_MAX) {
+            rp->done = 1;
+            return;
+        }
+        rp->pos = rp->block * CAPTURE_BLOCK_SIZE + CAPTURE_HEADER_SIZE;
+        memcpy(&used, rp->map + rp->block * CAPTURE_BLOCK_SIZE + 4, sizeof(used));
+        rp->end = rp->pos + le32toh(used);
+        if (rp->end > rp->size)
+            rp->end = rp->size;
+    }
+}
+
+struct replay *replayOpen(const char *path, double speed, double from)
+{
+    struct replay *rp;
+    struct stat st;
+    uint64_t first, target;
+    size_t lo, hi;
+    void *map;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "Replay: can't open %s: %s\n", path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return NULL;
+    }
+    if (st.st_size < CAPTURE_HEADER_SIZE) {
+        fprintf(stderr, "Replay: %s is not a capture file\n", path);
+        close(fd);
+        return NULL;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Replay: can't map %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    if (!(rp = calloc(1, sizeof(*rp))) || !(rp->path = strdup(path))) {
+        fprintf(stderr, "Out of memory setting up the replay\n");
+        exit(1);
+    }
+    rp->map = map;
+    rp->size = st.st_size;
+    rp->nblocks = (rp->size + CAPTURE_BLOCK_SIZE - 1) / CAPTURE_BLOCK_SIZE;
+    rp->speed = speed > 0 ? speed : 0;
+
+    if ((first = replayBlockTime(rp, 0)) == UINT64_MAX) {
+        fprintf(stderr, "Replay: %s is not a capture file\n", path);
+        replayClose(rp);
+        return NULL;
+    }
+
+    // Find the last block starting no later than the requested time, then
+    // skip the records before it. Block times only go up, except that a
+    // missing block sorts last.
+    target = first + (uint64_t) (from > 0 ? from * 1e6 : 0);
+    lo = 0;
+    hi = rp->nblocks;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (replayBlockTime(rp, mid) <= target)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    // Start with an empty block before lo, so that replayNext() loads it
+    rp->block = lo - 1;  // wraps for block 0, and back again
+    rp->pos = rp->end = 0;
+    replayNext(rp);
+    while (!rp->done && rp->time < target)
+        replayNext(rp);
+
+    if (rp->done) {
+        fprintf(stderr, "Replay: nothing in %s after %.1f seconds\n", path, from);
+        replayClose(rp);
+        return NULL;
+    }
+    rp->base = rp->time;
+    return rp;
+}
+
+// When the current record is due, on the monotonic clock
+static uint64_t replayDue(const struct replay *rp)
+{
+    if (!rp->speed)
+        return rp->start;
+    return rp->start + (uint64_t) ((rp->time - rp->base) / rp->speed);
+}
+
+int replayPoll(struct replay *rp, uint64_t now, int max, replay_fn handler)
+{
+    int n = 0;
+
+    if (rp->done)
+        return 0;
+    if (!rp->start)
+        rp->start = now;
+
+    while (n < max && replayDue(rp) <= now) {
+        handler((char *) rp->frame, rp->frame_len);
+        ++n;
+        replayNext(rp);
+        if (rp->done) {
+            fprintf(stderr, "Replay of %s finished: %llu frames\n", rp->path, (unsigned long long) rp->frames + n);
+            break;
+        }
+    }
+    rp->frames += n;
+    return n;
+}
+
+uint64_t replayDeadline(struct replay *rp)
+{
+    if (rp->done)
+        return UINT64_MAX;
+    if (!rp->start)
+        return 0;
+    return replayDue(rp);
+}
+
+void replayClose(struct replay *rp)
+{
+    munmap((void *) rp->map, rp->size);
+    free(rp->path);
+    free(rp);
+}
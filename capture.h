@@ -0,0 +1,125 @@
+// Part of dump1090, a Mode S message decoder for RTLSDR devices.
+//
+// capture.h: recording ingested frames to a file and replaying them
+//
+// This file is free software: you may copy, redistribute and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation, either version 2 of the License, or (at your
+// option) any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef DUMP1090_CAPTURE_H
+#define DUMP1090_CAPTURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "ring.h"
+
+// A capture file is a run of fixed-size blocks. Each block starts with a
+// header holding the wall-clock time of its first record, so the block
+// headers are a sparse time index: replay binary-searches them to seek.
+// A record is
+//
+//   varint  microseconds since the previous record (or the block time)
+//   varint  input id (the client the frame was read from)
+//   byte    frame length
+//   bytes   the frame as received, still escaped, starting with 0x1a
+//
+// Records never straddle blocks; the tail of a block that has no room for
+// the next record is left unused. Multi-byte header fields are little
+// endian. Recording to an existing file starts a new block after the end
+// of it, so the file only ever grows.
+#define CAPTURE_MAGIC      "BCAP"
+#define CAPTURE_BLOCK_SIZE 65536
+#define CAPTURE_HEADER_SIZE 16   // magic, bytes of records used, first time
+#define CAPTURE_FRAME_MAX  63
+#define CAPTURE_QUEUE      16384 // frames waiting for the writer thread
+#define CAPTURE_SYNC_INTERVAL 1000 // ms between writes of a partly filled block
+
+// One frame on its way to the writer thread
+struct capture_msg {
+    uint64_t time;              // monotonic_usecs() when it was read
+    uint32_t input;
+    uint8_t len;
+    char data[CAPTURE_FRAME_MAX];
+};
+
+// --record: frames are queued by whichever thread read them and written
+// out by a thread of their own, so disk stalls never reach the network.
+struct capture {
+    char *path;
+    int fd;
+    pthread_t thread;
+    atomic_int stop;
+    struct mpsc_ring queue;
+    int64_t wall_offset;        // wall clock minus monotonic clock, us
+    unsigned char *block;       // block being filled
+    size_t used;                // bytes of it in use, header included
+    size_t synced;              // bytes of it already written
+    off_t offset;               // where it goes in the file
+    uint64_t last_time;         // wall time of the latest record
+    int error;                  // errno of a failed write, reported once
+    atomic_ullong frames;       // frames recorded
+    atomic_ullong dropped;      // frames lost because the writer fell behind
+};
+
+// Open (or extend) a capture file and start the writer thread.
+// Returns NULL with a message on stderr on failure
+struct capture *captureOpen(const char *path);
+
+// Queue one escaped frame, from any thread. Never blocks: if the writer
+// has fallen behind the frame is counted as dropped
+void captureFrame(struct capture *cap, uint32_t input, uint64_t time, const char *data, int len);
+
+// Write out everything queued, stop the writer thread and close the file
+void captureClose(struct capture *cap);
+
+// --inReplay: plays a capture file back through the main thread.
+struct replay {
+    char *path;
+    const unsigned char *map;   // the whole file, read only
+    size_t size;
+    size_t nblocks;
+    size_t block;               // current block
+    size_t pos;                 // offset in the file of the next record
+    size_t end;                 // end of the records of the current block
+    uint64_t time;              // wall time of the next record
+    uint32_t input;             // and the rest of it
+    const unsigned char *frame;
+    int frame_len;
+    double speed;               // 1 = real time, 0 = as fast as possible
+    uint64_t base;              // capture time replay started from
+    uint64_t start;             // monotonic_usecs() when replay started, 0 = not yet
+    uint64_t frames;            // frames replayed
+    int done;
+};
+
+// Map a capture for replay at 'speed' times real time (0 = flat out),
+// starting 'from' seconds into it. Returns NULL with a message on stderr
+// on failure
+struct replay *replayOpen(const char *path, double speed, double from);
+
+// Frame handler for replayed frames
+typedef void (*replay_fn)(char *data, int len);
+
+// Pass every frame that is due by 'now' (monotonic_usecs()) to the
+// handler, but no more than 'max' of them. Returns the number passed
+int replayPoll(struct replay *rp, uint64_t now, int max, replay_fn handler);
+
+// When the next frame is due (monotonic_usecs()), or UINT64_MAX if the
+// replay has finished
+uint64_t replayDeadline(struct replay *rp);
+
+void replayClose(struct replay *rp);
+
+#endif
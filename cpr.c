@@ -0,0 +1,169 @@
+// Part of dump1090, a Mode S message decoder for RTLSDR devices.
+//
+// cpr.c - Compact Position Reporting decoder
+//
+// This file is free software: you may copy, redistribute and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation, either version 2 of the License, or (at your
+// option) any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <math.h>
+
+#include "cpr.h"
+
+#define CPR_NZ 15
+
+// Always positive MOD operation, used for CPR decoding
+static int cprModInt(int a, int b)
+{
+    int res = a % b;
+    if (res < 0)
+        res += b;
+    return res;
+}
+
+static double cprModDouble(double a, double b)
+{
+    double res = fmod(a, b);
+    if (res < 0)
+        res += b;
+    return res;
+}
+
+// The NL function: number of longitude zones at a given latitude
+static int cprNLFunction(double lat)
+{
+    double a;
+
+    if (lat < 0)
+        lat = -lat;
+    if (lat == 0)
+        return 59;
+    if (lat == 87)
+        return 2;
+    if (lat > 87)
+        return 1;
+
+    a = 1 - (1 - cos(M_PI / (2 * CPR_NZ))) / (cos(M_PI / 180 * lat) * cos(M_PI / 180 * lat));
+    return (int) floor(2 * M_PI / acos(a));
+}
+
+static int cprNFunction(double lat, int fflag)
+{
+    int nl = cprNLFunction(lat) - (fflag ? 1 : 0);
+    if (nl < 1)
+        nl = 1;
+    return nl;
+}
+
+static double cprDlonFunction(double lat, int fflag, int surface)
+{
+    return (surface ? 90.0 : 360.0) / cprNFunction(lat, fflag);
+}
+
+int decodeCPRairborne(int even_cprlat, int even_cprlon,
+                      int odd_cprlat, int odd_cprlon,
+                      int fflag,
+                      double *out_lat, double *out_lon)
+{
+    double AirDlat0 = 360.0 / 60.0;
+    double AirDlat1 = 360.0 / 59.0;
+    double lat0 = even_cprlat;
+    double lat1 = odd_cprlat;
+    double lon0 = even_cprlon;
+    double lon1 = odd_cprlon;
+    double rlat, rlon;
+
+    // Compute the Latitude Index "j"
+    int j = (int) floor(((59 * lat0 - 60 * lat1) / 131072) + 0.5);
+    double rlat0 = AirDlat0 * (cprModInt(j, 60) + lat0 / 131072);
+    double rlat1 = AirDlat1 * (cprModInt(j, 59) + lat1 / 131072);
+
+    if (rlat0 >= 270)
+        rlat0 -= 360;
+    if (rlat1 >= 270)
+        rlat1 -= 360;
+
+    // Check to see that the latitude is in range: -90 .. +90
+    if (rlat0 < -90 || rlat0 > 90 || rlat1 < -90 || rlat1 > 90)
+        return -2;
+
+    // Check that both are in the same latitude zone, or abort.
+    if (cprNLFunction(rlat0) != cprNLFunction(rlat1))
+        return -1;
+
+    // Compute ni and the Longitude Index "m"
+    if (fflag) { // Use odd packet.
+        int ni = cprNFunction(rlat1, 1);
+        int m = (int) floor((((lon0 * (cprNLFunction(rlat1) - 1)) -
+                              (lon1 * cprNLFunction(rlat1))) / 131072.0) + 0.5);
+        rlon = cprDlonFunction(rlat1, 1, 0) * (cprModInt(m, ni) + lon1 / 131072);
+        rlat = rlat1;
+    } else {     // Use even packet.
+        int ni = cprNFunction(rlat0, 0);
+        int m = (int) floor((((lon0 * (cprNLFunction(rlat0) - 1)) -
+                              (lon1 * cprNLFunction(rlat0))) / 131072) + 0.5);
+        rlon = cprDlonFunction(rlat0, 0, 0) * (cprModInt(m, ni) + lon0 / 131072);
+        rlat = rlat0;
+    }
+
+    // Renormalize to -180 .. +180
+    rlon -= floor((rlon + 180) / 360) * 360;
+
+    *out_lat = rlat;
+    *out_lon = rlon;
+    return 0;
+}
+
+int decodeCPRrelative(double reflat, double reflon,
+                      int cprlat, int cprlon,
+                      int fflag, int surface,
+                      double *out_lat, double *out_lon)
+{
+    double AirDlat, AirDlon;
+    double fractional_lat = cprlat / 131072.0;
+    double fractional_lon = cprlon / 131072.0;
+    double rlon, rlat;
+    int j, m;
+
+    AirDlat = (surface ? 90.0 : 360.0) / (fflag ? 59.0 : 60.0);
+
+    // Compute the Latitude Index "j"
+    j = (int) (floor(reflat / AirDlat) +
+               floor(0.5 + cprModDouble(reflat, AirDlat) / AirDlat - fractional_lat));
+    rlat = AirDlat * (j + fractional_lat);
+    if (rlat >= 270)
+        rlat -= 360;
+
+    // Check to see that the latitude is in range: -90 .. +90
+    if (rlat < -90 || rlat > 90)
+        return -1;
+
+    // Check to see that answer is reasonable - ie no more than 1/2 cell away
+    if (fabs(rlat - reflat) > (AirDlat / 2))
+        return -1;
+
+    // Compute the Longitude Index "m"
+    AirDlon = cprDlonFunction(rlat, fflag, surface);
+    m = (int) (floor(reflon / AirDlon) +
+               floor(0.5 + cprModDouble(reflon, AirDlon) / AirDlon - fractional_lon));
+    rlon = AirDlon * (m + fractional_lon);
+    if (rlon > 180)
+        rlon -= 360;
+
+    // Check to see that answer is reasonable - ie no more than 1/2 cell away
+    if (fabs(rlon - reflon) > (AirDlon / 2))
+        return -1;
+
+    *out_lat = rlat;
+    *out_lon = rlon;
+    return 0;
+}
@@ -0,0 +1,39 @@
+// Part of dump1090, a Mode S message decoder for RTLSDR devices.
+//
+// cpr.h - Compact Position Reporting decoder prototypes
+//
+// This file is free software: you may copy, redistribute and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation, either version 2 of the License, or (at your
+// option) any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef DUMP1090_CPR_H
+#define DUMP1090_CPR_H
+
+// Global airborne decoding from an even and an odd position (17-bit
+// values). fflag says which is the more recent (1 = odd), and that one's
+// position is returned.
+// Returns 0 on success, -1 if the pair straddles a longitude zone
+// boundary, -2 if the latitudes are out of range.
+int decodeCPRairborne(int even_cprlat, int even_cprlon,
+                      int odd_cprlat, int odd_cprlon,
+                      int fflag,
+                      double *out_lat, double *out_lon);
+
+// Local decoding of a single position against a reference position
+// within half a cell of it (about 180NM airborne, 45NM on the surface).
+// Returns 0 on success, -1 if the result is too far from the reference.
+int decodeCPRrelative(double reflat, double reflon,
+                      int cprlat, int cprlon,
+                      int fflag, int surface,
+                      double *out_lat, double *out_lon);
+
+#endif
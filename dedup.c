@@ -0,0 +1,117 @@
+// Part of dump1090, a Mode S message decoder for RTLSDR devices.
+//
+// dedup.c: suppression of Mode S frames received from several inputs
+//
+// This file is free software: you may copy, redistribute and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation, either version 2 of the License, or (at your
+// option) any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "dedup.h"
+
+#include <stdlib.h>
+
+// How far to probe before evicting; keeps the worst case bounded when the
+// table is busier than it was sized for
+#define DEDUP_MAX_PROBE 32
+
+// Bytes of timestamp and signal level ahead of the payload
+#define DEDUP_SKIP 7
+
+int dedupInit(struct dedup_table *table, uint64_t window, size_t capacity)
+{
+    size_t size = 1;
+
+    while (size < capacity)
+        size <<= 1;
+
+    if (!(table->slots = calloc(size, sizeof(struct dedup_entry))))
+        return -1;
+    table->mask = size - 1;
+    table->window = window;
+    table->unique = table->duplicates = 0;
+    return 0;
+}
+
+void dedupFree(struct dedup_table *table)
+{
+    free(table->slots);
+    table->slots = NULL;
+}
+
+// FNV-1a over the type and the unescaped payload, finished with a
+// multiply-xorshift so the low bits used for the index are well mixed
+static uint64_t dedupHash(const unsigned char *frame, int len)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    int i, skip = DEDUP_SKIP;
+
+    h = (h ^ frame[1]) * 0x100000001b3ULL;
+
+    for (i = 2; i < len; ++i) {
+        // 0x1a is sent doubled inside a frame
+        if (frame[i] == 0x1a && i + 1 < len)
+            ++i;
+        if (skip) {
+            --skip;
+            continue;
+        }
+        h = (h ^ frame[i]) * 0x100000001b3ULL;
+    }
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h ? h : 1;
+}
+
+int dedupCheck(struct dedup_table *table, const unsigned char *frame, int len, uint64_t now)
+{
+    struct dedup_entry *victim = NULL, *oldest = NULL;
+    uint64_t hash;
+    size_t i, idx;
+
+    // Mode S short and long frames only; identical Mode A/C replies
+    // commonly come from different aircraft
+    if (len < 2 || (frame[1] != '2' && frame[1] != '3'))
+        return 0;
+
+    hash = dedupHash(frame, len);
+    idx = hash & table->mask;
+
+    for (i = 0; i < DEDUP_MAX_PROBE; ++i) {
+        struct dedup_entry *e = &table->slots[(idx + i) & table->mask];
+        int live = e->hash && now - e->seen < table->window;
+
+        if (live && e->hash == hash) {
+            ++table->duplicates;
+            return 1;
+        }
+
+        if (!e->hash) {
+            if (!victim)
+                victim = e;
+            break;
+        }
+
+        if (!live && !victim)
+            victim = e;
+        if (!oldest || e->seen < oldest->seen)
+            oldest = e;
+    }
+
+    if (!victim)
+        victim = oldest;
+    victim->hash = hash;
+    victim->seen = now;
+    ++table->unique;
+    return 0;
+}
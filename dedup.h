@@ -0,0 +1,53 @@
+// Part of dump1090, a Mode S message decoder for RTLSDR devices.
+//
+// dedup.h: suppression of Mode S frames received from several inputs
+//
+// This file is free software: you may copy, redistribute and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation, either version 2 of the License, or (at your
+// option) any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef DUMP1090_DEDUP_H
+#define DUMP1090_DEDUP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Receivers with overlapping coverage hear the same transmission; only the
+// timestamp and signal level differ. Each Mode S payload seen is
+// remembered for a time window in an open-addressing hash table of
+// (hash, first seen) pairs, probed linearly over a bounded distance.
+// Entries older than the window count as free, so there is no separate
+// expiry pass.
+struct dedup_entry {
+    uint64_t hash;      // 0 = never used
+    uint64_t seen;      // mstime() of the first copy
+};
+
+struct dedup_table {
+    struct dedup_entry *slots;
+    size_t mask;        // capacity - 1 (capacity is a power of two)
+    uint64_t window;    // milliseconds a payload is remembered
+    uint64_t unique;    // frames passed
+    uint64_t duplicates;// frames suppressed
+};
+
+// Set up a table remembering payloads for 'window' ms, with room for at
+// least 'capacity' of them. Returns 0 on success, -1 if out of memory
+int dedupInit(struct dedup_table *table, uint64_t window, size_t capacity);
+void dedupFree(struct dedup_table *table);
+
+// Check an escaped Beast frame (starting with 0x1a and the type byte).
+// Returns 1 if the same Mode S payload was already seen within the window,
+// 0 otherwise (including frames that aren't Mode S). Not thread safe.
+int dedupCheck(struct dedup_table *table, const unsigned char *frame, int len, uint64_t now);
+
+#endif
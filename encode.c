@@ -0,0 +1,417 @@
+// Part of dump1090, a Mode S message decoder for RTLSDR devices.
+//
+// encode.c: AVR raw and SBS (BaseStation) encodings of Beast frames
+//
+// This file is free software: you may copy, redistribute and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation, either version 2 of the License, or (at your
+// option) any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "encode.h"
+#include "cpr.h"
+
+#define SBS_PROBE 16    // slots searched for an aircraft before giving up
+
+static const char hexDigits[] = "0123456789ABCDEF";
+
+//
+// AVR raw
+//
+int encodeAvr(const struct frame_features *ff, char *out)
+{
+    int i, n = 0;
+
+    if (!ff->modes && !(ff->type == '1' && ff->msglen == 2))
+        return 0;
+
+    out[n++] = '*';
+    for (i = 0; i < ff->msglen; ++i) {
+        out[n++] = hexDigits[ff->msg[i] >> 4];
+        out[n++] = hexDigits[ff->msg[i] & 15];
+    }
+    out[n++] = ';';
+    out[n++] = '\n';
+    return n;
+}
+
+//
+// Aircraft table
+//
+int sbsInit(struct sbs_state *st, size_t capacity)
+{
+    size_t size = 1;
+
+    while (size < capacity)
+        size <<= 1;
+    if (!(st->slots = calloc(size, sizeof(*st->slots))))
+        return -1;
+    st->mask = size - 1;
+    return 0;
+}
+
+void sbsFree(struct sbs_state *st)
+{
+    free(st->slots);
+    st->slots = NULL;
+}
+
+static inline size_t sbsHash(uint32_t a)
+{
+    a ^= a >> 13;
+    a *= 0x5bd1e995;
+    a ^= a >> 15;
+    return a;
+}
+
+// Find an aircraft seen recently. With 'create', an aircraft not found
+// takes over the stalest slot of its probe sequence. Slots are reused but
+// never emptied, so the search can stop at the first empty one.
+static struct sbs_aircraft *sbsFind(struct sbs_state *st, uint32_t addr, uint64_t now, int create)
+{
+    struct sbs_aircraft *a, *victim = NULL;
+    size_t i, h = sbsHash(addr);
+
+    for (i = 0; i < SBS_PROBE; ++i) {
+        a = &st->slots[(h + i) & st->mask];
+        if (a->addr == addr)
+            return (create || a->seen + SBS_AIRCRAFT_TTL >= now) ? a : NULL;
+        if (!victim || a->seen < victim->seen)
+            victim = a;
+        if (!a->addr)
+            break;
+    }
+
+    if (!create)
+        return NULL;
+    memset(victim, 0, sizeof(*victim));
+    victim->addr = addr;
+    return victim;
+}
+
+//
+// Field decoding
+//
+
+// What goes in the variable part of a MSG line; anything not valid is
+// left empty
+struct sbs_fields {
+    char callsign[9];
+    int has_alt, alt;
+    int has_gs, has_track;
+    double gs, track;
+    int has_pos;
+    double lat, lon;
+    int has_vr, vr;
+    int has_squawk, squawk;
+    int alert, emergency, spi, ground; // -1 = unknown
+};
+
+// 13-bit altitude of DF0/4/16/20. Only the 25 ft encoding is decoded;
+// metric and Gillham (100 ft) altitudes are rare now and left out.
+static int decodeAC13(const unsigned char *msg, int *alt)
+{
+    int ac13 = ((msg[2] & 0x1f) << 8) | msg[3];
+    int n;
+
+    if (!ac13 || (ac13 & 0x40) || !(ac13 & 0x10))
+        return 0;
+    n = ((ac13 & 0x1f80) >> 2) | ((ac13 & 0x20) >> 1) | (ac13 & 0x0f);
+    *alt = n * 25 - 1000;
+    return 1;
+}
+
+// 12-bit altitude of an airborne position, 25 ft encoding only
+static int decodeAC12(const unsigned char *msg, int *alt)
+{
+    int ac12 = (msg[5] << 4) | (msg[6] >> 4);
+    int n;
+
+    if (!ac12 || !(ac12 & 0x10))
+        return 0;
+    n = ((ac12 & 0x0fe0) >> 1) | (ac12 & 0x0f);
+    *alt = n * 25 - 1000;
+    return 1;
+}
+
+// Mode A code of DF5/21, as four octal digits in hex (7700 -> 0x7700)
+static int decodeID13(const unsigned char *msg)
+{
+    int id13 = ((msg[2] & 0x1f) << 8) | msg[3];
+    int a = 0;
+
+    if (id13 & 0x1000) a |= 0x0010; // C1
+    if (id13 & 0x0800) a |= 0x1000; // A1
+    if (id13 & 0x0400) a |= 0x0020; // C2
+    if (id13 & 0x0200) a |= 0x2000; // A2
+    if (id13 & 0x0100) a |= 0x0040; // C4
+    if (id13 & 0x0080) a |= 0x4000; // A4
+    if (id13 & 0x0020) a |= 0x0100; // B1
+    if (id13 & 0x0010) a |= 0x0001; // D1
+    if (id13 & 0x0008) a |= 0x0200; // B2
+    if (id13 & 0x0004) a |= 0x0002; // D2
+    if (id13 & 0x0002) a |= 0x0400; // B4
+    if (id13 & 0x0001) a |= 0x0004; // D4
+    return a;
+}
+
+// Flight status of DF4/5/20/21
+static void decodeFS(const unsigned char *msg, struct sbs_fields *f)
+{
+    int fs = msg[0] & 7;
+
+    f->alert = (fs == 2 || fs == 3 || fs == 4);
+    f->spi = (fs == 4 || fs == 5);
+    f->ground = (fs == 1 || fs == 3) ? 1 : (fs == 0 || fs == 2) ? 0 : -1;
+}
+
+// Ground speed in knots of a surface position's movement field, -1 if none
+static double decodeMovement(int m)
+{
+    if (m == 1)
+        return 0;
+    if (m >= 2 && m <= 8)
+        return 0.125 * (m - 1);
+    if (m >= 9 && m <= 12)
+        return 1 + 0.25 * (m - 8);
+    if (m >= 13 && m <= 38)
+        return 2 + 0.5 * (m - 12);
+    if (m >= 39 && m <= 93)
+        return 15 + (m - 38);
+    if (m >= 94 && m <= 108)
+        return 70 + 2 * (m - 93);
+    if (m >= 109 && m <= 123)
+        return 100 + 5 * (m - 108);
+    if (m == 124)
+        return 175;
+    return -1;
+}
+
+// Work out where a position message puts the aircraft: globally from a
+// recent even/odd pair if there is one, otherwise locally from its last
+// known position
+static int decodePosition(struct sbs_aircraft *a, const unsigned char *msg, int surface, uint64_t now, struct sbs_fields *f)
+{
+    int odd = (msg[6] >> 2) & 1;
+    int lat = ((msg[6] & 3) << 15) | (msg[7] << 7) | (msg[8] >> 1);
+    int lon = ((msg[8] & 1) << 16) | (msg[9] << 8) | msg[10];
+    int ok = -1;
+
+    if (!surface) {
+        a->cpr_time[odd] = now;
+        a->cpr_lat[odd] = lat;
+        a->cpr_lon[odd] = lon;
+        if (a->cpr_time[!odd] && now - a->cpr_time[!odd] <= SBS_CPR_MAX_AGE)
+            ok = decodeCPRairborne(a->cpr_lat[0], a->cpr_lon[0], a->cpr_lat[1], a->cpr_lon[1], odd, &f->lat, &f->lon);
+    }
+    if (ok < 0 && a->pos_time && now - a->pos_time <= SBS_POSITION_MAX_AGE)
+        ok = decodeCPRrelative(a->lat, a->lon, lat, lon, odd, surface, &f->lat, &f->lon);
+    if (ok < 0)
+        return 0;
+
+    a->lat = f->lat;
+    a->lon = f->lon;
+    a->pos_time = now;
+    f->has_pos = 1;
+    return 1;
+}
+
+// Extended squitter. Returns the SBS message type, 0 if there's none
+static int decodeES(struct sbs_aircraft *a, const unsigned char *msg, uint64_t now, struct sbs_fields *f)
+{
+    static const char charset[] = "?ABCDEFGHIJKLMNOPQRSTUVWXYZ????? ???????????????0123456789??????";
+    int tc = msg[4] >> 3;
+    int i;
+
+    if (tc >= 1 && tc <= 4) {
+        uint64_t chars = 0;
+
+        for (i = 5; i < 11; ++i)
+            chars = chars << 8 | msg[i];
+        for (i = 0; i < 8; ++i)
+            f->callsign[i] = charset[(chars >> (42 - 6 * i)) & 63];
+        for (i = 8; i > 0 && f->callsign[i - 1] == ' '; --i)
+            f->callsign[i - 1] = 0;
+        return 1;
+    }
+
+    if (tc >= 5 && tc <= 8) {
+        double gs = decodeMovement(((msg[4] & 7) << 4) | (msg[5] >> 4));
+
+        if (gs >= 0) {
+            f->has_gs = 1;
+            f->gs = gs;
+        }
+        if (msg[5] & 0x08) {
+            f->has_track = 1;
+            f->track = (((msg[5] & 7) << 4) | (msg[6] >> 4)) * 360.0 / 128;
+        }
+        decodePosition(a, msg, 1, now, f);
+        f->ground = 1;
+        return 2;
+    }
+
+    if ((tc >= 9 && tc <= 18) || (tc >= 20 && tc <= 22)) {
+        int ss = (msg[4] >> 1) & 3;
+
+        if (tc <= 18)
+            f->has_alt = decodeAC12(msg, &f->alt);
+        decodePosition(a, msg, 0, now, f);
+        f->alert = (ss == 1 || ss == 2);
+        f->spi = (ss == 3);
+        f->ground = 0;
+        return 3;
+    }
+
+    if (tc == 19) {
+        int st = msg[4] & 7;
+        int vr = ((msg[8] & 7) << 6) | (msg[9] >> 2);
+
+        if (st == 1 || st == 2) {
+            int mult = (st == 2) ? 4 : 1;
+            int ew = ((msg[5] & 3) << 8) | msg[6];
+            int ns = ((msg[7] & 0x7f) << 3) | (msg[8] >> 5);
+
+            if (ew && ns) {
+                double vx = (ew - 1) * mult * ((msg[5] & 4) ? -1 : 1);
+                double vy = (ns - 1) * mult * ((msg[7] & 0x80) ? -1 : 1);
+
+                f->has_gs = f->has_track = 1;
+                f->gs = sqrt(vx * vx + vy * vy);
+                f->track = atan2(vx, vy) * 180 / M_PI;
+                if (f->track < 0)
+                    f->track += 360;
+            }
+        }
+        if (vr) {
+            f->has_vr = 1;
+            f->vr = (vr - 1) * 64 * ((msg[8] & 8) ? -1 : 1);
+        }
+        return (f->has_gs || f->has_vr) ? 4 : 0;
+    }
+
+    return 0;
+}
+
+//
+// Formatting
+//
+
+// "YYYY/MM/DD,HH:MM:SS.mmm" in local time, as BaseStation writes it.
+// The broken-down time is cached for the second; main thread only.
+static int sbsTime(uint64_t now, char *out)
+{
+    static time_t cached = -1;
+    static struct tm tm;
+    time_t secs = (time_t) (now / 1000);
+
+    if (secs != cached) {
+        localtime_r(&secs, &tm);
+        cached = secs;
+    }
+    return sprintf(out, "%04d/%02d/%02d,%02d:%02d:%02d.%03u",
+                   (tm.tm_year + 1900) % 10000, (tm.tm_mon + 1) % 100, tm.tm_mday % 100,
+                   tm.tm_hour % 100, tm.tm_min % 100, tm.tm_sec % 100, (unsigned) (now % 1000));
+}
+
+static int sbsFlag(char *out, int flag)
+{
+    return sprintf(out, flag < 0 ? "," : flag ? ",-1" : ",0");
+}
+
+int encodeSbs(struct sbs_state *st, const struct frame_features *ff, uint64_t now, char *out)
+{
+    const unsigned char *msg = ff->msg;
+    struct sbs_aircraft *a;
+    struct sbs_fields f;
+    char when[32];
+    int type = 0, n;
+
+    if (!ff->modes || !ff->has_addr || (ff->df >= 16) != (ff->msglen == 14))
+        return 0;
+    if (!st->slots && sbsInit(st, SBS_AIRCRAFT) < 0)
+        return 0;
+
+    // Messages with a checkable CRC introduce an aircraft; the address of
+    // the rest is only trusted if it has been introduced
+    switch (ff->df) {
+    case 11: case 17: case 18:
+        if (!ff->crc_ok)
+            return 0;
+        a = sbsFind(st, ff->addr, now, 1);
+        a->seen = now;
+        break;
+    case 0: case 4: case 5: case 16: case 20: case 21:
+        if (!(a = sbsFind(st, ff->addr, now, 0)))
+            return 0;
+        break;
+    default:
+        return 0;
+    }
+
+    memset(&f, 0, sizeof(f));
+    f.alert = f.emergency = f.spi = f.ground = -1;
+
+    switch (ff->df) {
+    case 0: case 16:
+        f.has_alt = decodeAC13(msg, &f.alt);
+        type = 7;
+        break;
+    case 4: case 20:
+        f.has_alt = decodeAC13(msg, &f.alt);
+        decodeFS(msg, &f);
+        type = 5;
+        break;
+    case 5: case 21:
+        f.has_squawk = 1;
+        f.squawk = decodeID13(msg);
+        f.emergency = (f.squawk == 0x7500 || f.squawk == 0x7600 || f.squawk == 0x7700);
+        decodeFS(msg, &f);
+        type = 6;
+        break;
+    case 11:
+        if ((msg[0] & 7) == 4)
+            f.ground = 1;
+        else if ((msg[0] & 7) == 5)
+            f.ground = 0;
+        type = 8;
+        break;
+    case 17: case 18:
+        // DF18 only with an ICAO address (CF 0 and 1 are ADS-B, 6 rebroadcast)
+        if (ff->df == 18 && (msg[0] & 7) != 0 && (msg[0] & 7) != 1 && (msg[0] & 7) != 6)
+            return 0;
+        type = decodeES(a, msg, now, &f);
+        break;
+    }
+    if (!type)
+        return 0;
+
+    sbsTime(now, when);
+    n = sprintf(out, "MSG,%d,1,1,%06X,1,%s,%s,%s", type, ff->addr & 0xffffff, when, when, f.callsign);
+    n += f.has_alt ? sprintf(out + n, ",%d", f.alt) : sprintf(out + n, ",");
+    n += f.has_gs ? sprintf(out + n, ",%.0f", f.gs) : sprintf(out + n, ",");
+    n += f.has_track ? sprintf(out + n, ",%.0f", f.track) : sprintf(out + n, ",");
+    n += f.has_pos ? sprintf(out + n, ",%.5f,%.5f", f.lat, f.lon) : sprintf(out + n, ",,");
+    n += f.has_vr ? sprintf(out + n, ",%d", f.vr) : sprintf(out + n, ",");
+    n += f.has_squawk ? sprintf(out + n, ",%04x", f.squawk) : sprintf(out + n, ",");
+    n += sbsFlag(out + n, f.alert);
+    n += sbsFlag(out + n, f.emergency);
+    n += sbsFlag(out + n, f.spi);
+    n += sbsFlag(out + n, f.ground);
+    out[n++] = '\r';
+    out[n++] = '\n';
+    return n;
+}
@@ -0,0 +1,66 @@
+// Part of dump1090, a Mode S message decoder for RTLSDR devices.
+//
+// encode.h: AVR raw and SBS (BaseStation) encodings of Beast frames
+//
+// This file is free software: you may copy, redistribute and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation, either version 2 of the License, or (at your
+// option) any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef DUMP1090_ENCODE_H
+#define DUMP1090_ENCODE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "filter.h"
+
+#define ENCODE_MAX 256              // longest line either encoding produces
+#define SBS_AIRCRAFT 4096           // aircraft the SBS encoder tracks at once
+#define SBS_CPR_MAX_AGE 10000       // ms between an even and odd position for global decoding
+#define SBS_POSITION_MAX_AGE 600000 // ms a decoded position is a reference for local decoding
+#define SBS_AIRCRAFT_TTL 300000     // ms after which an aircraft's slot may be reused
+
+// AVR raw: "*<payload in hex>;" for Mode S and Mode A/C frames.
+// Returns the bytes written to out, 0 if the frame has no AVR form
+int encodeAvr(const struct frame_features *ff, char *out);
+
+// What the SBS encoder remembers about an aircraft. Positions arrive as
+// even/odd CPR halves: the first fix needs one of each within
+// SBS_CPR_MAX_AGE, after which each new half is decoded against the last
+// fix.
+struct sbs_aircraft {
+    uint32_t addr;          // 0 = free (address 000000 is never used)
+    uint64_t seen;          // mstime() of the last frame with a good CRC
+    uint64_t cpr_time[2];   // when the latest even [0] and odd [1] halves arrived
+    int cpr_lat[2];
+    int cpr_lon[2];
+    uint64_t pos_time;      // when lat/lon were decoded, 0 = never
+    double lat, lon;
+};
+
+// Aircraft by address, in an open-addressing table probed over a bounded
+// distance. Used by the main thread only.
+struct sbs_state {
+    struct sbs_aircraft *slots;
+    size_t mask;            // capacity - 1 (capacity is a power of two)
+};
+
+// Returns 0 on success, -1 if out of memory
+int sbsInit(struct sbs_state *st, size_t capacity);
+void sbsFree(struct sbs_state *st);
+
+// SBS: one "MSG,..." line for the Mode S messages BaseStation knows about.
+// Frames from aircraft not yet seen with a verified CRC are left out.
+// Returns the bytes written to out, 0 if the frame has no SBS form
+int encodeSbs(struct sbs_state *st, const struct frame_features *ff, uint64_t now, char *out);
+
+#endif
@@ -0,0 +1,386 @@
+// Part of dump1090, a Mode S message decoder for RTLSDR devices.
+//
+// filter.c: per-output message filters
+//
+// This file is free software: you may copy, redistribute and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation, either version 2 of the License, or (at your
+// option) any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "beast-repeater.h"
+#include "filter.h"
+
+static const unsigned char mlatMagic[6] = { 0xff, 0x00, 'M', 'L', 'A', 'T' };
+
+//
+// Mode S CRC
+//
+static uint32_t crcTable[256];
+
+static void crcInit(void)
+{
+    uint32_t i, j, c;
+
+    if (crcTable[1])
+        return;
+
+    for (i = 0; i < 256; ++i) {
+        c = i << 16;
+        for (j = 0; j < 8; ++j)
+            c = (c & 0x800000) ? ((c << 1) ^ 0xfff409) : (c << 1);
+        crcTable[i] = c & 0xffffff;
+    }
+}
+
+// CRC of all but the last 3 bytes, xored with the last 3 bytes: 0 for a
+// good DF17/18, the address for frames with address/parity
+static uint32_t crcSyndrome(const unsigned char *msg, int n)
+{
+    uint32_t rem = 0;
+    int i;
+
+    for (i = 0; i < n - 3; ++i)
+        rem = ((rem << 8) ^ crcTable[msg[i] ^ (rem >> 16)]) & 0xffffff;
+    return rem ^ ((uint32_t) msg[n - 3] << 16 | (uint32_t) msg[n - 2] << 8 | msg[n - 1]);
+}
+
+//
+// Address sets
+//
+static inline uint32_t icaoHash(uint32_t a)
+{
+    a ^= a >> 13;
+    a *= 0x5bd1e995;
+    a ^= a >> 15;
+    return a;
+}
+
+static int icaoSetAdd(struct icao_set *set, uint32_t addr)
+{
+    size_t i;
+
+    if ((set->count + 1) * 2 > set->mask + 1) {
+        struct icao_set bigger;
+        size_t size = set->slots ? (set->mask + 1) * 2 : 64;
+
+        if (!(bigger.slots = calloc(size, sizeof(uint32_t))))
+            return -1;
+        bigger.mask = size - 1;
+        bigger.count = 0;
+        for (i = 0; set->slots && i <= set->mask; ++i) {
+            if (set->slots[i])
+                icaoSetAdd(&bigger, set->slots[i] - 1);
+        }
+        free(set->slots);
+        *set = bigger;
+    }
+
+    for (i = icaoHash(addr) & set->mask; set->slots[i]; i = (i + 1) & set->mask) {
+        if (set->slots[i] == addr + 1)
+            return 0;
+    }
+    set->slots[i] = addr + 1;
+    ++set->count;
+    return 0;
+}
+
+static int icaoSetHas(const struct icao_set *set, uint32_t addr)
+{
+    size_t i;
+
+    for (i = icaoHash(addr) & set->mask; set->slots[i]; i = (i + 1) & set->mask) {
+        if (set->slots[i] == addr + 1)
+            return 1;
+    }
+    return 0;
+}
+
+//
+// Compiling
+//
+
+// Add a list of hex addresses, separated by ',' or whitespace, to a set
+static int parseAddrs(struct icao_set *set, const char *list, char *err, size_t errlen)
+{
+    const char *p = list;
+
+    while (*p) {
+        char *end;
+        unsigned long a;
+
+        while (*p == ',' || isspace((unsigned char) *p))
+            ++p;
+        if (!*p)
+            break;
+
+        a = strtoul(p, &end, 16);
+        if (end == p || a > 0xffffff || (*end && *end != ',' && !isspace((unsigned char) *end))) {
+            snprintf(err, errlen, "bad ICAO address near '%.8s'", p);
+            return -1;
+        }
+        if (icaoSetAdd(set, (uint32_t) a) < 0) {
+            snprintf(err, errlen, "out of memory");
+            return -1;
+        }
+        p = end;
+    }
+
+    return 0;
+}
+
+// icao=@file: the same list format, from a file
+static int parseAddrFile(struct icao_set *set, const char *path, char *err, size_t errlen)
+{
+    FILE *f;
+    char line[1024];
+    int rv = 0;
+
+    if (!(f = fopen(path, "r"))) {
+        snprintf(err, errlen, "can't open %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    while (rv == 0 && fgets(line, sizeof(line), f)) {
+        char *hash = strchr(line, '#');
+        if (hash)
+            *hash = 0;
+        rv = parseAddrs(set, line, err, errlen);
+    }
+
+    fclose(f);
+    return rv;
+}
+
+static int parseYesNo(const char *value, int *out)
+{
+    if (!strcmp(value, "yes") || !strcmp(value, "1"))
+        *out = 1;
+    else if (!strcmp(value, "no") || !strcmp(value, "0"))
+        *out = 0;
+    else
+        return -1;
+    return 0;
+}
+
+static int parseTerm(struct net_filter *f, char *term, char *err, size_t errlen)
+{
+    char *value = strchr(term, '=');
+    int negate = 0;
+
+    if (!value) {
+        snprintf(err, errlen, "expected key=value, got '%s'", term);
+        return -1;
+    }
+    if (value > term && value[-1] == '!') {
+        negate = 1;
+        value[-1] = 0;
+    }
+    *value++ = 0;
+
+    if (!strcmp(term, "df") && !negate) {
+        char *p = value, *end;
+
+        while (*p) {
+            long df = strtol(p, &end, 10);
+            if (end == p || df < 0 || df > 31 || (*end && *end != ',')) {
+                snprintf(err, errlen, "bad DF list '%s'", value);
+                return -1;
+            }
+            f->df_mask |= 1u << (df >= 24 ? 24 : df);
+            p = *end ? end + 1 : end;
+        }
+    } else if (!strcmp(term, "icao")) {
+        struct icao_set *set = negate ? &f->deny : &f->allow;
+        if (value[0] == '@')
+            return parseAddrFile(set, value + 1, err, errlen);
+        return parseAddrs(set, value, err, errlen);
+    } else if (!strcmp(term, "sig") && !negate) {
+        char *end;
+        long sig = strtol(value, &end, 0);
+        if (end == value || *end || sig < 0 || sig > 255) {
+            snprintf(err, errlen, "bad signal level '%s'", value);
+            return -1;
+        }
+        f->min_signal = (int) sig;
+    } else if (!strcmp(term, "mlat") && !negate) {
+        int yes;
+        if (!strcmp(value, "only"))
+            f->mlat = FILTER_MLAT_ONLY;
+        else if (parseYesNo(value, &yes) == 0)
+            f->mlat = yes ? FILTER_MLAT_YES : FILTER_MLAT_NO;
+        else {
+            snprintf(err, errlen, "mlat must be yes, no or only");
+            return -1;
+        }
+    } else if (!strcmp(term, "modeac") && !negate) {
+        if (parseYesNo(value, &f->modeac) < 0) {
+            snprintf(err, errlen, "modeac must be yes or no");
+            return -1;
+        }
+    } else if (!strcmp(term, "crc") && !negate) {
+        if (parseYesNo(value, &f->crc) < 0) {
+            snprintf(err, errlen, "crc must be yes or no");
+            return -1;
+        }
+    } else {
+        snprintf(err, errlen, "unknown filter term '%s%s'", term, negate ? "!" : "");
+        return -1;
+    }
+
+    return 0;
+}
+
+struct net_filter *filterCompile(const char *spec, char *err, size_t errlen)
+{
+    struct net_filter *f;
+    char *copy, *term, *save = NULL;
+
+    crcInit();
+
+    if (!(f = calloc(1, sizeof(*f))) || !(copy = strdup(spec))) {
+        free(f);
+        snprintf(err, errlen, "out of memory");
+        return NULL;
+    }
+
+    f->modeac = Modes.mode_ac;
+    f->mlat = Modes.forward_mlat ? FILTER_MLAT_YES : FILTER_MLAT_NO;
+    f->crc = Modes.check_crc;
+
+    for (term = strtok_r(copy, " \t;", &save); term; term = strtok_r(NULL, " \t;", &save)) {
+        if (parseTerm(f, term, err, errlen) < 0) {
+            free(copy);
+            filterFree(f);
+            return NULL;
+        }
+    }
+
+    free(copy);
+    return f;
+}
+
+void filterFree(struct net_filter *filter)
+{
+    if (!filter)
+        return;
+    free(filter->allow.slots);
+    free(filter->deny.slots);
+    free(filter);
+}
+
+//
+// Evaluating
+//
+void filterFeatures(const unsigned char *frame, int len, struct frame_features *ff)
+{
+    const struct beast_frame_type *t;
+    unsigned char head[7], *msg = ff->msg;
+    const unsigned char *p = frame + 2;
+    const unsigned char *end = frame + len;
+    int i, n;
+
+    memset(ff, 0, sizeof(*ff));
+    ff->crc_ok = 1;
+    if (len < 2)
+        return;
+
+    ff->type = frame[1];
+    t = &beastFrameTypes[ff->type];
+
+    // unescape the timestamp, signal and payload
+    for (i = 0; i < t->stamped && p < end; ++i) {
+        head[i] = *p;
+        p += (*p == 0x1a) ? 2 : 1;
+    }
+    for (n = 0; n < t->payload && n < (int) sizeof(ff->msg) && p < end; ++n) {
+        msg[n] = *p;
+        p += (*p == 0x1a) ? 2 : 1;
+    }
+    ff->msglen = n;
+
+    if (t->stamped == 7) {
+        ff->signal = head[6];
+        ff->mlat = !memcmp(head, mlatMagic, sizeof(mlatMagic));
+    }
+
+    if (ff->type != '2' && ff->type != '3')
+        return;
+    if (n != (ff->type == '2' ? MODES_SHORT_MSG_BYTES : MODES_LONG_MSG_BYTES))
+        return;
+
+    crcInit();
+    ff->modes = 1;
+    ff->df = msg[0] >> 3;
+    if (ff->df > 24)
+        ff->df = 24;
+
+    switch (ff->df) {
+    case 11:
+        // parity is overlaid with the interrogator id
+        ff->crc_ok = (crcSyndrome(msg, n) & ~0x7fu) == 0;
+        ff->has_addr = 1;
+        ff->addr = (uint32_t) msg[1] << 16 | (uint32_t) msg[2] << 8 | msg[3];
+        break;
+
+    case 17:
+    case 18:
+        ff->crc_ok = crcSyndrome(msg, n) == 0;
+        ff->has_addr = 1;
+        ff->addr = (uint32_t) msg[1] << 16 | (uint32_t) msg[2] << 8 | msg[3];
+        break;
+
+    case 0: case 4: case 5: case 16: case 20: case 21: case 24:
+        // address/parity: the syndrome is the address
+        ff->has_addr = 1;
+        ff->addr = crcSyndrome(msg, n);
+        break;
+
+    default:
+        break;
+    }
+}
+
+int filterMatch(const struct net_filter *f, const struct frame_features *ff)
+{
+    if (ff->mlat ? f->mlat == FILTER_MLAT_NO : f->mlat == FILTER_MLAT_ONLY)
+        return 0;
+
+    if (ff->signal < f->min_signal && (ff->type != 0xe3))
+        return 0;
+
+    if (!ff->modes) {
+        if (ff->type == '1')
+            return f->modeac && !f->df_mask && !f->allow.count;
+        return !f->df_mask && !f->allow.count;
+    }
+
+    if (f->df_mask && !(f->df_mask & (1u << ff->df)))
+        return 0;
+    if (f->crc && !ff->crc_ok)
+        return 0;
+    if (f->allow.count && !(ff->has_addr && icaoSetHas(&f->allow, ff->addr)))
+        return 0;
+    if (f->deny.count && ff->has_addr && icaoSetHas(&f->deny, ff->addr))
+        return 0;
+
+    return 1;
+}
+
+uint64_t filterEvaluate(const struct net_filter *filters, const struct frame_features *ff)
+{
+    uint64_t pass = 0;
+
+    for (; filters; filters = filters->next) {
+        if (filterMatch(filters, ff))
+            pass |= (uint64_t) 1 << filters->id;
+    }
+    return pass;
+}
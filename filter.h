@@ -0,0 +1,95 @@
+// Part of dump1090, a Mode S message decoder for RTLSDR devices.
+//
+// filter.h: per-output message filters
+//
+// This file is free software: you may copy, redistribute and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation, either version 2 of the License, or (at your
+// option) any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef DUMP1090_FILTER_H
+#define DUMP1090_FILTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A filter is compiled from a spec of terms separated by spaces or ';':
+//
+//   df=17,18            Mode S downlink formats to pass (24 covers 24-31)
+//   icao=4840d6,...     only these addresses (icao=@file reads a list)
+//   icao!=4840d6,...    never these addresses
+//   sig=<0-255>         minimum signal level byte
+//   mlat=yes|no|only    MLAT results (timestamp FF 00 'MLAT')
+//   modeac=yes|no       Mode A/C replies
+//   crc=yes|no          drop DF11/17/18 frames whose CRC is wrong
+//
+// df= and icao= restrict the output to Mode S frames. The mlat, modeac and
+// crc defaults come from --forward-mlat, --modeac and --check-crc.
+//
+// Everything about a frame that filters look at is worked out once per
+// frame; each filter then contributes one bit to a mask saying which
+// outputs the frame goes to.
+
+#define FILTER_MAX 64
+
+typedef enum {
+    FILTER_MLAT_NO,
+    FILTER_MLAT_YES,
+    FILTER_MLAT_ONLY
+} filter_mlat_t;
+
+// Open-addressing set of 24-bit addresses
+struct icao_set {
+    uint32_t *slots;    // address + 1, 0 = empty
+    size_t mask;
+    size_t count;
+};
+
+struct net_filter {
+    struct net_filter *next;
+    int id;                 // bit in the pass mask
+    uint32_t df_mask;       // DFs to pass, 0 = any
+    int modeac;
+    filter_mlat_t mlat;
+    int min_signal;
+    int crc;
+    struct icao_set allow;  // empty = any address
+    struct icao_set deny;
+};
+
+// What filters need to know about a frame
+struct frame_features {
+    unsigned char type;     // Beast frame type
+    int modes;              // 1 for Mode S frames
+    int df;
+    int has_addr;
+    uint32_t addr;
+    int signal;
+    int mlat;
+    int crc_ok;             // 0 only if the CRC could be checked and was wrong
+    int msglen;             // bytes of payload in msg
+    unsigned char msg[21];  // the payload, unescaped
+};
+
+// Compile a filter spec. Returns NULL and fills err on error
+struct net_filter *filterCompile(const char *spec, char *err, size_t errlen);
+void filterFree(struct net_filter *filter);
+
+// Work out the features of an escaped Beast frame
+void filterFeatures(const unsigned char *frame, int len, struct frame_features *ff);
+
+int filterMatch(const struct net_filter *filter, const struct frame_features *ff);
+
+// Evaluate every filter in the list against a frame's features.
+// Returns a mask with bit 'id' set for each filter that passes it
+uint64_t filterEvaluate(const struct net_filter *filters, const struct frame_features *ff);
+
+#endif
@@ -0,0 +1,65 @@
+// Part of dump1090, a Mode S message decoder for RTLSDR devices.
+//
+// hist.c: log-linear latency histograms
+//
+// This file is free software: you may copy, redistribute and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation, either version 2 of the License, or (at your
+// option) any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "hist.h"
+
+// Largest value that falls into a bucket
+static uint64_t histBucketTop(unsigned b)
+{
+    unsigned e, sub;
+
+    if (b < (1u << HIST_SUB_BITS))
+        return b;
+    e = (b >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+    sub = b & ((1u << HIST_SUB_BITS) - 1);
+    return (((uint64_t) (sub | (1u << HIST_SUB_BITS)) + 1) << (e - HIST_SUB_BITS)) - 1;
+}
+
+// Add one thread's histogram to a snapshot
+void histMerge(struct hist_snapshot *snap, struct hist *h)
+{
+    unsigned b;
+
+    for (b = 0; b < HIST_BUCKETS; ++b) {
+        uint64_t n = atomic_load_explicit(&h->counts[b], memory_order_relaxed);
+        snap->counts[b] += n;
+        snap->count += n;
+    }
+    snap->sum += atomic_load_explicit(&h->sum, memory_order_relaxed);
+}
+
+// The value below which a fraction q of the samples lie, rounded up to the
+// top of its bucket (so it never understates). 0 if there are no samples.
+uint64_t histQuantile(const struct hist_snapshot *snap, double q)
+{
+    uint64_t rank, seen = 0;
+    unsigned b;
+
+    if (!snap->count)
+        return 0;
+
+    rank = (uint64_t) (q * snap->count);
+    if (rank >= snap->count)
+        rank = snap->count - 1;
+
+    for (b = 0; b < HIST_BUCKETS; ++b) {
+        seen += snap->counts[b];
+        if (seen > rank)
+            return histBucketTop(b);
+    }
+    return histBucketTop(HIST_BUCKETS - 1);
+}
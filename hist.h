@@ -0,0 +1,72 @@
+// Part of dump1090, a Mode S message decoder for RTLSDR devices.
+//
+// hist.h: log-linear latency histograms
+//
+// This file is free software: you may copy, redistribute and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation, either version 2 of the License, or (at your
+// option) any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef DUMP1090_HIST_H
+#define DUMP1090_HIST_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+// HDR-style histogram of microsecond values: every power of two is split
+// into 2^HIST_SUB_BITS linear buckets, so any value is known to within
+// 1/2^HIST_SUB_BITS (12.5%) at a fixed cost of a few instructions per
+// sample. Values from 0 up to 2^HIST_MAX_BITS us (about 19 hours) are
+// kept; anything larger lands in the last bucket.
+//
+// Like the other statistics a histogram is updated by one thread only, and
+// read by the metrics scrape, which merges the histograms of all threads.
+#define HIST_SUB_BITS  3
+#define HIST_MAX_BITS  36
+#define HIST_BUCKETS   ((HIST_MAX_BITS - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+struct hist {
+    atomic_ullong counts[HIST_BUCKETS];
+    atomic_ullong sum;          // of all recorded values
+};
+
+// A histogram merged from several threads
+struct hist_snapshot {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+};
+
+static inline unsigned histBucket(uint64_t v)
+{
+    unsigned e;
+
+    if (v < (1u << HIST_SUB_BITS))
+        return v;
+    e = 63 - __builtin_clzll(v);
+    if (e >= HIST_MAX_BITS)
+        return HIST_BUCKETS - 1;
+    return ((e - HIST_SUB_BITS + 1) << HIST_SUB_BITS) | ((v >> (e - HIST_SUB_BITS)) & ((1u << HIST_SUB_BITS) - 1));
+}
+
+// Record n samples of value v
+static inline void histRecord(struct hist *h, uint64_t v, uint64_t n)
+{
+    atomic_ullong *b = &h->counts[histBucket(v)];
+
+    atomic_store_explicit(b, atomic_load_explicit(b, memory_order_relaxed) + n, memory_order_relaxed);
+    atomic_store_explicit(&h->sum, atomic_load_explicit(&h->sum, memory_order_relaxed) + v * n, memory_order_relaxed);
+}
+
+void histMerge(struct hist_snapshot *snap, struct hist *h);
+uint64_t histQuantile(const struct hist_snapshot *snap, double q);
+
+#endif
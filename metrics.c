@@ -0,0 +1,493 @@
+// Part of dump1090, a Mode S message decoder for RTLSDR devices.
+//
+// metrics.c: statistics in Prometheus text format
+//
+// This file is free software: you may copy, redistribute and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation, either version 2 of the License, or (at your
+// option) any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "beast-repeater.h"
+#include "metrics.h"
+#include "uring.h"
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <inttypes.h>
+
+// Growable output buffer
+struct mbuf {
+    char *data;
+    size_t len;
+    size_t size;
+};
+
+static void mprintf(struct mbuf *b, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    for (;;) {
+        va_start(ap, fmt);
+        n = vsnprintf(b->data + b->len, b->size - b->len, fmt, ap);
+        va_end(ap);
+
+        if (n >= 0 && b->len + n < b->size)
+            break;
+
+        b->size = b->size * 2 + n;
+        if (!(b->data = realloc(b->data, b->size))) {
+            fprintf(stderr, "Out of memory rendering metrics\n");
+            exit(1);
+        }
+    }
+    b->len += n;
+}
+
+// Append a label value, escaped as the text format requires
+static void mlabel(struct mbuf *b, const char *name, const char *value)
+{
+    const char *p;
+
+    mprintf(b, "%s=\"", name);
+    for (p = value; *p; ++p) {
+        if (*p == '\\' || *p == '"')
+            mprintf(b, "\\%c", *p);
+        else if (*p == '\n')
+            mprintf(b, "\\n");
+        else
+            mprintf(b, "%c", *p);
+    }
+    mprintf(b, "\"");
+}
+
+static void mheader(struct mbuf *b, const char *name, const char *type, const char *help)
+{
+    mprintf(b, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void mservice(struct mbuf *b, struct net_service *s)
+{
+    mlabel(b, "service", s->descr);
+    mprintf(b, ",");
+    mlabel(b, "addr", s->addr);
+}
+
+static const char *threadName(net_shard_t pool, int id, char *buf, size_t len)
+{
+    switch (pool) {
+    case NET_SHARD_OUTPUT:
+        snprintf(buf, len, "output-%d", id);
+        break;
+    case NET_SHARD_INPUT:
+        snprintf(buf, len, "input-%d", id);
+        break;
+    case NET_SHARD_NONE:
+    default:
+        snprintf(buf, len, "main");
+        break;
+    }
+    return buf;
+}
+
+// Counters kept per client, with the matching total of closed clients kept
+// per service
+static const struct {
+    const char *name;
+    const char *help;
+    size_t client;      // offset in struct net_client_stats
+    size_t closed;      // offset in struct net_service_stats
+} counters[] = {
+    { "frames_in", "Messages received",
+      offsetof(struct net_client_stats, frames_in), offsetof(struct net_service_stats, frames_in) },
+    { "bytes_in", "Bytes received",
+      offsetof(struct net_client_stats, bytes_in), offsetof(struct net_service_stats, bytes_in) },
+    { "frames_out", "Messages completely sent",
+      offsetof(struct net_client_stats, frames_out), offsetof(struct net_service_stats, frames_out) },
+    { "bytes_out", "Bytes sent",
+      offsetof(struct net_client_stats, bytes_out), offsetof(struct net_service_stats, bytes_out) },
+};
+
+#define NCOUNTERS (sizeof(counters) / sizeof(counters[0]))
+
+static const char *closeReasons[NET_CLOSE_REASONS] = { "peer", "send_error", "queue_full", "queue_stale", "local" };
+
+static uint64_t clientStat(struct net_client_stats *st, size_t offset)
+{
+    return atomic_load_explicit((atomic_ullong *) ((char *) st + offset), memory_order_relaxed);
+}
+
+// Per-service sums of live and closed clients
+struct service_totals {
+    uint64_t counters[NCOUNTERS];
+    uint64_t dropped;
+    uint64_t backlog;
+};
+
+static void renderServices(struct mbuf *b, struct service_totals *totals)
+{
+    struct net_service *s;
+    struct net_client_stats *st;
+    unsigned i;
+    int r;
+
+    for (s = Modes.services; s; s = s->next) {
+        struct service_totals *t = &totals[s->id];
+        for (i = 0; i < NCOUNTERS; ++i)
+            t->counters[i] = *(uint64_t *) ((char *) &s->stats + counters[i].closed);
+        t->dropped = s->stats.frames_dropped;
+    }
+
+    for (st = Modes.stats_clients; st; st = st->next) {
+        struct service_totals *t = &totals[st->service->id];
+        for (i = 0; i < NCOUNTERS; ++i)
+            t->counters[i] += clientStat(st, counters[i].client);
+        t->dropped += atomic_load_explicit(&st->frames_dropped, memory_order_relaxed);
+        t->backlog += atomic_load_explicit(&st->backlog, memory_order_relaxed);
+    }
+
+    mheader(b, "beast_connections", "gauge", "Clients currently connected");
+    for (s = Modes.services; s; s = s->next) {
+        mprintf(b, "beast_connections{");
+        mservice(b, s);
+        mprintf(b, "} %d\n", atomic_load(&s->connections));
+    }
+
+    mheader(b, "beast_connections_total", "counter", "Clients ever connected");
+    for (s = Modes.services; s; s = s->next) {
+        mprintf(b, "beast_connections_total{");
+        mservice(b, s);
+        mprintf(b, "} %" PRIu64 "\n", s->stats.accepted);
+    }
+
+    mheader(b, "beast_connect_attempts_total", "counter", "Outgoing connection attempts, including reconnects");
+    for (s = Modes.services; s; s = s->next) {
+        mprintf(b, "beast_connect_attempts_total{");
+        mservice(b, s);
+        mprintf(b, "} %llu\n", atomic_load_explicit(&s->stats.reconnects, memory_order_relaxed));
+    }
+
+    mheader(b, "beast_disconnects_total", "counter", "Clients closed, by reason");
+    for (s = Modes.services; s; s = s->next) {
+        for (r = 0; r < NET_CLOSE_REASONS; ++r) {
+            mprintf(b, "beast_disconnects_total{");
+            mservice(b, s);
+            mprintf(b, ",reason=\"%s\"} %" PRIu64 "\n", closeReasons[r], s->stats.disconnects[r]);
+        }
+    }
+
+    for (i = 0; i < NCOUNTERS; ++i) {
+        char name[64];
+
+        snprintf(name, sizeof(name), "beast_%s_total", counters[i].name);
+        mheader(b, name, "counter", counters[i].help);
+        for (s = Modes.services; s; s = s->next) {
+            mprintf(b, "%s{", name);
+            mservice(b, s);
+            mprintf(b, "} %" PRIu64 "\n", totals[s->id].counters[i]);
+        }
+    }
+
+    mheader(b, "beast_frames_batched_total", "counter", "Messages written to output batches");
+    for (s = Modes.services; s; s = s->next) {
+        if (!s->writer)
+            continue;
+        mprintf(b, "beast_frames_batched_total{");
+        mservice(b, s);
+        mprintf(b, "} %llu\n", atomic_load_explicit(&s->stats.frames_batched, memory_order_relaxed));
+    }
+
+    mheader(b, "beast_frames_dropped_total", "counter", "Output messages discarded, by reason");
+    for (s = Modes.services; s; s = s->next) {
+        if (!s->writer)
+            continue;
+        mprintf(b, "beast_frames_dropped_total{");
+        mservice(b, s);
+        mprintf(b, ",reason=\"queue\"} %" PRIu64 "\n", totals[s->id].dropped);
+        mprintf(b, "beast_frames_dropped_total{");
+        mservice(b, s);
+        mprintf(b, ",reason=\"no_clients\"} %llu\n", atomic_load_explicit(&s->stats.drops_idle, memory_order_relaxed));
+        mprintf(b, "beast_frames_dropped_total{");
+        mservice(b, s);
+        mprintf(b, ",reason=\"oversize\"} %llu\n", atomic_load_explicit(&s->stats.drops_oversize, memory_order_relaxed));
+    }
+
+    mheader(b, "beast_frames_shed_total", "counter", "Output messages shed to stay within --out-rate, by class");
+    for (s = Modes.services; s; s = s->next) {
+        static const char *classes[NET_CLASSES] = { "low", "surveillance", "extended", "position" };
+        int cls;
+
+        if (!s->writer || (!s->writer->rate_bytes && !s->writer->rate_msgs))
+            continue;
+        for (cls = 0; cls < NET_CLASSES; ++cls) {
+            mprintf(b, "beast_frames_shed_total{");
+            mservice(b, s);
+            mprintf(b, ",class=\"%s\"} %llu\n", classes[cls], atomic_load_explicit(&s->stats.frames_shed[cls], memory_order_relaxed));
+        }
+    }
+
+    mheader(b, "beast_frames_thinned_total", "counter", "Output messages left out by --out-thin");
+    for (s = Modes.services; s; s = s->next) {
+        if (!s->writer || !s->writer->thin)
+            continue;
+        mprintf(b, "beast_frames_thinned_total{");
+        mservice(b, s);
+        mprintf(b, "} %" PRIu64 "\n", s->writer->thin->thinned);
+    }
+
+    mheader(b, "beast_compress_bytes_total", "counter", "Output batch bytes run through the shared compressor, and what they came to");
+    for (s = Modes.services; s; s = s->next) {
+        if (!s->writer)
+            continue;
+        mprintf(b, "beast_compress_bytes_total{");
+        mservice(b, s);
+        mprintf(b, ",stage=\"in\"} %llu\n", atomic_load_explicit(&s->stats.deflate_in, memory_order_relaxed));
+        mprintf(b, "beast_compress_bytes_total{");
+        mservice(b, s);
+        mprintf(b, ",stage=\"out\"} %llu\n", atomic_load_explicit(&s->stats.deflate_out, memory_order_relaxed));
+    }
+
+    mheader(b, "beast_udp_datagrams_total", "counter", "--outUdp datagrams, counted once per target, and --inUdp datagrams");
+    for (s = Modes.services; s; s = s->next) {
+        if (s->udp_input) {
+            mprintf(b, "beast_udp_datagrams_total{");
+            mservice(b, s);
+            mprintf(b, ",result=\"received\"} %llu\n", atomic_load_explicit(&s->stats.udp_received, memory_order_relaxed));
+            mprintf(b, "beast_udp_datagrams_total{");
+            mservice(b, s);
+            mprintf(b, ",result=\"truncated\"} %llu\n", atomic_load_explicit(&s->stats.udp_truncated, memory_order_relaxed));
+        }
+        if (!s->writer || !s->writer->udp)
+            continue;
+        mprintf(b, "beast_udp_datagrams_total{");
+        mservice(b, s);
+        mprintf(b, ",result=\"sent\"} %llu\n", atomic_load_explicit(&s->stats.udp_sent, memory_order_relaxed));
+        mprintf(b, "beast_udp_datagrams_total{");
+        mservice(b, s);
+        mprintf(b, ",result=\"dropped\"} %llu\n", atomic_load_explicit(&s->stats.udp_dropped, memory_order_relaxed));
+    }
+
+    mheader(b, "beast_flush_adaptive_bytes", "gauge", "Batch size an --out-flush adaptive output has settled on, 0 = every pass");
+    for (s = Modes.services; s; s = s->next) {
+        if (!s->writer || s->writer->flush_policy != NET_FLUSH_ADAPTIVE)
+            continue;
+        mprintf(b, "beast_flush_adaptive_bytes{");
+        mservice(b, s);
+        mprintf(b, "} %d\n", s->writer->adapt_size);
+    }
+
+    mheader(b, "beast_backlog_bytes", "gauge", "Bytes waiting in client output queues");
+    for (s = Modes.services; s; s = s->next) {
+        if (!s->writer)
+            continue;
+        mprintf(b, "beast_backlog_bytes{");
+        mservice(b, s);
+        mprintf(b, "} %" PRIu64 "\n", totals[s->id].backlog);
+    }
+}
+
+static void clientLabels(struct mbuf *b, struct net_client_stats *st)
+{
+    char thread[32];
+
+    mservice(b, st->service);
+    mprintf(b, ",");
+    mlabel(b, "peer", st->peer);
+    mprintf(b, ",");
+    mlabel(b, "thread", threadName(st->pool, st->thread, thread, sizeof(thread)));
+}
+
+static void renderClients(struct mbuf *b)
+{
+    struct net_client_stats *st;
+    unsigned i;
+
+    for (i = 0; i < NCOUNTERS; ++i) {
+        char name[64];
+
+        snprintf(name, sizeof(name), "beast_client_%s_total", counters[i].name);
+        mheader(b, name, "counter", counters[i].help);
+        for (st = Modes.stats_clients; st; st = st->next) {
+            mprintf(b, "%s{", name);
+            clientLabels(b, st);
+            mprintf(b, "} %" PRIu64 "\n", clientStat(st, counters[i].client));
+        }
+    }
+
+    mheader(b, "beast_client_frames_dropped_total", "counter", "Output messages discarded from or refused by the queue");
+    for (st = Modes.stats_clients; st; st = st->next) {
+        if (!st->service->writer)
+            continue;
+        mprintf(b, "beast_client_frames_dropped_total{");
+        clientLabels(b, st);
+        mprintf(b, "} %llu\n", atomic_load_explicit(&st->frames_dropped, memory_order_relaxed));
+    }
+
+    mheader(b, "beast_client_datagrams_total", "counter", "--inUdp datagrams by sequence number: received, missing, or out of order");
+    for (st = Modes.stats_clients; st; st = st->next) {
+        if (!st->service->udp_input)
+            continue;
+        mprintf(b, "beast_client_datagrams_total{");
+        clientLabels(b, st);
+        mprintf(b, ",result=\"received\"} %llu\n", atomic_load_explicit(&st->datagrams_in, memory_order_relaxed));
+        mprintf(b, "beast_client_datagrams_total{");
+        clientLabels(b, st);
+        mprintf(b, ",result=\"lost\"} %llu\n", atomic_load_explicit(&st->datagrams_lost, memory_order_relaxed));
+        mprintf(b, "beast_client_datagrams_total{");
+        clientLabels(b, st);
+        mprintf(b, ",result=\"late\"} %llu\n", atomic_load_explicit(&st->datagrams_late, memory_order_relaxed));
+    }
+
+    mheader(b, "beast_client_backlog_bytes", "gauge", "Bytes waiting in the output queue");
+    for (st = Modes.stats_clients; st; st = st->next) {
+        if (!st->service->writer)
+            continue;
+        mprintf(b, "beast_client_backlog_bytes{");
+        clientLabels(b, st);
+        mprintf(b, "} %llu\n", atomic_load_explicit(&st->backlog, memory_order_relaxed));
+    }
+}
+
+// --latency: merge each output's histograms across the threads that
+// record them and report a few quantiles of each component
+static void renderLatency(struct mbuf *b)
+{
+    static const struct {
+        const char *name;
+        size_t offset;
+    } components[] = {
+        { "wait",  offsetof(struct net_latency, wait) },
+        { "batch", offsetof(struct net_latency, batch) },
+        { "send",  offsetof(struct net_latency, send) },
+        { "total", offsetof(struct net_latency, total) },
+    };
+    static const double quantiles[] = { 0.5, 0.99, 0.999 };
+    struct hist_snapshot *snap;
+    struct net_service *s;
+    unsigned c, q;
+    int i;
+
+    if (!Modes.latency)
+        return;
+
+    if (!(snap = malloc(sizeof(*snap)))) {
+        fprintf(stderr, "Out of memory rendering metrics\n");
+        exit(1);
+    }
+
+    mheader(b, "beast_latency_seconds", "summary",
+            "Forwarding latency by component: wait (kernel to read), batch (read to flush), send (flush to socket), total");
+    for (s = Modes.services; s; s = s->next) {
+        if (!s->writer)
+            continue;
+
+        for (c = 0; c < sizeof(components) / sizeof(components[0]); ++c) {
+            memset(snap, 0, sizeof(*snap));
+            histMerge(snap, (struct hist *) ((char *) &Modes.latency[s->id] + components[c].offset));
+            for (i = 0; i < Modes.net_workers; ++i)
+                histMerge(snap, (struct hist *) ((char *) &Modes.workers[i].latency[s->id] + components[c].offset));
+
+            for (q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); ++q) {
+                mprintf(b, "beast_latency_seconds{");
+                mservice(b, s);
+                mprintf(b, ",component=\"%s\",quantile=\"%g\"} %.6f\n",
+                        components[c].name, quantiles[q], histQuantile(snap, quantiles[q]) / 1e6);
+            }
+            mprintf(b, "beast_latency_seconds_sum{");
+            mservice(b, s);
+            mprintf(b, ",component=\"%s\"} %.6f\n", components[c].name, snap->sum / 1e6);
+            mprintf(b, "beast_latency_seconds_count{");
+            mservice(b, s);
+            mprintf(b, ",component=\"%s\"} %" PRIu64 "\n", components[c].name, snap->count);
+        }
+    }
+
+    free(snap);
+}
+
+static void renderThreads(struct mbuf *b)
+{
+    static const net_shard_t pools[] = { NET_SHARD_OUTPUT, NET_SHARD_INPUT };
+    char thread[32];
+    unsigned p;
+    int i;
+
+    mheader(b, "beast_thread_clients", "gauge", "Clients owned by each worker thread");
+    for (p = 0; p < sizeof(pools) / sizeof(pools[0]); ++p) {
+        struct net_worker *pool = pools[p] == NET_SHARD_OUTPUT ? Modes.workers : Modes.readers;
+        int count = pools[p] == NET_SHARD_OUTPUT ? Modes.net_workers : Modes.net_readers;
+
+        for (i = 0; i < count; ++i)
+            mprintf(b, "beast_thread_clients{thread=\"%s\"} %d\n",
+                    threadName(pools[p], i, thread, sizeof(thread)), atomic_load(&pool[i].nclients));
+    }
+
+    mheader(b, "beast_thread_inbox_drops_total", "counter", "Messages for a worker thread dropped because its inbox was full");
+    for (p = 0; p < sizeof(pools) / sizeof(pools[0]); ++p) {
+        struct net_worker *pool = pools[p] == NET_SHARD_OUTPUT ? Modes.workers : Modes.readers;
+        int count = pools[p] == NET_SHARD_OUTPUT ? Modes.net_workers : Modes.net_readers;
+
+        for (i = 0; i < count; ++i)
+            mprintf(b, "beast_thread_inbox_drops_total{thread=\"%s\"} %" PRIu64 "\n",
+                    threadName(pools[p], i, thread, sizeof(thread)), pool[i].inbox_drops);
+    }
+
+    if (Modes.net_readers) {
+        mheader(b, "beast_fanout_stalls_total", "counter", "Times an input reader waited for room to pass messages on");
+        mprintf(b, "beast_fanout_stalls_total %llu\n", atomic_load_explicit(&Modes.fanout_stalls, memory_order_relaxed));
+    }
+
+    if (Modes.uring) {
+        mheader(b, "beast_io_uring_enters_total", "counter", "io_uring_enter() calls made by the main thread");
+        mprintf(b, "beast_io_uring_enters_total %" PRIu64 "\n", Modes.uring->enters);
+    }
+
+    if (Modes.dedup_window) {
+        mheader(b, "beast_dedup_frames_total", "counter", "Messages seen by the duplicate filter");
+        mprintf(b, "beast_dedup_frames_total{result=\"forwarded\"} %" PRIu64 "\n", Modes.dedup.unique);
+        mprintf(b, "beast_dedup_frames_total{result=\"duplicate\"} %" PRIu64 "\n", Modes.dedup.duplicates);
+    }
+
+    if (Modes.capture) {
+        mheader(b, "beast_capture_frames_total", "counter", "Messages offered to the --record capture file");
+        mprintf(b, "beast_capture_frames_total{result=\"written\"} %llu\n", atomic_load_explicit(&Modes.capture->frames, memory_order_relaxed));
+        mprintf(b, "beast_capture_frames_total{result=\"dropped\"} %llu\n", atomic_load_explicit(&Modes.capture->dropped, memory_order_relaxed));
+    }
+}
+
+char *metricsRender(size_t *len)
+{
+    struct mbuf b = { NULL, 0, 0 };
+    struct service_totals *totals;
+    int nservices = Modes.services ? Modes.services->id + 1 : 1;
+
+    if (!(totals = calloc(nservices, sizeof(*totals)))) {
+        fprintf(stderr, "Out of memory rendering metrics\n");
+        exit(1);
+    }
+
+    b.size = 16384;
+    if (!(b.data = malloc(b.size))) {
+        fprintf(stderr, "Out of memory rendering metrics\n");
+        exit(1);
+    }
+
+    pthread_mutex_lock(&Modes.stats_lock);
+    renderServices(&b, totals);
+    renderClients(&b);
+    pthread_mutex_unlock(&Modes.stats_lock);
+    renderLatency(&b);
+    renderThreads(&b);
+
+    free(totals);
+    *len = b.len;
+    return b.data;
+}
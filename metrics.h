@@ -0,0 +1,29 @@
+// Part of dump1090, a Mode S message decoder for RTLSDR devices.
+//
+// metrics.h: statistics in Prometheus text format
+//
+// This file is free software: you may copy, redistribute and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation, either version 2 of the License, or (at your
+// option) any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef DUMP1090_METRICS_H
+#define DUMP1090_METRICS_H
+
+#include <stddef.h>
+
+// Render every service, client and thread counter in the Prometheus text
+// exposition format. The counters are kept per client by the thread that
+// owns it and only summed here, at scrape time. Must be called from the
+// main thread. Returns a malloc()ed buffer of *len bytes.
+char *metricsRender(size_t *len);
+
+#endif
@@ -48,14 +48,97 @@
 //   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "beast-repeater.h"
+#include "util.h"
+#include "uring.h"
 /* for PRIX64 */
 #include <inttypes.h>
 
 #include <assert.h>
 #include <stdarg.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#include <sys/eventfd.h>
+#include <sched.h>
+#include <netdb.h>
+#include <zlib.h>
 
 
 static void moveNetClient(struct client *c, struct net_service *new_service);
+static struct net_segment *netSegmentAlloc(void);
+static struct net_segment *netSegmentAllocSize(size_t size);
+static void netWorkerHandoff(struct net_service *service, int fd);
+static struct net_worker *netWorkerPool(net_shard_t shard, int *count);
+static int netWorkerSend(struct net_worker *w, struct net_worker_msg *msg);
+static void modesCloseClient(struct client *c);
+static void modesCloseClientWhy(struct client *c, net_close_reason_t why);
+static void netUringAttach(struct client *c);
+static void netUringSend(struct client *c);
+static void netUringCancel(struct client *c);
+
+// Decompression state of an input whose stream has turned compressed
+#define NET_INFLATE_BUF 16384
+
+struct net_inflate {
+    z_stream strm;
+    unsigned char *in;   // compressed data read from the socket
+    size_t size;
+};
+
+// --io-uring: a main thread socket driven by the ring. A multishot
+// receive stays armed on it, filling buffers from the shared pool, and at
+// most one send of queued segments is in flight at a time.
+struct net_uring_io {
+    int pending;         // operations the kernel still holds; the client can't be freed until 0
+    int recv_armed;      // the multishot receive is outstanding
+    struct net_segment *segs[MODES_NET_MAX_IOV]; // the send in flight, holding a reference each
+    int nsegs;
+    struct iovec iov[MODES_NET_MAX_IOV];
+    struct msghdr msg;
+    const char *in;      // received data not yet taken by netClientRead()
+    size_t in_len;
+    int in_done;         // the receive has ended: in_err is 0 at end of stream, else why
+    int in_err;
+};
+
+// Register an event source with an event loop, watching it for input
+static void netEventAdd(int epfd, struct net_event *ev)
+{
+    struct epoll_event ee;
+
+    memset(&ee, 0, sizeof(ee));
+    ee.events = EPOLLIN;
+    ee.data.ptr = ev;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, ev->fd, &ee) < 0) {
+        fprintf(stderr, "epoll_ctl(ADD, %d): %s\n", ev->fd, strerror(errno));
+        exit(1);
+    }
+}
+
+// Start or stop watching a client for writability
+static void netEventWantWrite(struct client *c, int want_write)
+{
+    struct epoll_event ee;
+
+    // the ring has no readiness to watch: it's told to send instead
+    if (c->uring) {
+        if (want_write)
+            netUringSend(c);
+        return;
+    }
+
+    if (c->want_write == want_write)
+        return;
+
+    memset(&ee, 0, sizeof(ee));
+    ee.events = EPOLLIN | (want_write ? EPOLLOUT : 0);
+    ee.data.ptr = &c->ev;
+    if (epoll_ctl(c->epfd, EPOLL_CTL_MOD, c->fd, &ee) < 0) {
+        fprintf(stderr, "epoll_ctl(MOD, %d): %s\n", c->fd, strerror(errno));
+        return;
+    }
+    c->want_write = want_write;
+}
 
 //
 //=========================================================================
@@ -74,45 +157,130 @@ struct net_service *serviceInit(const char *descr, struct net_writer *writer, he
         exit(1);
     }
 
+    service->id = Modes.services ? Modes.services->id + 1 : 0;
     service->next = Modes.services;
     Modes.services = service;
 
     service->descr = descr;
     service->listener_count = 0;
     service->connections = 0;
+    service->last_read = 0;
+    service->shard = NET_SHARD_NONE;
     service->writer = writer;
     service->read_sep = sep;
     service->read_mode = mode;
     service->read_handler = handler;
+    service->frame_handler = NULL;
+    service->udp_input = NULL;
 
     if (service->writer) {
-        if (! (service->writer->data = malloc(MODES_OUT_BUF_SIZE)) ) {
-            fprintf(stderr, "Out of memory allocating output buffer for service %s\n", descr);
-            exit(1);
-        }
-
+        service->writer->segment = netSegmentAlloc();
         service->writer->service = service;
         service->writer->dataUsed = 0;
         service->writer->lastWrite = mstime();
         service->writer->send_heartbeat = hb;
+        service->writer->queue_limit = Modes.net_output_queue_size;
+        service->writer->queue_max_age = Modes.net_output_queue_age;
+        service->writer->drop_policy = Modes.net_output_drop_policy;
+        service->writer->format = Modes.net_output_format;
+        service->writer->compress = Modes.net_output_compress;
+        atomic_init(&service->writer->compressed_clients, 0);
+        atomic_init(&service->writer->compress_restart, 0);
+        service->writer->zstream = NULL;
+        service->writer->zsegment = NULL;
+        service->writer->batch_limit = MODES_OUT_BUF_SIZE;
+        service->writer->flush_policy = Modes.net_output_flush_policy;
+        service->writer->flush_size = Modes.net_output_flush_size;
+        service->writer->flush_interval = Modes.net_output_flush_interval;
+        service->writer->flush_urgent = Modes.net_output_flush_urgent;
+        service->writer->batch_start = 0;
+        service->writer->adapt_start = 0;
+        service->writer->adapt_bytes = 0;
+        service->writer->adapt_rate = 0;
+        service->writer->adapt_size = 0;
+        service->writer->rate_bytes = Modes.net_output_rate;
+        service->writer->rate_msgs = Modes.net_output_rate_msgs;
+        service->writer->rate_byte_tokens = 0;
+        service->writer->rate_msg_tokens = 0;
+        service->writer->rate_refill = 0;
+        service->writer->thin_interval = Modes.net_output_thin_interval;
+        service->writer->thin_limit = Modes.net_output_thin_limit;
+        service->writer->thin = NULL;
+        service->writer->udp = NULL;
     }
 
     return service;
 }
 
-// Create a client attached to the given service using the provided socket FD
-struct client *createSocketClient(struct net_service *service, int fd)
+// Start counting for a new client whose other end is at ss (sslen 0 if
+// that isn't known)
+static void netStatsAttachPeer(struct client *c, struct net_worker *worker, const struct sockaddr_storage *ss, socklen_t sslen)
 {
-    anetSetSendBuffer(Modes.aneterr, fd, (MODES_NET_SNDBUF_SIZE << Modes.net_sndbuf_size));
-    return createGenericClient(service, fd);
+    struct net_client_stats *st = &c->stats;
+    char host[NI_MAXHOST], port[NI_MAXSERV];
+
+    memset(st, 0, sizeof(*st));
+    st->service = c->service;
+    st->thread = worker ? worker->id : -1;
+    st->pool = worker ? worker->pool : NET_SHARD_NONE;
+    st->close_reason = NET_CLOSE_PEER;
+
+    if (sslen && getnameinfo((const struct sockaddr *) ss, sslen, host, sizeof(host), port, sizeof(port),
+                             NI_NUMERICHOST | NI_NUMERICSERV) == 0)
+        snprintf(st->peer, sizeof(st->peer), ss->ss_family == AF_INET6 ? "[%s]:%s" : "%s:%s", host, port);
+    else
+        snprintf(st->peer, sizeof(st->peer), "fd %d", c->fd);
+
+    pthread_mutex_lock(&Modes.stats_lock);
+    st->next = Modes.stats_clients;
+    if (st->next)
+        st->next->prev = st;
+    Modes.stats_clients = st;
+    c->service->stats.accepted++;
+    pthread_mutex_unlock(&Modes.stats_lock);
 }
 
-// Create a client attached to the given service using the provided FD (might not be a socket!)
-struct client *createGenericClient(struct net_service *service, int fd)
+// Start counting for a new client with a socket
+static void netStatsAttach(struct client *c, struct net_worker *worker)
+{
+    struct sockaddr_storage ss;
+    socklen_t sslen = sizeof(ss);
+
+    if (getpeername(c->fd, (struct sockaddr *) &ss, &sslen) < 0)
+        sslen = 0;
+    netStatsAttachPeer(c, worker, &ss, sslen);
+}
+
+// Fold a closing client's counters into its service's totals
+static void netStatsDetach(struct client *c)
+{
+    struct net_client_stats *st = &c->stats;
+    struct net_service_stats *ss = &c->service->stats;
+
+    pthread_mutex_lock(&Modes.stats_lock);
+    if (st->prev)
+        st->prev->next = st->next;
+    else
+        Modes.stats_clients = st->next;
+    if (st->next)
+        st->next->prev = st->prev;
+
+    ss->frames_in += atomic_load_explicit(&st->frames_in, memory_order_relaxed);
+    ss->bytes_in += atomic_load_explicit(&st->bytes_in, memory_order_relaxed);
+    ss->frames_out += atomic_load_explicit(&st->frames_out, memory_order_relaxed);
+    ss->bytes_out += atomic_load_explicit(&st->bytes_out, memory_order_relaxed);
+    ss->frames_dropped += atomic_load_explicit(&st->frames_dropped, memory_order_relaxed);
+    ss->disconnects[st->close_reason]++;
+    pthread_mutex_unlock(&Modes.stats_lock);
+}
+
+// Create a client attached to the given service using the provided FD, owned
+// by the given worker's event loop (or the main loop if worker is NULL)
+static struct client *netCreateClient(struct net_service *service, int fd, struct net_worker *worker)
 {
     struct client *c;
 
-    anetNonBlock(Modes.aneterr, fd);
+    anetNonBlock(worker ? worker->aneterr : Modes.aneterr, fd);
 
     if (!(c = (struct client *) malloc(sizeof(*c)))) {
         fprintf(stderr, "Out of memory allocating a new %s network client\n", service->descr);
@@ -120,22 +288,126 @@ struct client *createGenericClient(struct net_service *service, int fd)
     }
 
     c->service    = NULL;
-    c->next       = Modes.clients;
     c->fd         = fd;
-    c->buflen     = 0;
+    c->epfd       = worker ? worker->epfd : Modes.epfd;
+    memset(&c->rbuf, 0, sizeof(c->rbuf));
     c->modeac_requested = 0;
     c->verbatim_requested = true;
     c->local_requested = true;
-    Modes.clients = c;
+    c->sendq = NULL;
+    c->sendq_size = c->sendq_first = c->sendq_count = 0;
+    c->sendq_offset = 0;
+    c->sendq_len = 0;
+    c->want_write = 0;
+    c->close_when_drained = 0;
+    c->timestamping = 0;
+    c->ingress = 0;
+    c->ingress_wait = 0;
+    c->id = atomic_fetch_add_explicit(&Modes.next_client_id, 1, memory_order_relaxed) + 1;
+    c->zerocopy = 0;
+    c->zc_next_id = 0;
+    c->zc_inflight = NULL;
+    c->zc_size = c->zc_first = c->zc_count = 0;
+    c->compress = NET_COMPRESS_OFF;
+    c->inflate = NULL;
+    c->uring = NULL;
+
+    if (worker) {
+        // Segments only ever hold whole frames, so unlike the main thread
+        // there's no partial batch to flush before joining. The connection
+        // was already counted when the socket was accepted or handed over.
+        c->next = worker->clients;
+        worker->clients = c;
+        c->service = service;
+    } else {
+        c->next = Modes.clients;
+        Modes.clients = c;
+        moveNetClient(c, service);
+    }
+
+    c->ev.type = NET_EVENT_CLIENT;
+    c->ev.fd = fd;
+    c->ev.service = service;
+    c->ev.client = c;
+    c->ev.worker = worker;
+    netEventAdd(c->epfd, &c->ev);
 
-    moveNetClient(c, service);
+    netStatsAttach(c, worker);
 
+    if (service->writer && service->writer->compress)
+        netCompressJoin(c);
     return c;
 }
 
+static struct client *netCreateSocketClient(struct net_service *service, int fd, struct net_worker *worker)
+{
+    char *err = worker ? worker->aneterr : Modes.aneterr;
+    struct client *c;
+
+    anetSetSendBuffer(err, fd, (MODES_NET_SNDBUF_SIZE << Modes.net_sndbuf_size));
+    c = netCreateClient(service, fd, worker);
+
+    // Outputs batch for themselves (--out-flush); Nagle would only hold
+    // the batches back further
+    if (service->writer)
+        anetTcpNoDelay(err, fd);
+
+    // Zerocopy only pays off for outputs; quietly fall back to normal
+    // sends if the kernel doesn't support it
+    if (Modes.net_zerocopy && service->writer &&
+        anetSetZeroCopy(err, fd) == ANET_OK)
+        c->zerocopy = 1;
+
+    // For latency measurements inputs are stamped with the time the
+    // kernel received the data, if it can tell us
+    if (Modes.net_latency && !service->writer &&
+        anetSetRxTimestamping(err, fd) == ANET_OK)
+        c->timestamping = 1;
+
+    // An input that wants compression asks for it straight away; what
+    // arrives is plain Beast up to the marker either way
+    if (service->request_compression) {
+        static const char request[] = { 0x1a, '1', NET_COMPRESS_MARKER };
+
+        if (write(fd, request, sizeof(request)) != (ssize_t) sizeof(request))
+            fprintf(stderr, "Couldn't ask %s for compression: %s\n", service->descr, strerror(errno));
+    }
+
+    // The main thread's sockets move over to the ring, unless they need
+    // the socket error queue or control messages, which only epoll serves
+    if (!worker && Modes.uring && !c->zerocopy && !c->timestamping)
+        netUringAttach(c);
+
+    return c;
+}
+
+// Create a client attached to the given service using the provided socket FD
+struct client *createSocketClient(struct net_service *service, int fd)
+{
+    return netCreateSocketClient(service, fd, NULL);
+}
+
+// Create a client attached to the given service using the provided FD (might not be a socket!)
+struct client *createGenericClient(struct net_service *service, int fd)
+{
+    return netCreateClient(service, fd, NULL);
+}
+
+// Give a newly connected socket to the service, on a reader thread if the
+// service's clients are handled there
+static void netAttachSocket(struct net_service *service, int fd)
+{
+    if (netWorkerPool(service->shard, NULL))
+        netWorkerHandoff(service, fd);
+    else
+        createSocketClient(service, fd);
+}
+
 // Initiate an outgoing connection which will use the given service.
-// Return the new client or NULL if the connection failed
-struct client *serviceConnect(struct net_service *service, char *addr, int port)
+// This blocks while resolving and connecting; the event loop uses
+// netConnectorStart instead.
+// Returns 0 if the connection was made, or -1 if it failed
+int serviceConnect(struct net_service *service, char *addr, int port)
 {
     int s;
     char buf[20];
@@ -144,9 +416,487 @@ struct client *serviceConnect(struct net_service *service, char *addr, int port)
     snprintf(buf, 20, "%d", port);
     s = anetTcpConnect(Modes.aneterr, addr, buf);
     if (s == ANET_ERR)
-        return NULL;
+        return -1;
+
+    netAttachSocket(service, s);
+    return 0;
+}
+
+//
+// Non-blocking outgoing connections
+//
+
+// Resolver thread side: look up a name and order the addresses for happy
+// eyeballs, alternating families starting with the preferred one
+static void netResolve(struct net_resolve_msg *msg, const char *host, const char *port)
+{
+    struct addrinfo hints, *res, *p;
+    struct addrinfo *byfamily[2][NET_CONNECT_MAX_ADDRS];
+    int count[2] = { 0, 0 };
+    int first = -1, i, f, rv;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_ADDRCONFIG;
+
+    msg->naddrs = 0;
+    msg->err[0] = 0;
+    if ((rv = getaddrinfo(host, port, &hints, &res)) != 0) {
+        snprintf(msg->err, sizeof(msg->err), "%s", gai_strerror(rv));
+        return;
+    }
+
+    for (p = res; p; p = p->ai_next) {
+        if (p->ai_family != AF_INET && p->ai_family != AF_INET6)
+            continue;
+        f = (p->ai_family == AF_INET6);
+        if (first < 0)
+            first = f;
+        if (count[f] < NET_CONNECT_MAX_ADDRS)
+            byfamily[f][count[f]++] = p;
+    }
+
+    for (i = 0; msg->naddrs < NET_CONNECT_MAX_ADDRS && (i < count[0] || i < count[1]); ++i) {
+        int order[2] = { first, !first };
+        int k;
+
+        for (k = 0; k < 2 && msg->naddrs < NET_CONNECT_MAX_ADDRS; ++k) {
+            f = order[k];
+            if (i >= count[f])
+                continue;
+            if (getnameinfo(byfamily[f][i]->ai_addr, byfamily[f][i]->ai_addrlen,
+                            msg->addrs[msg->naddrs], NET_CONNECT_ADDR_LEN,
+                            NULL, 0, NI_NUMERICHOST) == 0)
+                ++msg->naddrs;
+        }
+    }
+
+    freeaddrinfo(res);
+    if (!msg->naddrs)
+        snprintf(msg->err, sizeof(msg->err), "no usable addresses");
+}
+
+static void *netResolverMain(void *arg)
+{
+    struct net_resolver *r = arg;
+    struct net_resolve_msg msg;
+    uint64_t count = 1;
+
+    while (!Modes.exit) {
+        if (spscPop(&r->requests, &msg) < 0) {
+            // blocks until the main thread queues something
+            if (read(r->reqfd, &count, sizeof(count)) < 0 && errno != EINTR)
+                break;
+            continue;
+        }
+
+        // the main thread owns the connector; only the host and port are
+        // read here, and they don't change while a lookup is outstanding
+        netResolve(&msg, msg.conn->host, msg.conn->port);
+
+        while (spscPush(&r->results, &msg) < 0) {
+            if (Modes.exit)
+                return NULL;
+            sched_yield();
+        }
+        count = 1;
+        if (write(r->donefd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+            fprintf(stderr, "resolver wakeup failed: %s\n", strerror(errno));
+    }
+
+    return NULL;
+}
+
+static void netStartResolver(void)
+{
+    struct net_resolver *r = &Modes.resolver;
+    sigset_t all, old;
+
+    if ((r->reqfd = eventfd(0, EFD_CLOEXEC)) < 0 ||
+        (r->donefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        fprintf(stderr, "resolver eventfd: %s\n", strerror(errno));
+        exit(1);
+    }
+    if (spscInit(&r->requests, MODES_NET_RESOLVER_QUEUE, sizeof(struct net_resolve_msg)) < 0 ||
+        spscInit(&r->results, MODES_NET_RESOLVER_QUEUE, sizeof(struct net_resolve_msg)) < 0) {
+        fprintf(stderr, "Out of memory allocating resolver queues\n");
+        exit(1);
+    }
+
+    r->done_ev.type = NET_EVENT_RESOLVED;
+    r->done_ev.fd = r->donefd;
+    r->done_ev.service = NULL;
+    r->done_ev.client = NULL;
+    r->done_ev.worker = NULL;
+    r->done_ev.connector = NULL;
+    netEventAdd(Modes.epfd, &r->done_ev);
+
+    // Signals are for the main thread only
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    if (pthread_create(&r->thread, NULL, netResolverMain, r) != 0) {
+        fprintf(stderr, "Can't start resolver thread\n");
+        exit(1);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    r->running = 1;
+}
+
+// Stop the resolver thread. Modes.exit must already be set; a lookup in
+// progress is allowed to finish first.
+static void netStopResolver(void)
+{
+    struct net_resolver *r = &Modes.resolver;
+    uint64_t one = 1;
+
+    if (!r->running)
+        return;
+
+    if (write(r->reqfd, &one, sizeof(one)) < 0)
+        fprintf(stderr, "resolver wakeup failed: %s\n", strerror(errno));
+    pthread_join(r->thread, NULL);
+
+    spscFree(&r->requests);
+    spscFree(&r->results);
+    close(r->reqfd);
+    close(r->donefd);
+    r->running = 0;
+}
+
+static void netConnectorFail(struct net_connector *conn)
+{
+    netConnectorCancel(conn);
+    conn->state = NET_CONNECT_FAILED;
+}
+
+// Start connecting to the next address, skipping any that fail at once
+static void netConnectorAttempt(struct net_connector *conn, uint64_t now)
+{
+    while (conn->next < conn->naddrs) {
+        int i = conn->next++;
+        struct net_event *ev = &conn->attempts[i];
+        struct epoll_event ee;
+        int fd;
+
+        if ((fd = anetTcpNonBlockConnect(conn->err, conn->addrs[i], conn->port)) == ANET_ERR)
+            continue;
+
+        ev->type = NET_EVENT_CONNECT;
+        ev->fd = fd;
+        ev->service = conn->service;
+        ev->client = NULL;
+        ev->worker = NULL;
+        ev->connector = conn;
+
+        memset(&ee, 0, sizeof(ee));
+        ee.events = EPOLLOUT;
+        ee.data.ptr = ev;
+        if (epoll_ctl(Modes.epfd, EPOLL_CTL_ADD, fd, &ee) < 0) {
+            fprintf(stderr, "epoll_ctl(ADD, %d): %s\n", fd, strerror(errno));
+            exit(1);
+        }
+
+        ++conn->pending;
+        conn->next_attempt = now + MODES_NET_CONNECT_DELAY;
+        return;
+    }
+
+    if (!conn->pending)
+        netConnectorFail(conn);
+}
+
+// Begin connecting the service to host:port. Returns at once; the outcome
+// shows up later as NET_CONNECT_CONNECTED or NET_CONNECT_FAILED.
+void netConnectorStart(struct net_connector *conn, struct net_service *service, char *host, int port)
+{
+    struct net_resolve_msg msg;
+    uint64_t one = 1;
+
+    if (!Modes.resolver.running)
+        netStartResolver();
+
+    conn->service = service;
+    conn->host = host;
+    snprintf(conn->port, sizeof(conn->port), "%d", port);
+    snprintf(service->addr, sizeof(service->addr), "%s:%d", host, port);
+    NET_STAT_ADD(service->stats.reconnects, 1);
+    conn->state = NET_CONNECT_RESOLVING;
+    conn->naddrs = conn->next = conn->pending = 0;
+    conn->err[0] = 0;
+    conn->give_up = mstime() + MODES_NET_CONNECT_TIMEOUT;
+
+    msg.conn = conn;
+    msg.generation = ++conn->generation;
+    if (spscPush(&Modes.resolver.requests, &msg) < 0) {
+        snprintf(conn->err, sizeof(conn->err), "too many name lookups outstanding");
+        conn->state = NET_CONNECT_FAILED;
+        return;
+    }
+    if (write(Modes.resolver.reqfd, &one, sizeof(one)) < 0)
+        fprintf(stderr, "resolver wakeup failed: %s\n", strerror(errno));
+}
+
+// Abandon any attempts in flight. The connector is left idle.
+void netConnectorCancel(struct net_connector *conn)
+{
+    int i;
+
+    for (i = 0; i < conn->next; ++i) {
+        struct net_event *ev = &conn->attempts[i];
+
+        if (ev->fd < 0 || ev->connector != conn)
+            continue;
+        epoll_ctl(Modes.epfd, EPOLL_CTL_DEL, ev->fd, NULL);
+        close(ev->fd);
+        ev->fd = -1;
+    }
+
+    conn->pending = 0;
+    conn->next = conn->naddrs;
+    conn->state = NET_CONNECT_IDLE;
+}
 
-    return createSocketClient(service, s);
+// Main thread: pick up finished name lookups and start connecting
+static void netResolverDrain(void)
+{
+    struct net_resolve_msg msg;
+    uint64_t count;
+
+    if (read(Modes.resolver.donefd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        fprintf(stderr, "resolver eventfd read: %s\n", strerror(errno));
+
+    while (spscPop(&Modes.resolver.results, &msg) == 0) {
+        struct net_connector *conn = msg.conn;
+        int i;
+
+        // superseded by a later attempt, or already timed out
+        if (conn->state != NET_CONNECT_RESOLVING || msg.generation != conn->generation)
+            continue;
+
+        if (!msg.naddrs) {
+            snprintf(conn->err, sizeof(conn->err), "%s: %s", conn->host, msg.err);
+            conn->state = NET_CONNECT_FAILED;
+            continue;
+        }
+
+        for (i = 0; i < msg.naddrs; ++i) {
+            memcpy(conn->addrs[i], msg.addrs[i], NET_CONNECT_ADDR_LEN);
+            conn->attempts[i].fd = -1;
+        }
+        conn->naddrs = msg.naddrs;
+        conn->state = NET_CONNECT_CONNECTING;
+        netConnectorAttempt(conn, mstime());
+    }
+}
+
+// An attempt became writable (connected) or failed
+static void netConnectorEvent(struct net_event *ev)
+{
+    struct net_connector *conn = ev->connector;
+    int fd = ev->fd;
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    if (fd < 0 || conn->state != NET_CONNECT_CONNECTING)
+        return;
+
+    epoll_ctl(Modes.epfd, EPOLL_CTL_DEL, fd, NULL);
+    ev->fd = -1;
+    --conn->pending;
+
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+        err = errno;
+
+    if (err) {
+        snprintf(conn->err, sizeof(conn->err), "%s: %s", conn->addrs[ev - conn->attempts], strerror(err));
+        close(fd);
+        // don't wait out the delay if nothing else is in flight
+        if (!conn->pending)
+            netConnectorAttempt(conn, mstime());
+        return;
+    }
+
+    // The first to connect wins
+    netConnectorCancel(conn);
+    conn->state = NET_CONNECT_CONNECTED;
+
+    // Notice a peer that vanished without closing the connection
+    if (Modes.net_keepalive) {
+        int interval = Modes.net_keepalive / 3 ? Modes.net_keepalive / 3 : 1;
+
+        if (anetTcpKeepAliveTune(conn->err, fd, Modes.net_keepalive, interval, 3) == ANET_ERR ||
+            anetTcpUserTimeout(conn->err, fd, (Modes.net_keepalive + interval * 3) * 1000) == ANET_ERR)
+            fprintf(stderr, "%s: %s\n", conn->host, conn->err);
+    }
+
+    atomic_store_explicit(&conn->service->last_read, mstime(), memory_order_relaxed);
+    netAttachSocket(conn->service, fd);
+}
+
+// Timed work: start the next parallel attempt, or give up
+void netConnectorPoll(struct net_connector *conn, uint64_t now)
+{
+    if (conn->state != NET_CONNECT_RESOLVING && conn->state != NET_CONNECT_CONNECTING)
+        return;
+
+    if (now >= conn->give_up) {
+        if (conn->state == NET_CONNECT_RESOLVING)
+            snprintf(conn->err, sizeof(conn->err), "%s: name lookup timed out", conn->host);
+        else if (!conn->err[0])
+            snprintf(conn->err, sizeof(conn->err), "connection timed out");
+        netConnectorFail(conn);
+        return;
+    }
+
+    if (conn->state == NET_CONNECT_CONNECTING && now >= conn->next_attempt)
+        netConnectorAttempt(conn, now);
+}
+
+// Close every client of a service, wherever it lives. Clients on worker
+// threads are closed asynchronously; service->connections drops once they
+// are gone.
+void netServiceReset(struct net_service *service)
+{
+    struct net_worker_msg msg;
+    struct net_worker *pool;
+    struct client *c;
+    int count, i;
+
+    for (c = Modes.clients; c; c = c->next) {
+        if (c->service == service)
+            modesCloseClientWhy(c, NET_CLOSE_LOCAL);
+    }
+
+    if (!(pool = netWorkerPool(service->shard, &count)))
+        return;
+
+    msg.type = NET_WORKER_RESET;
+    msg.fd = -1;
+    msg.service = service;
+    msg.seg = NULL;
+    for (i = 0; i < count; ++i) {
+        if (atomic_load(&pool[i].nclients) && netWorkerSend(&pool[i], &msg) < 0)
+            fprintf(stderr, "Worker %d inbox full, can't reset %s\n", pool[i].id, service->descr);
+    }
+}
+
+// Earliest time netConnectorPoll has something to do
+uint64_t netConnectorDeadline(struct net_connector *conn, uint64_t deadline)
+{
+    if (conn->state != NET_CONNECT_RESOLVING && conn->state != NET_CONNECT_CONNECTING)
+        return deadline;
+
+    if (conn->give_up < deadline)
+        deadline = conn->give_up;
+    if (conn->state == NET_CONNECT_CONNECTING && conn->next < conn->naddrs && conn->next_attempt < deadline)
+        deadline = conn->next_attempt;
+    return deadline;
+}
+
+// Parse an output queue drop policy name.
+// Returns 0 on success, -1 if the name is not recognised
+int parseDropPolicy(const char *name, net_drop_policy_t *policy)
+{
+    if (!strcmp(name, "oldest"))
+        *policy = NET_DROP_OLDEST;
+    else if (!strcmp(name, "newest"))
+        *policy = NET_DROP_NEWEST;
+    else if (!strcmp(name, "disconnect"))
+        *policy = NET_DROP_DISCONNECT;
+    else
+        return -1;
+    return 0;
+}
+
+// Parse an output flush policy name.
+// Returns 0 on success, -1 if the name is not recognised
+int parseFlushPolicy(const char *name, net_flush_policy_t *policy)
+{
+    if (!strcmp(name, "latency"))
+        *policy = NET_FLUSH_LATENCY;
+    else if (!strcmp(name, "throughput"))
+        *policy = NET_FLUSH_THROUGHPUT;
+    else if (!strcmp(name, "adaptive"))
+        *policy = NET_FLUSH_ADAPTIVE;
+    else
+        return -1;
+    return 0;
+}
+
+// Parse an output format name.
+// Returns 0 on success, -1 if the name is not recognised
+int parseOutputFormat(const char *name, net_format_t *format)
+{
+    if (!strcmp(name, "beast"))
+        *format = NET_FORMAT_BEAST;
+    else if (!strcmp(name, "raw") || !strcmp(name, "avr"))
+        *format = NET_FORMAT_RAW;
+    else if (!strcmp(name, "sbs") || !strcmp(name, "basestation"))
+        *format = NET_FORMAT_SBS;
+    else
+        return -1;
+    return 0;
+}
+
+// Set up the given service to send its output as UDP datagrams to
+// "host:port[,host:port...]", a multicast group or unicast addresses.
+// _exits_ on failure!
+void serviceUdpOutput(struct net_service *service, const char *targets)
+{
+    struct net_writer *writer = service->writer;
+    char err[256];
+
+    if (!(writer->udp = malloc(sizeof(*writer->udp)))) {
+        fprintf(stderr, "Out of memory setting up UDP output to %s\n", targets);
+        exit(1);
+    }
+    if (udpSenderOpen(writer->udp, targets, Modes.net_udp_ttl, err, sizeof(err)) < 0) {
+        fprintf(stderr, "UDP output to %s: %s\n", targets, err);
+        exit(1);
+    }
+
+    // Every target counts as a subscriber, always there
+    writer->batch_limit = UDP_PAYLOAD_MAX - UDP_HEADER_LEN;
+    service->connections = writer->udp->ntargets;
+    snprintf(service->addr, sizeof(service->addr), "%s", targets);
+}
+
+// Send the datagrams a UDP output has queued during this pass
+void netUdpFlush(struct net_writer *writer)
+{
+    if (!writer->udp || !writer->udp->pending)
+        return;
+    udpSenderFlush(writer->udp);
+    NET_STAT_SET(writer->service->stats.udp_sent, writer->udp->sent);
+    NET_STAT_SET(writer->service->stats.udp_dropped, writer->udp->dropped);
+}
+
+// Set up the given service to take Beast datagrams on bind_addr:port.
+// _exits_ on failure!
+void serviceUdpInput(struct net_service *service, const char *bind_addr, const char *port)
+{
+    struct net_udp_input *in;
+    char err[256];
+
+    if (!(in = calloc(1, sizeof(*in)))) {
+        fprintf(stderr, "Out of memory setting up UDP input on %s:%s\n", bind_addr, port);
+        exit(1);
+    }
+    if (udpReceiverOpen(&in->rx, bind_addr, port, err, sizeof(err)) < 0) {
+        fprintf(stderr, "UDP input on %s:%s: %s\n", bind_addr, port, err);
+        exit(1);
+    }
+
+    service->udp_input = in;
+    snprintf(service->addr, sizeof(service->addr), "%s:%s", bind_addr, port);
+
+    in->ev.type = NET_EVENT_DATAGRAM;
+    in->ev.fd = in->rx.fd;
+    in->ev.service = service;
+    in->ev.client = NULL;
+    in->ev.worker = NULL;
+    netEventAdd(Modes.epfd, &in->ev);
 }
 
 // Set up the given service to listen on an address/port.
@@ -157,6 +907,7 @@ void serviceListen(struct net_service *service, char *bind_addr, char *bind_port
     int n = 0;
     char *p, *end;
     char buf[128];
+    int i;
 
     if (service->listener_count > 0) {
         fprintf(stderr, "Tried to set up the service %s twice!\n", service->descr);
@@ -169,7 +920,7 @@ void serviceListen(struct net_service *service, char *bind_addr, char *bind_port
     p = bind_ports;
     while (p && *p) {
         int newfds[16];
-        int nfds, i;
+        int nfds;
 
         end = strpbrk(p, ", ");
         if (!end) {
@@ -206,30 +957,88 @@ void serviceListen(struct net_service *service, char *bind_addr, char *bind_port
 
     service->listener_count = n;
     service->listener_fds = fds;
+    snprintf(service->addr, sizeof(service->addr), "%s:%s", bind_addr, bind_ports);
+
+    if (!(service->listener_events = calloc(n, sizeof(struct net_event)))) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    for (i = 0; i < n; ++i) {
+        struct net_event *ev = &service->listener_events[i];
+        ev->type = NET_EVENT_LISTENER;
+        ev->fd = fds[i];
+        ev->service = service;
+        ev->client = NULL;
+        ev->worker = NULL;
+        netEventAdd(Modes.epfd, ev);
+    }
 }
 
 
 //
 //=========================================================================
 //
-// This function gets called from time to time when the decoding thread is
-// awakened by new data arriving. This usually happens a few times every second
+// This function gets called by the event loop when a listening socket
+// becomes readable. Accept everything that is pending on it. Clients of
+// sharded services accepted by the main thread are passed on to a worker.
 //
-static struct client * modesAcceptClients(void) {
+static void modesAcceptClients(struct net_event *ev) {
+    char *err = ev->worker ? ev->worker->aneterr : Modes.aneterr;
     int fd;
-    struct net_service *s;
 
-    for (s = Modes.services; s; s = s->next) {
-        int i;
-        for (i = 0; i < s->listener_count; ++i) {
-            while ((fd = anetTcpAccept(Modes.aneterr, s->listener_fds[i])) >= 0) {
-                createSocketClient(s, fd);
-            }
+    while ((fd = anetTcpAccept(err, ev->fd)) >= 0) {
+        if (ev->worker) {
+            atomic_fetch_add(&ev->worker->nclients, 1);
+            ++ev->service->connections;
+            netCreateSocketClient(ev->service, fd, ev->worker);
+        } else if (netWorkerPool(ev->service->shard, NULL)) {
+            netWorkerHandoff(ev->service, fd);
+        } else {
+            createSocketClient(ev->service, fd);
         }
     }
+}
+//
+//=========================================================================
+//
+// Output segments. Each batch of output is built once, in a segment owned by
+// the writer; clients that can't take it immediately queue a reference to
+// the segment rather than a copy of the data.
+//
+static struct net_segment *netSegmentAllocSize(size_t size) {
+    struct net_segment *seg;
+
+    if (!(seg = malloc(sizeof(*seg) + size))) {
+        fprintf(stderr, "Out of memory allocating an output segment\n");
+        exit(1);
+    }
+
+    atomic_init(&seg->refcount, 1);
+    seg->len = 0;
+    seg->frames = 0;
+    seg->created = 0;
+    seg->flushed = 0;
+    seg->stamped = 0;
+    seg->compressed = 0;
+    seg->keyframe = 0;
+    seg->more = 0;
+    return seg;
+}
 
-    return Modes.clients;
+static struct net_segment *netSegmentAlloc(void) {
+    return netSegmentAllocSize(MODES_OUT_BUF_SIZE);
 }
+
+static void netSegmentRetain(struct net_segment *seg) {
+    atomic_fetch_add_explicit(&seg->refcount, 1, memory_order_relaxed);
+}
+
+static void netSegmentRelease(struct net_segment *seg) {
+    if (atomic_fetch_sub_explicit(&seg->refcount, 1, memory_order_acq_rel) == 1)
+        free(seg);
+}
+
 //
 //=========================================================================
 //
@@ -244,88 +1053,1003 @@ static void modesCloseClient(struct client *c) {
     // Clean up, but defer removing from the list until modesNetCleanup().
     // This is because there may be stackframes still pointing at this
     // client (unpredictably: reading from client A may cause client B to
-    // be freed)
+    // be freed). Likewise the event loop may still hold a pending event
+    // for this client; it is skipped because c->service is NULL.
+    // close() also drops the fd from the epoll set; the ring, however,
+    // keeps the socket open until what it holds for it is cancelled.
 
+    if (c->uring)
+        netUringCancel(c);
     close(c->fd);
     c->service->connections--;
 
+    // anything still queued can never be delivered now
+    while (c->sendq_count) {
+        NET_STAT_ADD(c->stats.frames_dropped, c->sendq[c->sendq_first]->frames);
+        netSegmentRelease(c->sendq[c->sendq_first]);
+        c->sendq_first = (c->sendq_first + 1) & (c->sendq_size - 1);
+        c->sendq_count--;
+    }
+    free(c->sendq);
+    c->sendq = NULL;
+    c->sendq_size = c->sendq_first = 0;
+    c->sendq_offset = c->sendq_len = 0;
+
+    // and nothing sent with MSG_ZEROCOPY will be reported complete
+    while (c->zc_count) {
+        netSegmentRelease(c->zc_inflight[c->zc_first].seg);
+        c->zc_first = (c->zc_first + 1) & (c->zc_size - 1);
+        c->zc_count--;
+    }
+    free(c->zc_inflight);
+    c->zc_inflight = NULL;
+    c->zc_size = c->zc_first = 0;
+
+    readbufFree(&c->rbuf);
+    netStatsDetach(c);
+
+    if (c->compress != NET_COMPRESS_OFF)
+        atomic_fetch_sub(&c->service->writer->compressed_clients, 1);
+    c->compress = NET_COMPRESS_OFF;
+    if (c->inflate) {
+        inflateEnd(&c->inflate->strm);
+        free(c->inflate->in);
+        free(c->inflate);
+        c->inflate = NULL;
+    }
+
     // mark it as inactive and ready to be freed
     c->fd = -1;
     c->service = NULL;
     c->modeac_requested = 0;
 }
-//
-//=========================================================================
-//
-// Send the write buffer for the specified writer to all connected clients
-//
-static void flushWrites(struct net_writer *writer) {
-    struct client *c;
 
-    for (c = Modes.clients; c; c = c->next) {
-        if (!c->service)
-            continue;
-        if (c->service == writer->service) {
-#ifndef _WIN32
-            int nwritten = write(c->fd, writer->data, writer->dataUsed);
-#else
-            int nwritten = send(c->fd, writer->data, writer->dataUsed, 0 );
-#endif
-            if (nwritten != writer->dataUsed) {
-                modesCloseClient(c);
-            }
-        }
-    }
+// Close a client, recording why
+static void modesCloseClientWhy(struct client *c, net_close_reason_t why) {
+    c->stats.close_reason = why;
+    modesCloseClient(c);
+}
+
+// The i'th queued segment of a client
+#define SENDQ_AT(c, i) ((c)->sendq[((c)->sendq_first + (i)) & ((c)->sendq_size - 1)])
+
+// Append a segment reference to a client's queue, growing it if needed
+static int modesQueueSegment(struct client *c, struct net_segment *seg) {
+    if (c->sendq_count == c->sendq_size) {
+        int newsize = c->sendq_size ? c->sendq_size * 2 : 16;
+        struct net_segment **newq;
+        int i;
+
+        if (!(newq = malloc(newsize * sizeof(*newq))))
+            return -1;
+        for (i = 0; i < c->sendq_count; ++i)
+            newq[i] = SENDQ_AT(c, i);
+        free(c->sendq);
+        c->sendq = newq;
+        c->sendq_size = newsize;
+        c->sendq_first = 0;
+    }
+
+    netSegmentRetain(seg);
+    c->sendq[(c->sendq_first + c->sendq_count) & (c->sendq_size - 1)] = seg;
+    c->sendq_count++;
+    c->sendq_len += seg->len;
+    NET_STAT_SET(c->stats.backlog, c->sendq_len);
+    return 0;
+}
+
+// Remember that segments were handed to the kernel by the zerocopy send
+// with the given id; they must stay untouched until it reports completion.
+static void modesTrackZerocopy(struct client *c, uint32_t id, struct net_segment **segs, int n) {
+    int i;
+
+    for (i = 0; i < n; ++i) {
+        if (c->zc_count == c->zc_size) {
+            int newsize = c->zc_size ? c->zc_size * 2 : 16;
+            struct net_zc_inflight *newq;
+            int j;
+
+            if (!(newq = malloc(newsize * sizeof(*newq)))) {
+                fprintf(stderr, "Out of memory tracking zerocopy sends\n");
+                exit(1);
+            }
+            for (j = 0; j < c->zc_count; ++j)
+                newq[j] = c->zc_inflight[(c->zc_first + j) & (c->zc_size - 1)];
+            free(c->zc_inflight);
+            c->zc_inflight = newq;
+            c->zc_size = newsize;
+            c->zc_first = 0;
+        }
+
+        netSegmentRetain(segs[i]);
+        c->zc_inflight[(c->zc_first + c->zc_count) & (c->zc_size - 1)].id = id;
+        c->zc_inflight[(c->zc_first + c->zc_count) & (c->zc_size - 1)].seg = segs[i];
+        c->zc_count++;
+    }
+}
+
+// Collect MSG_ZEROCOPY completion notifications from the socket error queue
+// and release the segments they cover.
+static void modesReapZerocopy(struct client *c) {
+    char control[256];
+    struct msghdr msg;
+    struct cmsghdr *cm;
+    struct sock_extended_err *serr;
+
+    for (;;) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (recvmsg(c->fd, &msg, MSG_ERRQUEUE) < 0)
+            return;
+
+        for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                  (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+                continue;
+
+            serr = (struct sock_extended_err *) CMSG_DATA(cm);
+            if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+
+            // Completions on a TCP socket arrive in order, so everything
+            // up to ee_data is done
+            while (c->zc_count && (int32_t) (c->zc_inflight[c->zc_first].id - serr->ee_data) <= 0) {
+                netSegmentRelease(c->zc_inflight[c->zc_first].seg);
+                c->zc_first = (c->zc_first + 1) & (c->zc_size - 1);
+                c->zc_count--;
+            }
+        }
+    }
+}
+
+// --latency: a segment has been completely written to a client
+static void netLatencySent(struct client *c, struct net_segment *seg) {
+    struct net_latency *lat;
+    uint64_t send;
+    int i;
+
+    if (!Modes.net_latency || !seg->stamped)
+        return;
+
+    lat = &(c->ev.worker ? c->ev.worker->latency : Modes.latency)[c->service->id];
+    send = monotonic_usecs() - seg->flushed;
+    histRecord(&lat->send, send, seg->stamped);
+    for (i = 0; i < seg->frames; ++i) {
+        if (seg->ages[i] != UINT32_MAX)
+            histRecord(&lat->total, send + seg->ages[i], 1);
+    }
+}
+
+// Send up to n segments (the first starting at 'offset') with one system
+// call. Returns bytes written or -1 with errno set.
+static ssize_t modesSendSegments(struct client *c, struct net_segment **segs, int n, int offset) {
+    struct iovec iov[MODES_NET_MAX_IOV];
+    struct msghdr msg;
+    ssize_t nwritten;
+    int i, flags = MSG_NOSIGNAL;
+
+    if (n > MODES_NET_MAX_IOV)
+        n = MODES_NET_MAX_IOV;
+
+    // The next batch is already being written: let the kernel hold a
+    // part-filled packet back for it
+    if (segs[n - 1]->more)
+        flags |= MSG_MORE;
+
+    for (i = 0; i < n; ++i) {
+        iov[i].iov_base = segs[i]->data + (i == 0 ? offset : 0);
+        iov[i].iov_len = segs[i]->len - (i == 0 ? offset : 0);
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = n;
+
+    if (!c->zerocopy)
+        return sendmsg(c->fd, &msg, flags);
+
+    if ((nwritten = sendmsg(c->fd, &msg, flags | MSG_ZEROCOPY)) < 0)
+        return nwritten;
+
+    // Every successful zerocopy send consumes one notification id, even if
+    // it turns out the kernel copied the data after all
+    modesTrackZerocopy(c, c->zc_next_id++, segs, n);
+    return nwritten;
+}
+
+//
+//=========================================================================
+//
+// Write as much of a client's output queue as the socket will take.
+// Called when the socket becomes writable.
+//
+static void modesDrainClient(struct client *c) {
+    struct net_segment *segs[MODES_NET_MAX_IOV];
+
+    while (c->sendq_count) {
+        ssize_t nwritten;
+        int n, i;
+
+        for (n = 0; n < c->sendq_count && n < MODES_NET_MAX_IOV; ++n)
+            segs[n] = SENDQ_AT(c, n);
+
+        nwritten = modesSendSegments(c, segs, n, c->sendq_offset);
+        if (nwritten < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                break;
+            modesCloseClientWhy(c, NET_CLOSE_SEND);
+            return;
+        }
+
+        c->sendq_len -= nwritten;
+        NET_STAT_ADD(c->stats.bytes_out, nwritten);
+        nwritten += c->sendq_offset;
+        for (i = 0; i < n && nwritten >= segs[i]->len; ++i) {
+            nwritten -= segs[i]->len;
+            NET_STAT_ADD(c->stats.frames_out, segs[i]->frames);
+            netLatencySent(c, segs[i]);
+            netSegmentRelease(segs[i]);
+            c->sendq_first = (c->sendq_first + 1) & (c->sendq_size - 1);
+            c->sendq_count--;
+        }
+        c->sendq_offset = nwritten;
+
+        if (i < n)
+            break; // short write, socket is full
+    }
+
+    NET_STAT_SET(c->stats.backlog, c->sendq_len);
+
+    if (!c->sendq_count && c->close_when_drained) {
+        modesCloseClientWhy(c, NET_CLOSE_LOCAL);
+        return;
+    }
+
+    netEventWantWrite(c, c->sendq_count > 0);
+}
+
+// What to do when a client's queue overflows. A compressed stream can't
+// lose a piece and carry on, so those clients are always disconnected.
+static net_drop_policy_t modesDropPolicy(struct client *c) {
+    return c->compress != NET_COMPRESS_OFF ? NET_DROP_DISCONNECT : c->service->writer->drop_policy;
+}
+
+// Drop queued segments from the head of a client's queue, oldest first,
+// until at least 'need' more bytes fit under the limit and nothing created
+// before min_created remains. A segment that has been partly written is
+// never dropped, as that would break the framing seen by the client.
+static void modesTrimClientQueue(struct client *c, int limit, int need, uint64_t min_created) {
+    int keep = (c->sendq_offset > 0);
+    int i;
+
+    // nor is anything an io_uring send still has in flight
+    if (c->uring && c->uring->nsegs > keep)
+        keep = c->uring->nsegs;
+
+    while (c->sendq_count > keep) {
+        struct net_segment *seg = SENDQ_AT(c, keep);
+
+        if (c->sendq_len + need <= limit && seg->created >= min_created)
+            break;
+
+        c->sendq_len -= seg->len;
+        NET_STAT_ADD(c->stats.frames_dropped, seg->frames);
+        netSegmentRelease(seg);
+        // slide the kept head up into the freed slot
+        for (i = keep; i > 0; --i)
+            SENDQ_AT(c, i) = SENDQ_AT(c, i - 1);
+        c->sendq_first = (c->sendq_first + 1) & (c->sendq_size - 1);
+        c->sendq_count--;
+    }
+
+    NET_STAT_SET(c->stats.backlog, c->sendq_len);
+}
+
+// Apply the writer's age limit to a client's queue.
+// Returns 1 if more data may be appended to the queue, or 0 if it must be
+// refused (the queue is stale and the policy is to drop new data, or the
+// client has been closed).
+static int modesCheckClientQueueAge(struct client *c, uint64_t now) {
+    struct net_writer *writer = c->service->writer;
+    uint64_t oldest;
+
+    if (!writer || !writer->queue_max_age || !c->sendq_count)
+        return 1;
+    oldest = c->sendq[c->sendq_first]->created;
+    if (oldest + writer->queue_max_age > now)
+        return 1;
+
+    switch (modesDropPolicy(c)) {
+    case NET_DROP_OLDEST:
+        modesTrimClientQueue(c, INT_MAX, 0, now - writer->queue_max_age);
+        return 1;
+    case NET_DROP_NEWEST:
+        return 0;
+    case NET_DROP_DISCONNECT:
+    default:
+        fprintf(stderr, "Output queue for %p stalled for over %" PRIu64 " ms, disconnecting\n",
+                (void *) c, now - oldest);
+        modesCloseClientWhy(c, NET_CLOSE_STALE);
+        return 0;
+    }
+}
+
+// Send a segment to one client, queueing it if the socket won't take it all
+// right now
+static void modesWriteToClient(struct client *c, struct net_segment *seg) {
+    struct net_writer *writer = c->service->writer;
+    ssize_t nwritten = 0;
+
+    if (c->sendq_count || c->uring) {
+        // Can't write directly without reordering, or the ring does the
+        // writing; join the queue
+        if (!modesCheckClientQueueAge(c, seg->created)) {
+            if (c->service)
+                NET_STAT_ADD(c->stats.frames_dropped, seg->frames);
+            return;
+        }
+    } else {
+        nwritten = modesSendSegments(c, &seg, 1, 0);
+        if (nwritten == seg->len) {
+            NET_STAT_ADD(c->stats.bytes_out, nwritten);
+            NET_STAT_ADD(c->stats.frames_out, seg->frames);
+            netLatencySent(c, seg);
+            return;
+        }
+        if (nwritten < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                modesCloseClientWhy(c, NET_CLOSE_SEND);
+                return;
+            }
+            nwritten = 0;
+        }
+        NET_STAT_ADD(c->stats.bytes_out, nwritten);
+    }
+
+    // Once part of the data has been written the rest must be queued, to
+    // keep the framing intact; otherwise it's subject to the queue limit
+    if (nwritten == 0 && c->sendq_len + seg->len > writer->queue_limit) {
+        switch (modesDropPolicy(c)) {
+        case NET_DROP_OLDEST:
+            modesTrimClientQueue(c, writer->queue_limit, seg->len, 0);
+            if (c->sendq_len + seg->len > writer->queue_limit) {
+                NET_STAT_ADD(c->stats.frames_dropped, seg->frames);
+                return;
+            }
+            break;
+        case NET_DROP_NEWEST:
+            NET_STAT_ADD(c->stats.frames_dropped, seg->frames);
+            return;
+        case NET_DROP_DISCONNECT:
+        default:
+            fprintf(stderr, "Output queue for %p over %d bytes, disconnecting\n",
+                    (void *) c, writer->queue_limit);
+            modesCloseClientWhy(c, NET_CLOSE_QUEUE);
+            return;
+        }
+    }
+
+    if (modesQueueSegment(c, seg) < 0) {
+        fprintf(stderr, "Out of memory queueing output for %p\n", (void *) c);
+        modesCloseClientWhy(c, NET_CLOSE_LOCAL);
+        return;
+    }
+
+    // A partial direct write leaves the remainder at the head of the
+    // queue, marked as started so it is never dropped
+    if (nwritten) {
+        c->sendq_offset = nwritten;
+        c->sendq_len -= nwritten;
+        NET_STAT_SET(c->stats.backlog, c->sendq_len);
+    }
+
+    netEventWantWrite(c, 1);
+}
+
+//
+//=========================================================================
+//
+// Stream compression. Each writer has one deflate stream, shared by every
+// client that wants compression, so the CPU cost doesn't grow with the
+// number of them. Every batch ends with a sync flush and decodes completely
+// on arrival. A client that joins is held back until a batch at which the
+// stream was reset, and is sent the marker just before it.
+//
+
+// Room for a compressed batch: deflate never grows data by more than a
+// few bytes per 16K block, plus the sync flush
+#define NET_ZSEGMENT_SIZE (MODES_OUT_BUF_SIZE + MODES_OUT_BUF_SIZE / 16 + 64)
+
+// Switch an output client to the compressed stream, from the next reset.
+// Called by the thread that owns the client.
+void netCompressJoin(struct client *c) {
+    struct net_writer *writer = c->service->writer;
+
+    if (!writer || c->compress != NET_COMPRESS_OFF)
+        return;
+    c->compress = NET_COMPRESS_WAITING;
+    atomic_fetch_add(&writer->compressed_clients, 1);
+    atomic_store(&writer->compress_restart, 1);
+}
+
+// Main thread: run a flushed batch through the writer's deflate stream
+static struct net_segment *netCompressBatch(struct net_writer *writer, struct net_segment *seg) {
+    struct net_segment *zseg;
+    z_stream *z = writer->zstream;
+    int keyframe = atomic_exchange(&writer->compress_restart, 0);
+
+    if (!z) {
+        // raw deflate: no header, so a reset stream is just more blocks
+        if (!(z = calloc(1, sizeof(*z))) ||
+            deflateInit2(z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            fprintf(stderr, "Out of memory setting up output compression\n");
+            exit(1);
+        }
+        writer->zstream = z;
+        keyframe = 1;
+    } else if (keyframe) {
+        deflateReset(z);
+    }
+
+    if (!(zseg = writer->zsegment))
+        zseg = writer->zsegment = netSegmentAllocSize(NET_ZSEGMENT_SIZE);
+
+    z->next_in = (Bytef *) seg->data;
+    z->avail_in = seg->len;
+    z->next_out = (Bytef *) zseg->data;
+    z->avail_out = NET_ZSEGMENT_SIZE;
+    if (deflate(z, Z_SYNC_FLUSH) != Z_OK || z->avail_in || !z->avail_out) {
+        // can't happen with the output sized as above
+        fprintf(stderr, "Output compression failed: %s\n", z->msg ? z->msg : "no room");
+        exit(1);
+    }
+
+    zseg->len = NET_ZSEGMENT_SIZE - z->avail_out;
+    zseg->frames = seg->frames;
+    zseg->created = seg->created;
+    zseg->flushed = seg->flushed;
+    zseg->stamped = seg->stamped;
+    if (Modes.net_latency)
+        memcpy(zseg->ages, seg->ages, seg->frames * sizeof(seg->ages[0]));
+    zseg->compressed = 1;
+    zseg->keyframe = keyframe;
+    zseg->more = seg->more;
+
+    NET_STAT_ADD(writer->service->stats.deflate_in, seg->len);
+    NET_STAT_ADD(writer->service->stats.deflate_out, zseg->len);
+    return zseg;
+}
+
+// Send a batch to a client if it's in the form the client takes
+static void netClientSend(struct client *c, struct net_segment *seg) {
+    if (c->compress == NET_COMPRESS_OFF) {
+        if (!seg->compressed)
+            modesWriteToClient(c, seg);
+        return;
+    }
+    if (!seg->compressed)
+        return;
+
+    if (c->compress == NET_COMPRESS_WAITING) {
+        struct net_segment *marker;
+
+        if (!seg->keyframe)
+            return;
+        marker = netSegmentAllocSize(2);
+        marker->data[0] = 0x1a;
+        marker->data[1] = NET_COMPRESS_MARKER;
+        marker->len = 2;
+        marker->created = seg->created;
+        modesWriteToClient(c, marker);
+        netSegmentRelease(marker);
+        if (!c->service)
+            return;
+        c->compress = NET_COMPRESS_ON;
+    }
+    modesWriteToClient(c, seg);
+}
+
+//
+//=========================================================================
+//
+// Worker threads. Each runs its own event loop over a share of the clients
+// of sharded services: output workers take --outServer clients, input
+// readers take --inServer/--inConnect clients. The main thread talks to a
+// worker only through its single-producer inbox ring plus an eventfd
+// wakeup, and the segments it passes on are reference counted. Readers
+// send framed input back through the multi-producer fanout ring. So the
+// data path takes no locks.
+//
+
+// The pool of workers that takes clients of the given kind, or NULL if
+// that kind of client stays on the main thread
+static struct net_worker *netWorkerPool(net_shard_t shard, int *count) {
+    struct net_worker *pool = NULL;
+    int n = 0;
+
+    switch (shard) {
+    case NET_SHARD_OUTPUT:
+        pool = Modes.workers;
+        n = Modes.net_workers;
+        break;
+    case NET_SHARD_INPUT:
+        pool = Modes.readers;
+        n = Modes.net_readers;
+        break;
+    case NET_SHARD_NONE:
+        break;
+    }
+
+    if (count)
+        *count = n;
+    return n ? pool : NULL;
+}
+
+// Queue a message for a worker. On success the worker is woken at the end
+// of the current pass of the main loop. Returns 0, or -1 if the inbox is full
+static int netWorkerSend(struct net_worker *w, struct net_worker_msg *msg) {
+    if (spscPush(&w->inbox, msg) < 0) {
+        w->inbox_drops++;
+        return -1;
+    }
+    w->wake_pending = 1;
+    return 0;
+}
+
+// Hand a newly connected socket to the least loaded worker of the
+// service's pool. The connection counts as active from now on.
+static void netWorkerHandoff(struct net_service *service, int fd) {
+    int count, i;
+    struct net_worker *pool = netWorkerPool(service->shard, &count);
+    struct net_worker *best = &pool[0];
+    struct net_worker_msg msg;
+
+    for (i = 1; i < count; ++i) {
+        if (atomic_load(&pool[i].nclients) < atomic_load(&best->nclients))
+            best = &pool[i];
+    }
+
+    msg.type = NET_WORKER_ADD_CLIENT;
+    msg.fd = fd;
+    msg.service = service;
+    msg.seg = NULL;
+
+    atomic_fetch_add(&best->nclients, 1);
+    ++service->connections;
+    if (netWorkerSend(best, &msg) < 0) {
+        fprintf(stderr, "Worker %d inbox full, dropping new %s connection\n", best->id, service->descr);
+        atomic_fetch_sub(&best->nclients, 1);
+        --service->connections;
+        close(fd);
+    }
+}
+
+// Pass a flushed segment on to every worker that has clients
+static void netWorkersPublish(struct net_service *service, struct net_segment *seg) {
+    struct net_worker_msg msg;
+    int i;
+
+    msg.type = NET_WORKER_SEGMENT;
+    msg.fd = -1;
+    msg.service = service;
+    msg.seg = seg;
+
+    for (i = 0; i < Modes.net_workers; ++i) {
+        struct net_worker *w = &Modes.workers[i];
+
+        if (!atomic_load_explicit(&w->nclients, memory_order_relaxed))
+            continue;
+
+        netSegmentRetain(seg);
+        if (netWorkerSend(w, &msg) < 0)
+            netSegmentRelease(seg);
+    }
+}
+
+// Wake every worker that has been sent something since the last call
+void netWorkersWake(void) {
+    static const net_shard_t pools[] = { NET_SHARD_OUTPUT, NET_SHARD_INPUT };
+    uint64_t one = 1;
+    unsigned p;
+    int count, i;
+
+    for (p = 0; p < sizeof(pools) / sizeof(pools[0]); ++p) {
+        struct net_worker *pool = netWorkerPool(pools[p], &count);
+
+        for (i = 0; i < count; ++i) {
+            struct net_worker *w = &pool[i];
+
+            if (!w->wake_pending)
+                continue;
+            w->wake_pending = 0;
+            if (write(w->wakefd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+                fprintf(stderr, "Worker %d wakeup failed: %s\n", w->id, strerror(errno));
+        }
+    }
+}
+
+// Reader side: queue a frame for the main thread. The main thread is woken
+// once the reader has finished its current pass. If the main thread has
+// fallen behind, wait for it rather than drop input; the reader stops
+// reading meanwhile, so TCP pushes back on the feeders.
+// Returns 0, or -1 if the frame was dropped
+int netFanoutPush(struct client *c, const char *data, int len) {
+    struct net_worker *w = c->ev.worker;
+    struct net_frame frame;
+    uint64_t one = 1;
+
+    if (len > NET_FRAME_MAX)
+        return -1;
+
+    frame.ingress = c->ingress;
+    frame.ingress_wait = c->ingress_wait;
+    frame.len = len;
+    memcpy(frame.data, data, len);
+    if (mpscPush(&Modes.fanout, &frame) == 0) {
+        w->fanout_pending = 1;
+        return 0;
+    }
+
+    atomic_fetch_add_explicit(&Modes.fanout_stalls, 1, memory_order_relaxed);
+    if (write(Modes.fanoutfd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        fprintf(stderr, "Worker %d: fanout wakeup failed: %s\n", w->id, strerror(errno));
+    while (mpscPush(&Modes.fanout, &frame) < 0) {
+        if (Modes.exit)
+            return -1;
+        sched_yield();
+    }
+
+    w->fanout_pending = 1;
+    return 0;
+}
+
+// Main thread: hand queued input frames to the fan-out stage, a batch at a
+// time so that a flood of input can't starve everything else
+static void netFanoutDrain(void) {
+    struct net_frame frame;
+    int n;
+
+    for (n = 0; n < MODES_NET_FANOUT_BATCH; ++n) {
+        if (mpscPop(&Modes.fanout, &frame) < 0)
+            break;
+        Modes.net_ingress = frame.ingress;
+        Modes.net_ingress_wait = frame.ingress_wait;
+        Modes.fanout_handler(frame.data, frame.len);
+    }
+    Modes.net_ingress = 0;
+
+    if (n < MODES_NET_FANOUT_BATCH)
+        return;
+
+    // more to do; come back on the next pass
+    uint64_t one = 1;
+    if (write(Modes.fanoutfd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        fprintf(stderr, "fanout wakeup failed: %s\n", strerror(errno));
+}
+
+// Worker side: act on everything in the inbox
+static void netWorkerDrainInbox(struct net_worker *w) {
+    struct net_worker_msg msg;
+    struct client *c;
+
+    while (spscPop(&w->inbox, &msg) == 0) {
+        switch (msg.type) {
+        case NET_WORKER_ADD_CLIENT:
+            netCreateSocketClient(msg.service, msg.fd, w);
+            break;
+
+        case NET_WORKER_SEGMENT:
+            for (c = w->clients; c; c = c->next) {
+                if (c->service == msg.service)
+                    netClientSend(c, msg.seg);
+            }
+            netSegmentRelease(msg.seg);
+            break;
+
+        case NET_WORKER_RESET:
+            for (c = w->clients; c; c = c->next) {
+                if (c->service == msg.service)
+                    modesCloseClientWhy(c, NET_CLOSE_LOCAL);
+            }
+            break;
+        }
+    }
+}
+
+// --latency: stamp a batch as it is flushed, and record how long each
+// message in it waited for the batch to go
+static void netLatencyFlush(struct net_writer *writer, struct net_segment *seg) {
+    struct net_latency *lat = &Modes.latency[writer->service->id];
+    uint64_t now = monotonic_usecs();
+    int i;
+
+    seg->flushed = now;
+    seg->stamped = 0;
+    for (i = 0; i < seg->frames; ++i) {
+        uint64_t batch, age;
+
+        if (!writer->ingress[i]) {
+            seg->ages[i] = UINT32_MAX; // heartbeat
+            continue;
+        }
+
+        batch = now > writer->ingress[i] ? now - writer->ingress[i] : 0;
+        histRecord(&lat->batch, batch, 1);
+        age = batch + writer->ingress_wait[i];
+        seg->ages[i] = age < UINT32_MAX ? age : UINT32_MAX - 1;
+        seg->stamped++;
+    }
+}
+
+//
+//=========================================================================
+//
+// Send the write buffer for the specified writer to all connected clients.
+// Clients that can't keep up get a reference to it queued instead, within
+// the writer's queue limits.
+//
+// --out-flush adaptive: every NET_FLUSH_ADAPT_WINDOW ms, estimate the rate
+// this output batches at and size batches to fill in flush_interval. When
+// that comes to only a few messages there's nothing to gain by waiting,
+// and the output flushes every pass as in latency mode.
+static void netFlushAdapt(struct net_writer *writer, int len, uint64_t now)
+{
+    uint64_t window = now - writer->adapt_start;
+    double rate, size;
+
+    writer->adapt_bytes += len;
+    if (window < NET_FLUSH_ADAPT_WINDOW)
+        return;
+
+    rate = (double) writer->adapt_bytes / window;
+    writer->adapt_rate = writer->adapt_rate ? (3 * writer->adapt_rate + rate) / 4 : rate;
+    writer->adapt_start = now;
+    writer->adapt_bytes = 0;
+
+    size = writer->adapt_rate * writer->flush_interval;
+    if (size < NET_FLUSH_ADAPT_MIN)
+        writer->adapt_size = 0;
+    else if (size > writer->batch_limit)
+        writer->adapt_size = writer->batch_limit;
+    else
+        writer->adapt_size = (int) size;
+}
+
+// Bytes at which the batch is sent without waiting for the end of the pass
+static int netFlushSize(struct net_writer *writer)
+{
+    if (writer->flush_policy == NET_FLUSH_ADAPTIVE && writer->adapt_size)
+        return writer->adapt_size;
+    return writer->flush_size;
+}
+
+// Whether a batch should be sent at the end of this pass of the event loop
+int netFlushDue(struct net_writer *writer, uint64_t now)
+{
+    if (!writer->dataUsed)
+        return 0;
+
+    switch (writer->flush_policy) {
+    case NET_FLUSH_ADAPTIVE:
+        if (!writer->adapt_size)
+            return 1;
+        // fall through
+    case NET_FLUSH_THROUGHPUT:
+        return now >= writer->batch_start + writer->flush_interval;
+    case NET_FLUSH_LATENCY:
+    default:
+        return 1;
+    }
+}
+
+// --out-rate: refill a writer's token buckets, then take a message of
+// class 'cls' and 'len' bytes from them if that leaves the classes above
+// it their share. Returns 1 if the message may go out, 0 if it is shed.
+int netRateAdmit(struct net_writer *writer, net_class_t cls, int len, uint64_t now)
+{
+    double byte_max = writer->rate_bytes * (NET_RATE_BURST / 1000.0);
+    double msg_max = writer->rate_msgs * (NET_RATE_BURST / 1000.0);
+    double share = (double) (NET_CLASSES - 1 - cls) / NET_CLASSES;
+
+    if (!writer->rate_refill) {
+        writer->rate_byte_tokens = byte_max;
+        writer->rate_msg_tokens = msg_max;
+    } else if (now > writer->rate_refill) {
+        double elapsed = (now - writer->rate_refill) / 1e6;
+
+        writer->rate_byte_tokens += writer->rate_bytes * elapsed;
+        if (writer->rate_byte_tokens > byte_max)
+            writer->rate_byte_tokens = byte_max;
+        writer->rate_msg_tokens += writer->rate_msgs * elapsed;
+        if (writer->rate_msg_tokens > msg_max)
+            writer->rate_msg_tokens = msg_max;
+    }
+    writer->rate_refill = now;
+
+    if ((writer->rate_bytes && writer->rate_byte_tokens - len < share * byte_max) ||
+        (writer->rate_msgs && writer->rate_msg_tokens - 1 < share * msg_max)) {
+        NET_STAT_ADD(writer->service->stats.frames_shed[cls], 1);
+        return 0;
+    }
+
+    writer->rate_byte_tokens -= len;
+    writer->rate_msg_tokens -= 1;
+    return 1;
+}
+
+// Send the batch. 'more' says the next one is being written already
+static void netFlush(struct net_writer *writer, int more) {
+    struct net_segment *seg = writer->segment;
+    struct net_segment *zseg = NULL;
+    struct client *c;
+    uint64_t now = mstime();
+
+    seg->len = writer->dataUsed;
+    seg->frames = writer->frames;
+    seg->created = now;
+    seg->more = more;
+    if (writer->flush_policy == NET_FLUSH_ADAPTIVE)
+        netFlushAdapt(writer, seg->len, now);
+    if (Modes.net_latency)
+        netLatencyFlush(writer, seg);
+
+    if (seg->len && writer->udp) {
+        // one datagram per batch, whoever is listening
+        udpSenderQueue(writer->udp, seg->data, seg->len);
+        NET_STAT_SET(writer->service->stats.udp_sent, writer->udp->sent);
+        NET_STAT_SET(writer->service->stats.udp_dropped, writer->udp->dropped);
+    } else if (seg->len) {
+        if (atomic_load(&writer->compressed_clients))
+            zseg = netCompressBatch(writer, seg);
+
+        for (c = Modes.clients; c; c = c->next) {
+            if (!c->service)
+                continue;
+            if (c->service == writer->service) {
+                netClientSend(c, seg);
+                if (zseg && c->service)
+                    netClientSend(c, zseg);
+            }
+        }
+
+        if (writer->service->shard == NET_SHARD_OUTPUT) {
+            netWorkersPublish(writer->service, seg);
+            if (zseg)
+                netWorkersPublish(writer->service, zseg);
+        }
+    }
+
+    // If nobody kept a reference the segment can be reused for the next
+    // batch; otherwise start a fresh one and let the clients free this one
+    if (atomic_load_explicit(&seg->refcount, memory_order_acquire) != 1) {
+        netSegmentRelease(seg);
+        writer->segment = netSegmentAlloc();
+    }
+    if (zseg && atomic_load_explicit(&zseg->refcount, memory_order_acquire) != 1) {
+        netSegmentRelease(zseg);
+        writer->zsegment = NULL;
+    }
 
     writer->dataUsed = 0;
-    writer->lastWrite = mstime();
+    writer->frames = 0;
+    writer->lastWrite = now;
+}
+
+void flushWrites(struct net_writer *writer) {
+    netFlush(writer, 0);
 }
 
 // Prepare to write up to 'len' bytes to the given net_writer.
 // Returns a pointer to write to, or NULL to skip this write.
-static void *prepareWrite(struct net_writer *writer, int len) {
+void *prepareWrite(struct net_writer *writer, int len) {
     if (!writer ||
         !writer->service ||
-        !writer->service->connections ||
-        !writer->data)
+        !writer->segment)
         return NULL;
 
-    if (len > MODES_OUT_BUF_SIZE)
+    if (!writer->service->connections) {
+        NET_STAT_ADD(writer->service->stats.drops_idle, 1);
         return NULL;
+    }
 
-    if (writer->dataUsed + len >= MODES_OUT_BUF_SIZE) {
-        // Flush now to free some space
-        flushWrites(writer);
+    if (len > writer->batch_limit) {
+        NET_STAT_ADD(writer->service->stats.drops_oversize, 1);
+        return NULL;
+    }
+
+    if (writer->dataUsed + len >= writer->batch_limit || writer->frames >= NET_SEGMENT_MAX_FRAMES) {
+        // Flush now to free some space. Outputs that favour throughput
+        // have the kernel wait for this message too before sending a
+        // part-filled packet
+        netFlush(writer, writer->flush_policy != NET_FLUSH_LATENCY);
     }
 
-    return writer->data + writer->dataUsed;
+    return writer->segment->data + writer->dataUsed;
 }
 
 // Complete a write previously begun by prepareWrite.
 // endptr should point one byte past the last byte written
 // to the buffer returned from prepareWrite.
-static void completeWrite(struct net_writer *writer, void *endptr) {
-    writer->dataUsed = endptr - writer->data;
+void completeWrite(struct net_writer *writer, void *endptr) {
+    if (!writer->frames)
+        writer->batch_start = mstime();
+    writer->dataUsed = (char *) endptr - writer->segment->data;
+    if (Modes.net_latency) {
+        writer->ingress[writer->frames] = Modes.net_ingress;
+        writer->ingress_wait[writer->frames] = Modes.net_ingress_wait;
+        if (Modes.net_ingress)
+            histRecord(&Modes.latency[writer->service->id].wait, Modes.net_ingress_wait, 1);
+    }
+    writer->frames++;
+    NET_STAT_ADD(writer->service->stats.frames_batched, 1);
 
-    if (writer->dataUsed >= Modes.net_output_flush_size) {
+    if (writer->dataUsed >= netFlushSize(writer)) {
         flushWrites(writer);
     }
 }
 
-static void send_beast_heartbeat(struct net_service *service)
+// Send a one-off reply to a single client (for request/response services
+// such as the metrics endpoint) and close the connection once it has all
+// been written. The reply goes out from the event loop, so this is safe to
+// call from a read handler.
+void netClientReply(struct client *c, const char *data, int len) {
+    struct net_segment *seg;
+
+    if (c->close_when_drained)
+        return; // already answered
+
+    seg = netSegmentAllocSize(len);
+    seg->len = len;
+    seg->created = mstime();
+    memcpy(seg->data, data, len);
+
+    if (modesQueueSegment(c, seg) < 0) {
+        fprintf(stderr, "Out of memory queueing a reply for %p\n", (void *) c);
+        netSegmentRelease(seg);
+        return;
+    }
+    netSegmentRelease(seg);
+    c->close_when_drained = 1;
+    netEventWantWrite(c, 1);
+}
+
+// Queue a message that keeps an idle connection from looking dead, in
+// whatever form the output's clients will ignore
+void send_heartbeat(struct net_service *service)
 {
-    static char heartbeat_message[] = { 0x1a, '1', 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+    static const char beast_heartbeat[] = { 0x1a, '1', 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+    static const char raw_heartbeat[] = "*0000;\n";
+    static const char sbs_heartbeat[] = "\r\n";
+    const char *message;
+    int len;
     char *data;
 
     if (!service->writer)
         return;
 
-    data = prepareWrite(service->writer, sizeof(heartbeat_message));
+    switch (service->writer->format) {
+    case NET_FORMAT_RAW:
+        message = raw_heartbeat;
+        len = sizeof(raw_heartbeat) - 1;
+        break;
+    case NET_FORMAT_SBS:
+        message = sbs_heartbeat;
+        len = sizeof(sbs_heartbeat) - 1;
+        break;
+    default:
+        message = beast_heartbeat;
+        len = sizeof(beast_heartbeat);
+        break;
+    }
+
+    data = prepareWrite(service->writer, len);
     if (!data)
         return;
 
-    memcpy(data, heartbeat_message, sizeof(heartbeat_message));
-    completeWrite(service->writer, data + sizeof(heartbeat_message));
+    memcpy(data, message, len);
+    completeWrite(service->writer, data + len);
 }
 
 
@@ -358,6 +2082,123 @@ static void moveNetClient(struct client *c, struct net_service *new_service)
     c->service = new_service;
 }
 
+// read() for a socket with SO_TIMESTAMPING on: also work out how long the
+// data had been sitting in the kernel, from the receive timestamp
+static ssize_t modesReadStamped(struct client *c, void *buf, size_t len) {
+    char control[CMSG_SPACE(sizeof(struct timespec) * 3)];
+    struct iovec iov = { buf, len };
+    struct msghdr msg;
+    struct cmsghdr *cm;
+    ssize_t nread;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    if ((nread = recvmsg(c->fd, &msg, 0)) <= 0)
+        return nread;
+
+    c->ingress = monotonic_usecs();
+    c->ingress_wait = 0;
+
+    for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+        if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPING) {
+            // the software timestamp is the first of three, on CLOCK_REALTIME
+            struct timespec rx, now;
+            int64_t wait;
+
+            memcpy(&rx, CMSG_DATA(cm), sizeof(rx));
+            clock_gettime(CLOCK_REALTIME, &now);
+            wait = (int64_t) (now.tv_sec - rx.tv_sec) * 1000000 + (now.tv_nsec - rx.tv_nsec) / 1000;
+            if (rx.tv_sec && wait > 0)
+                c->ingress_wait = wait < UINT32_MAX ? (uint32_t) wait : UINT32_MAX;
+        }
+    }
+
+    return nread;
+}
+
+// read() from a client's socket, or for one driven by the ring, from what
+// its latest receive completion delivered
+static ssize_t netClientRead(struct client *c, void *buf, size_t len) {
+    struct net_uring_io *u = c->uring;
+
+    if (!u)
+        return c->timestamping ? modesReadStamped(c, buf, len) : read(c->fd, buf, len);
+
+    if (u->in_len) {
+        if (len > u->in_len)
+            len = u->in_len;
+        memcpy(buf, u->in, len);
+        u->in += len;
+        u->in_len -= len;
+        return len;
+    }
+    if (u->in_done && !u->in_err)
+        return 0;
+    errno = u->in_done ? u->in_err : EAGAIN;
+    return -1;
+}
+
+// The rest of an input's stream is compressed, starting with the 'len'
+// bytes already read after the marker.
+// Returns 0, or -1 if out of memory
+static int netInflateStart(struct client *c, const char *data, size_t len) {
+    struct net_inflate *z;
+
+    if (!(z = calloc(1, sizeof(*z))))
+        return -1;
+    z->size = len > NET_INFLATE_BUF ? len : NET_INFLATE_BUF;
+    if (!(z->in = malloc(z->size)) || inflateInit2(&z->strm, -15) != Z_OK) {
+        free(z->in);
+        free(z);
+        return -1;
+    }
+    memcpy(z->in, data, len);
+    z->strm.next_in = z->in;
+    z->strm.avail_in = len;
+    c->inflate = z;
+    return 0;
+}
+
+// read() for a compressed input: inflate what's buffered, reading more
+// from the socket whenever that runs out, until 'len' bytes have come out
+// or the socket has nothing more. Counts the bytes on the wire.
+static ssize_t modesReadCompressed(struct client *c, char *buf, size_t len) {
+    struct net_inflate *z = c->inflate;
+    size_t produced = 0;
+    ssize_t nread;
+    int ret;
+
+    while (produced < len) {
+        if (!z->strm.avail_in) {
+            nread = netClientRead(c, z->in, z->size);
+            if (nread <= 0)
+                return produced ? (ssize_t) produced : nread;
+            NET_STAT_ADD(c->stats.bytes_in, nread);
+            z->strm.next_in = z->in;
+            z->strm.avail_in = nread;
+        }
+
+        z->strm.next_out = (Bytef *) buf + produced;
+        z->strm.avail_out = len - produced;
+        ret = inflate(&z->strm, Z_SYNC_FLUSH);
+        produced = len - z->strm.avail_out;
+        if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            // corrupt, or ended: nothing more can be decoded
+            if (produced)
+                return produced;
+            fprintf(stderr, "Compressed input from %s: %s\n", c->stats.peer,
+                    ret == Z_STREAM_END ? "stream ended" : (z->strm.msg ? z->strm.msg : "inflate failed"));
+            errno = EPROTO;
+            return -1;
+        }
+    }
+    return produced;
+}
+
 //
 //=========================================================================
 //
@@ -373,29 +2214,53 @@ static void moveNetClient(struct client *c, struct net_service *new_service)
 // The handler returns 0 on success, or 1 to signal this function we should
 // close the connection with the client in case of non-recoverable errors.
 //
-static void modesReadFromClient(struct client *c) {
-    int left;
-    int nread;
+void modesReadFromClient(struct client *c) {
+    struct readbuf *rb = &c->rbuf;
+    size_t left;
+    ssize_t nread;
     int bContinue = 1;
 
-    while (bContinue) {
-        left = MODES_CLIENT_BUF_SIZE - c->buflen - 1; // leave 1 extra byte for NUL termination in the ASCII case
+    // Outputs don't expect anything from the other end: throw it away
+    // without giving them a buffer
+    if (c->service->read_mode == READ_MODE_IGNORE) {
+        char scratch[512];
+
+        while ((nread = netClientRead(c, scratch, sizeof(scratch))) > 0)
+            ;
+        if (nread == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+            modesCloseClient(c);
+        return;
+    }
 
-        // If our buffer is full discard it, this is some badly formatted shit
-        if (left <= 0) {
-            c->buflen = 0;
-            left = MODES_CLIENT_BUF_SIZE;
+    if (!rb->base && readbufReserve(rb, MODES_CLIENT_BUF_SIZE) < 0) {
+        fprintf(stderr, "Out of memory allocating a read buffer for a %s client\n", c->service->descr);
+        modesCloseClient(c);
+        return;
+    }
+
+    while (bContinue) {
+        left = readbufSpace(rb);
+
+        // If our buffer is full, grow it; at the size limit, discard it,
+        // this is some badly formatted shit
+        if (left == 0) {
+            if (rb->size >= MODES_CLIENT_BUF_MAX || readbufReserve(rb, rb->size * 2) < 0)
+                readbufConsume(rb, rb->len);
+            left = readbufSpace(rb);
             // If there is garbage, read more to discard it ASAP
         }
 #ifndef _WIN32
-        nread = read(c->fd, c->buf+c->buflen, left);
+        if (c->inflate)
+            nread = modesReadCompressed(c, readbufTail(rb), left);
+        else
+            nread = netClientRead(c, readbufTail(rb), left);
 #else
-        nread = recv(c->fd, c->buf+c->buflen, left, 0);
+        nread = recv(c->fd, readbufTail(rb), left, 0);
         if (nread < 0) {errno = WSAGetLastError();}
 #endif
 
         // If we didn't get all the data we asked for, then return once we've processed what we did get.
-        if (nread != left) {
+        if (nread < 0 || (size_t) nread != left) {
             bContinue = 0;
         }
 
@@ -418,10 +2283,31 @@ static void modesReadFromClient(struct client *c) {
             return;
         }
 
-        c->buflen += nread;
+        rb->len += nread;
+        atomic_store_explicit(&c->service->last_read, mstime(), memory_order_relaxed);
+        if (!c->inflate)
+            NET_STAT_ADD(c->stats.bytes_in, nread);
+        if ((Modes.net_latency || Modes.capture) && !c->timestamping) {
+            c->ingress = monotonic_usecs();
+            c->ingress_wait = 0;
+        }
 
-        char *som = c->buf;           // first byte of next message
-        char *eod = som + c->buflen;  // one byte past end of data
+        // Filled the buffer: there's a burst on. Size the buffer to what
+        // is still waiting in the socket so it's taken in fewer reads.
+        // (The ring has already taken it out of the socket.)
+        if (bContinue && rb->size < MODES_CLIENT_BUF_MAX && !c->uring) {
+            int pending = 0;
+
+            if (ioctl(c->fd, FIONREAD, &pending) == 0 && pending > 0) {
+                size_t want = rb->len + pending;
+                if (want > MODES_CLIENT_BUF_MAX - 1)
+                    want = MODES_CLIENT_BUF_MAX - 1;
+                readbufReserve(rb, want);
+            }
+        }
+
+        char *som = readbufData(rb);  // first byte of next message
+        char *eod = som + rb->len;    // one byte past end of data
         char *p;
 
         switch (c->service->read_mode) {
@@ -430,59 +2316,63 @@ static void modesReadFromClient(struct client *c) {
             som = eod;
             break;
 
-        case READ_MODE_BEAST:
+        case READ_MODE_BEAST: {
             // This is the Beast Binary scanning case.
-            // If there is a complete message still in the buffer, there must be the separator 'sep'
-            // in the buffer, note that we full-scan the buffer at every read for simplicity.
-
-            while (som < eod && ((p = memchr(som, (char) 0x1a, eod - som)) != NULL)) { // The first byte of buffer 'should' be 0x1a
-                som = p; // consume garbage up to the 0x1a
-                ++p; // skip 0x1a
-
-                if (p >= eod) {
-                    // Incomplete message in buffer, retry later
-                    break;
-                }
-
-                char *eom; // one byte past end of message
-                if        (*p == '1') {
-                    eom = p + MODEAC_MSG_BYTES      + 8;         // point past remainder of message
-                } else if (*p == '2') {
-                    eom = p + MODES_SHORT_MSG_BYTES + 8;
-                } else if (*p == '3') {
-                    eom = p + MODES_LONG_MSG_BYTES  + 8;
-                } else if (*p == '4') {
-                    eom = p + MODES_LONG_MSG_BYTES  + 8;
-                } else if (*p == '5') {
-                    eom = p + MODES_LONG_MSG_BYTES  + 8;
-                } else {
-                    // Not a valid beast message, skip 0x1a and try again
-                    ++som;
-                    continue;
-                }
-
-                // we need to be careful of double escape characters in the message body
-                for (p = som + 1; p < eod && p < eom; p++) {
-                    if (0x1A == *p) {
-                        p++;
-                        eom++;
+            // Every 0x1a in the buffer is found up front by the vector
+            // scanner; frame starts and doubled escapes inside frames then
+            // come from the mask rather than a byte at a time, and the
+            // handler gets the frame already measured.
+            uint64_t mask[BEAST_MASK_WORDS(MODES_CLIENT_BUF_MAX)];
+            const unsigned char *base = (const unsigned char *) som;
+            size_t len = rb->len;
+            size_t pos = 0;
+            struct beast_frame frame;
+            int found = 0;
+
+            beastScanMask(base, len, mask);
+
+            while ((pos = beastNextEscape(mask, pos, len)) < len) { // The first byte of buffer 'should' be 0x1a
+                som = (char *) base + pos; // consume garbage up to the 0x1a
+
+                if ((found = beastFrameAt(base, mask, pos, len, &frame)) < 0) {
+                    if (c->service->accept_compression && !c->inflate &&
+                        pos + 1 < len && base[pos + 1] == NET_COMPRESS_MARKER) {
+                        // Everything after this is compressed; inflate
+                        // the rest of the buffer before reading more
+                        if (netInflateStart(c, (const char *) base + pos + 2, len - pos - 2) < 0) {
+                            fprintf(stderr, "Out of memory setting up decompression for a %s client\n", c->service->descr);
+                            modesCloseClient(c);
+                            return;
+                        }
+                        pos = len;
+                        bContinue = 1;
+                        break;
                     }
+                    // Not a valid beast message, skip 0x1a and try again
+                    ++pos;
+                    continue;
                 }
-
-                if (eom > eod) { // Incomplete message in buffer, retry later
+                if (!found) {
+                    // Incomplete message in buffer, retry later
                     break;
                 }
 
-                // Have a 0x1a followed by 1/2/3/4/5 - pass message to handler.
-                if (c->service->read_handler(c, som + 1)) {
+                // Have a complete frame - pass it to the handler.
+                NET_STAT_ADD(c->stats.frames_in, 1);
+                if (c->service->frame_handler(c, &frame)) {
                     modesCloseClient(c);
                     return;
                 }
 
                 // advance to next message
-                som = eom;
+                pos += frame.raw_len;
+                som = (char *) base + pos;
             }
+
+            if (pos >= len)
+                som = eod;
             break;
+        }
 
         case READ_MODE_BEAST_COMMAND:
             while (som < eod && ((p = memchr(som, (char) 0x1a, eod - som)) != NULL)) { // The first byte of buffer 'should' be 0x1a
@@ -517,6 +2407,7 @@ static void modesReadFromClient(struct client *c) {
                 }
 
                 // Have a 0x1a followed by 1 - pass message to handler.
+                NET_STAT_ADD(c->stats.frames_in, 1);
                 if (c->service->read_handler(c, som + 1)) {
                     modesCloseClient(c);
                     return;
@@ -539,6 +2430,7 @@ static void modesReadFromClient(struct client *c) {
 
             while (som < eod && (p = strstr(som, c->service->read_sep)) != NULL) { // end of first message if found
                 *p = '\0';                         // The handler expects null terminated strings
+                NET_STAT_ADD(c->stats.frames_in, 1);
                 if (c->service->read_handler(c, som)) {         // Pass message to handler.
                     modesCloseClient(c);           // Handler returns 1 on error to signal we .
                     return;                        // should close the client connection
@@ -549,18 +2441,803 @@ static void modesReadFromClient(struct client *c) {
             break;
         }
 
-        if (som > c->buf) {                        // We processed something - so
-            c->buflen = eod - som;                 //     Update the unprocessed buffer length
-            memmove(c->buf, som, c->buflen);       //     Move what's remaining to the start of the buffer
-        } else {                                   // If no message was decoded process the next client
+        if (som > readbufData(rb)) {               // We processed something - so
+            readbufConsume(rb, som - readbufData(rb)); // drop it; no copying in the ring
+        } else if (!bContinue) {                   // If no message was decoded process the next client
+            return;
+        }
+    }
+}
+
+
+
+
+
+//
+//=========================================================================
+//
+// --inUdp. Every datagram holds whole frames, so each is framed on its own
+// as it arrives: nothing waits for a datagram that was lost or is late.
+//
+
+// Drop a feeder and all those after it on the list
+static void netUdpForget(struct net_service *service, struct net_udp_feeder **pf)
+{
+    struct net_udp_feeder *f, *next;
+
+    for (f = *pf; f; f = next) {
+        next = f->next;
+        netStatsDetach(&f->client);
+        service->connections--;
+        service->udp_input->nfeeders--;
+        free(f);
+    }
+    *pf = NULL;
+}
+
+// The feeder sending from addr, made up if it's a new one
+static struct net_udp_feeder *netUdpFeeder(struct net_service *service, const struct sockaddr_storage *addr, socklen_t addrlen, uint64_t now)
+{
+    struct net_udp_input *in = service->udp_input;
+    struct net_udp_feeder *f, **pf, **stale = NULL, **last = NULL;
+
+    for (pf = &in->feeders; (f = *pf); pf = &f->next) {
+        if (f->addrlen == addrlen && !memcmp(&f->addr, addr, addrlen)) {
+            // to the front: a feeder usually sends several in a row
+            *pf = f->next;
+            f->next = in->feeders;
+            in->feeders = f;
+            return f;
+        }
+        if (!stale && now - f->last_seen > NET_UDP_FEEDER_TIMEOUT)
+            stale = pf;
+        last = pf;
+    }
+
+    // The list is in order of the latest datagram, so every feeder after
+    // a silent one is silent too. Failing that, make room by forgetting
+    // the one heard from longest ago.
+    if (stale)
+        netUdpForget(service, stale);
+    else if (in->nfeeders >= NET_UDP_FEEDERS_MAX)
+        netUdpForget(service, last);
+
+    if (!(f = calloc(1, sizeof(*f)))) {
+        fprintf(stderr, "Out of memory allocating a %s feeder\n", service->descr);
+        exit(1);
+    }
+    memcpy(&f->addr, addr, addrlen);
+    f->addrlen = addrlen;
+    f->client.fd = -1;
+    f->client.service = service;
+    f->client.id = atomic_fetch_add_explicit(&Modes.next_client_id, 1, memory_order_relaxed) + 1;
+    f->client.compress = NET_COMPRESS_OFF;
+    netStatsAttachPeer(&f->client, NULL, addr, addrlen);
+
+    service->connections++;
+    in->nfeeders++;
+    f->next = in->feeders;
+    in->feeders = f;
+    return f;
+}
+
+// Hand every complete frame in a datagram to the frame handler. A frame
+// cut short by the end of the datagram is lost with the rest of it.
+static void netFrameDatagram(struct client *c, const unsigned char *base, size_t len)
+{
+    uint64_t mask[BEAST_MASK_WORDS(UDP_DATAGRAM_MAX)];
+    struct beast_frame frame;
+    size_t pos = 0;
+    int found;
+
+    beastScanMask(base, len, mask);
+    while ((pos = beastNextEscape(mask, pos, len)) < len) {
+        if ((found = beastFrameAt(base, mask, pos, len, &frame)) == 0)
+            break;
+        if (found < 0) {
+            ++pos;
+            continue;
+        }
+
+        // there's no connection to close if the handler objects
+        NET_STAT_ADD(c->stats.frames_in, 1);
+        c->service->frame_handler(c, &frame);
+        pos += frame.raw_len;
+    }
+}
+
+// Take in everything waiting on an --inUdp socket, a batch per recvmmsg()
+static void netReadDatagrams(struct net_service *service)
+{
+    struct udp_receiver *rx = &service->udp_input->rx;
+    int n, i;
+
+    while ((n = udpReceive(rx)) > 0) {
+        uint64_t now = mstime();
+        uint64_t ingress = (Modes.net_latency || Modes.capture) ? monotonic_usecs() : 0;
+
+        NET_STAT_ADD(service->stats.udp_received, n);
+        for (i = 0; i < n; ++i) {
+            struct net_udp_feeder *f;
+            struct client *c;
+            uint32_t seq;
+            int start;
+
+            if (rx->lens[i] < 0) {
+                NET_STAT_ADD(service->stats.udp_truncated, 1);
+                continue;
+            }
+
+            f = netUdpFeeder(service, &rx->from[i], rx->fromlens[i], now);
+            f->last_seen = now;
+            c = &f->client;
+            NET_STAT_ADD(c->stats.bytes_in, rx->lens[i]);
+            c->ingress = ingress;
+            c->ingress_wait = 0;
+
+            if ((start = udpParseHeader(rx->bufs[i], rx->lens[i], &seq))) {
+                udpSequenceTrack(&f->seq, seq);
+                NET_STAT_SET(c->stats.datagrams_in, f->seq.received);
+                NET_STAT_SET(c->stats.datagrams_lost, f->seq.lost);
+                NET_STAT_SET(c->stats.datagrams_late, f->seq.late);
+            }
+            netFrameDatagram(c, rx->bufs[i] + start, rx->lens[i] - start);
+        }
+        atomic_store_explicit(&service->last_read, now, memory_order_relaxed);
+
+        if (n < UDP_RECV_BATCH)
             return;
+    }
+
+    if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+        fprintf(stderr, "%s: recvmmsg: %s\n", service->descr, strerror(errno));
+}
+
+//
+//=========================================================================
+//
+// --io-uring. The main thread's listeners and sockets are driven by one
+// ring instead of epoll: multishot accepts, multishot receives into a
+// shared pool of buffers, and sends of the queued segments prepared as the
+// output is flushed. Everything prepared during a pass of the event loop
+// goes to the kernel in one io_uring_enter() at its end. Completions are
+// signalled through an eventfd that epoll watches, so the worker threads,
+// the eventfds and anything else still on epoll carry on as before.
+//
+
+// What a completion is for, kept in the low bits of its user_data next to
+// the client or listener it belongs to. Cancellations use 0.
+#define NET_URING_ACCEPT 1
+#define NET_URING_RECV   2
+#define NET_URING_SEND   3
+#define NET_URING_OP_MASK 7
+#define NET_URING_TAG(p, op) ((uint64_t) (uintptr_t) (p) | (op))
+
+static int netUringArmAccept(struct net_event *ev) {
+    struct io_uring_sqe *sqe;
+
+    if (!(sqe = uringGetSqe(Modes.uring)))
+        return -1;
+    uringPrepAcceptMultishot(sqe, ev->fd, NET_URING_TAG(ev, NET_URING_ACCEPT));
+    return 0;
+}
+
+static int netUringArmRecv(struct client *c) {
+    struct io_uring_sqe *sqe;
+
+    if (!(sqe = uringGetSqe(Modes.uring)))
+        return -1;
+    uringPrepRecvMultishot(sqe, c->fd, NET_URING_TAG(c, NET_URING_RECV));
+    c->uring->recv_armed = 1;
+    c->uring->pending++;
+    return 0;
+}
+
+// Move a new main thread client from epoll to the ring. If the ring can't
+// take it, it quietly stays on epoll.
+static void netUringAttach(struct client *c) {
+    if (!(c->uring = calloc(1, sizeof(*c->uring)))) {
+        fprintf(stderr, "Out of memory allocating io_uring state for a %s client\n", c->service->descr);
+        exit(1);
+    }
+    if (netUringArmRecv(c) < 0) {
+        free(c->uring);
+        c->uring = NULL;
+        return;
+    }
+    if (epoll_ctl(c->epfd, EPOLL_CTL_DEL, c->fd, NULL) < 0)
+        fprintf(stderr, "epoll_ctl(DEL, %d): %s\n", c->fd, strerror(errno));
+}
+
+// Prepare a send of the head of a client's queue, unless one is already
+// in flight. It goes to the kernel with the rest at the end of the pass.
+static void netUringSend(struct client *c) {
+    struct net_uring_io *u = c->uring;
+    struct io_uring_sqe *sqe;
+    int n, flags = MSG_NOSIGNAL;
+
+    if (u->nsegs || !c->sendq_count)
+        return;
+
+    if (!(sqe = uringGetSqe(Modes.uring))) {
+        modesCloseClientWhy(c, NET_CLOSE_SEND);
+        return;
+    }
+
+    for (n = 0; n < c->sendq_count && n < MODES_NET_MAX_IOV; ++n) {
+        u->segs[n] = SENDQ_AT(c, n);
+        netSegmentRetain(u->segs[n]);
+        u->iov[n].iov_base = u->segs[n]->data + (n == 0 ? c->sendq_offset : 0);
+        u->iov[n].iov_len = u->segs[n]->len - (n == 0 ? c->sendq_offset : 0);
+    }
+    u->nsegs = n;
+    if (u->segs[n - 1]->more)
+        flags |= MSG_MORE;
+
+    memset(&u->msg, 0, sizeof(u->msg));
+    u->msg.msg_iov = u->iov;
+    u->msg.msg_iovlen = n;
+    uringPrepSendmsg(sqe, c->fd, &u->msg, flags, NET_URING_TAG(c, NET_URING_SEND));
+    u->pending++;
+}
+
+// A client is closing: have the kernel drop whatever it holds for the
+// socket. This is submitted straight away, before close() lets the fd
+// number be reused.
+static void netUringCancel(struct client *c) {
+    struct io_uring_sqe *sqe;
+
+    if (!c->uring->pending)
+        return;
+    if (!(sqe = uringGetSqe(Modes.uring))) {
+        fprintf(stderr, "io_uring: can't cancel the operations of %s\n", c->stats.peer);
+        return;
+    }
+    uringPrepCancelFd(sqe, c->fd, 0);
+    if (uringSubmit(Modes.uring) < 0)
+        fprintf(stderr, "io_uring_enter: %s\n", strerror(errno));
+}
+
+// A listener's multishot accept produced a connection, or stopped
+static void netUringAccepted(struct net_event *ev, const struct io_uring_cqe *cqe) {
+    if (cqe->res >= 0) {
+        if (netWorkerPool(ev->service->shard, NULL))
+            netWorkerHandoff(ev->service, cqe->res);
+        else
+            createSocketClient(ev->service, cqe->res);
+    }
+
+    if (!(cqe->flags & IORING_CQE_F_MORE) && cqe->res != -ECANCELED && netUringArmAccept(ev) < 0)
+        fprintf(stderr, "io_uring: can't accept on %s any more\n", ev->service->descr);
+}
+
+// A client's multishot receive filled a buffer, or stopped
+static void netUringReceived(struct client *c, const struct io_uring_cqe *cqe) {
+    struct net_uring_io *u = c->uring;
+    int bid = -1;
+
+    if (cqe->flags & IORING_CQE_F_BUFFER)
+        bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        u->recv_armed = 0;
+        u->pending--;
+    }
+
+    // -ENOBUFS: the pool ran dry for a moment; the data is still in the
+    // socket and the receive is armed again below
+    if (c->service && cqe->res != -ENOBUFS) {
+        if (cqe->res > 0 && bid >= 0) {
+            u->in = (const char *) uringBuffer(Modes.uring, bid);
+            u->in_len = cqe->res;
+        } else if (cqe->res <= 0) {
+            u->in_done = 1;
+            u->in_err = -cqe->res;
+        }
+        modesReadFromClient(c);
+    }
+
+    u->in_len = 0;
+    if (bid >= 0)
+        uringRecycleBuffer(Modes.uring, bid);
+
+    if (c->service && !u->recv_armed && !u->in_done && netUringArmRecv(c) < 0)
+        modesCloseClientWhy(c, NET_CLOSE_PEER);
+}
+
+// A client's send completed; account for it as modesDrainClient() would
+// and start the next one
+static void netUringSent(struct client *c, const struct io_uring_cqe *cqe) {
+    struct net_uring_io *u = c->uring;
+    int n = u->nsegs, i;
+    ssize_t nwritten = cqe->res;
+
+    u->pending--;
+    u->nsegs = 0;
+
+    if (c->service && nwritten >= 0) {
+        c->sendq_len -= nwritten;
+        NET_STAT_ADD(c->stats.bytes_out, nwritten);
+        nwritten += c->sendq_offset;
+        for (i = 0; i < n && nwritten >= u->segs[i]->len; ++i) {
+            nwritten -= u->segs[i]->len;
+            NET_STAT_ADD(c->stats.frames_out, u->segs[i]->frames);
+            netLatencySent(c, u->segs[i]);
+            netSegmentRelease(SENDQ_AT(c, 0));
+            c->sendq_first = (c->sendq_first + 1) & (c->sendq_size - 1);
+            c->sendq_count--;
+        }
+        c->sendq_offset = nwritten;
+        NET_STAT_SET(c->stats.backlog, c->sendq_len);
+    }
+
+    for (i = 0; i < n; ++i)
+        netSegmentRelease(u->segs[i]);
+
+    if (!c->service)
+        return;
+    if (cqe->res < 0 && cqe->res != -EAGAIN && cqe->res != -EINTR) {
+        modesCloseClientWhy(c, NET_CLOSE_SEND);
+        return;
+    }
+    if (!c->sendq_count && c->close_when_drained) {
+        modesCloseClientWhy(c, NET_CLOSE_LOCAL);
+        return;
+    }
+    netUringSend(c);
+}
+
+// Act on everything the ring has completed
+static void netUringReap(void) {
+    struct io_uring_cqe *cqe, done;
+
+    while ((cqe = uringPeek(Modes.uring))) {
+        void *p;
+
+        done = *cqe;
+        uringSeen(Modes.uring);
+        p = (void *) (uintptr_t) (done.user_data & ~(uint64_t) NET_URING_OP_MASK);
+
+        switch (done.user_data & NET_URING_OP_MASK) {
+        case NET_URING_ACCEPT:
+            netUringAccepted(p, &done);
+            break;
+        case NET_URING_RECV:
+            netUringReceived(p, &done);
+            break;
+        case NET_URING_SEND:
+            netUringSent(p, &done);
+            break;
+        }
+    }
+}
+
+// Hand the kernel everything prepared during this pass of the event loop
+void netUringSubmit(void) {
+    if (Modes.uring && uringSubmit(Modes.uring) < 0)
+        fprintf(stderr, "io_uring_enter: %s\n", strerror(errno));
+}
+
+// Set up the ring and move the main thread's listeners over to it. Falls
+// back to epoll if the kernel won't have it.
+static void netUringStart(void) {
+    struct net_service *s;
+    struct uring *u;
+    char err[128];
+    int i;
+
+    if (!(u = malloc(sizeof(*u)))) {
+        fprintf(stderr, "Out of memory allocating the io_uring\n");
+        exit(1);
+    }
+    if (uringOpen(u, MODES_NET_URING_ENTRIES, err, sizeof(err)) < 0) {
+        fprintf(stderr, "Can't use io_uring (%s), staying with epoll\n", err);
+        free(u);
+        return;
+    }
+    if (uringSetupBuffers(u, MODES_NET_URING_BUFS, MODES_NET_URING_BUF_SIZE, err, sizeof(err)) < 0) {
+        fprintf(stderr, "Can't use io_uring (%s), staying with epoll\n", err);
+        uringClose(u);
+        free(u);
+        return;
+    }
+    if ((Modes.uringfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 ||
+        uringRegisterEventfd(u, Modes.uringfd) < 0) {
+        fprintf(stderr, "Can't use io_uring (eventfd: %s), staying with epoll\n", strerror(errno));
+        if (Modes.uringfd >= 0)
+            close(Modes.uringfd);
+        uringClose(u);
+        free(u);
+        return;
+    }
+
+    Modes.uring = u;
+    Modes.uring_ev.type = NET_EVENT_URING;
+    Modes.uring_ev.fd = Modes.uringfd;
+    Modes.uring_ev.service = NULL;
+    Modes.uring_ev.client = NULL;
+    Modes.uring_ev.worker = NULL;
+    netEventAdd(Modes.epfd, &Modes.uring_ev);
+
+    // Listeners the output workers took over with SO_REUSEPORT are theirs
+    for (s = Modes.services; s; s = s->next) {
+        if (Modes.net_reuseport && netWorkerPool(s->shard, NULL))
+            continue;
+        for (i = 0; i < s->listener_count; ++i) {
+            if (netUringArmAccept(&s->listener_events[i]) < 0)
+                continue;
+            if (epoll_ctl(Modes.epfd, EPOLL_CTL_DEL, s->listener_fds[i], NULL) < 0)
+                fprintf(stderr, "epoll_ctl(DEL, %d): %s\n", s->listener_fds[i], strerror(errno));
+        }
+    }
+    netUringSubmit();
+}
+
+static void netUringStop(void) {
+    if (!Modes.uring)
+        return;
+    uringClose(Modes.uring);
+    free(Modes.uring);
+    Modes.uring = NULL;
+    close(Modes.uringfd);
+}
+
+//
+//=========================================================================
+//
+// Event loop plumbing shared by the main thread and the output workers
+//
+
+// Act on a batch of events returned by epoll_wait()
+void netHandleEvents(struct epoll_event *events, int n) {
+    int i;
+
+    for (i = 0; i < n; ++i) {
+        struct net_event *ev = events[i].data.ptr;
+
+        switch (ev->type) {
+        case NET_EVENT_LISTENER:
+            modesAcceptClients(ev);
+            break;
+
+        case NET_EVENT_CLIENT:
+            // skip clients closed earlier in this batch
+            if (ev->client->service && ev->client->zerocopy && (events[i].events & EPOLLERR))
+                modesReapZerocopy(ev->client);
+            if (ev->client->service && (events[i].events & EPOLLOUT))
+                modesDrainClient(ev->client);
+            if (ev->client->service && (events[i].events & ~EPOLLOUT))
+                modesReadFromClient(ev->client);
+            break;
+
+        case NET_EVENT_WAKE: {
+            uint64_t count;
+            if (read(ev->fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+                fprintf(stderr, "Worker %d: eventfd read: %s\n", ev->worker->id, strerror(errno));
+            netWorkerDrainInbox(ev->worker);
+            break;
+        }
+
+        case NET_EVENT_FANOUT: {
+            uint64_t count;
+            if (read(ev->fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+                fprintf(stderr, "fanout eventfd read: %s\n", strerror(errno));
+            netFanoutDrain();
+            break;
+        }
+
+        case NET_EVENT_CONNECT:
+            netConnectorEvent(ev);
+            break;
+
+        case NET_EVENT_RESOLVED:
+            netResolverDrain();
+            break;
+
+        case NET_EVENT_DATAGRAM:
+            netReadDatagrams(ev->service);
+            break;
+
+        case NET_EVENT_URING: {
+            uint64_t count;
+            if (read(ev->fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+                fprintf(stderr, "io_uring eventfd read: %s\n", strerror(errno));
+            netUringReap();
+            break;
+        }
+        }
+    }
+}
+
+// Earliest time any queue in a client list hits its age limit, or
+// 'deadline' if that is sooner
+uint64_t netQueueDeadline(struct client *clients, uint64_t deadline) {
+    struct client *c;
+
+    for (c = clients; c; c = c->next) {
+        if (c->service && c->sendq_count && c->service->writer && c->service->writer->queue_max_age &&
+            c->sendq[c->sendq_first]->created + c->service->writer->queue_max_age < deadline)
+            deadline = c->sendq[c->sendq_first]->created + c->service->writer->queue_max_age;
+    }
+
+    return deadline;
+}
+
+// Apply age limits to output queues that aren't moving, then unlink and
+// free closed clients. Returns the number of clients freed.
+int netReapClients(struct client **clients, uint64_t now) {
+    struct client *c, **prev;
+    int freed = 0;
+
+    for (c = *clients; c; c = c->next) {
+        if (c->service && c->sendq_count)
+            modesCheckClientQueueAge(c, now);
+    }
+
+    for (prev = clients, c = *prev; c; c = *prev) {
+        if (c->fd == -1 && !(c->uring && c->uring->pending)) {
+            // Recently closed, and the ring (if any) is done with it:
+            // prune from list
+            *prev = c->next;
+            printf("Connection lost with %p\n", c);
+            free(c->uring);
+            free(c);
+            ++freed;
+        } else {
+            prev = &c->next;
+        }
+    }
+
+    return freed;
+}
+
+static void *netWorkerMain(void *arg) {
+    struct net_worker *w = arg;
+    struct epoll_event events[64];
+    struct client *c;
+
+    while (!Modes.exit) {
+        uint64_t now = mstime();
+        uint64_t deadline = netQueueDeadline(w->clients, UINT64_MAX);
+        int timeout, n, closed;
+
+        if (deadline == UINT64_MAX)
+            timeout = -1;
+        else if (deadline <= now)
+            timeout = 0;
+        else
+            timeout = (deadline - now > INT_MAX ? INT_MAX : (int) (deadline - now));
+
+        n = epoll_wait(w->epfd, events, 64, timeout);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Worker %d: epoll_wait: %s\n", w->id, strerror(errno));
+            break;
+        }
+
+        netHandleEvents(events, n);
+        closed = netReapClients(&w->clients, mstime());
+        atomic_fetch_sub(&w->nclients, closed);
+
+        // Readers also wake the main thread when they lose a connection, so
+        // that it notices in time to reconnect --inConnect inputs
+        if (closed && w->pool == NET_SHARD_INPUT)
+            w->fanout_pending = 1;
+
+        if (w->fanout_pending) {
+            uint64_t one = 1;
+            w->fanout_pending = 0;
+            if (write(Modes.fanoutfd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+                fprintf(stderr, "Worker %d: fanout wakeup failed: %s\n", w->id, strerror(errno));
+        }
+    }
+
+    for (c = w->clients; c; c = c->next) {
+        if (c->service)
+            modesCloseClientWhy(c, NET_CLOSE_LOCAL);
+    }
+    netReapClients(&w->clients, mstime());
+    return NULL;
+}
+
+// Set up a pool of worker threads (but don't start them yet) for the
+// services of the given kind
+static struct net_worker *netCreateWorkers(net_shard_t kind, int count) {
+    struct net_worker *pool;
+    struct net_service *s;
+    int i, j;
+
+    if (!(pool = calloc(count, sizeof(struct net_worker)))) {
+        fprintf(stderr, "Out of memory allocating workers\n");
+        exit(1);
+    }
+
+    for (i = 0; i < count; ++i) {
+        struct net_worker *w = &pool[i];
+
+        w->pool = kind;
+        w->id = i;
+        if (Modes.net_latency && kind == NET_SHARD_OUTPUT && Modes.services &&
+            !(w->latency = calloc(Modes.services->id + 1, sizeof(struct net_latency)))) {
+            fprintf(stderr, "Out of memory allocating latency histograms\n");
+            exit(1);
+        }
+        atomic_init(&w->nclients, 0);
+        if ((w->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+            (w->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+            fprintf(stderr, "Worker %d: %s\n", i, strerror(errno));
+            exit(1);
+        }
+        if (spscInit(&w->inbox, MODES_NET_WORKER_INBOX, sizeof(struct net_worker_msg)) < 0) {
+            fprintf(stderr, "Out of memory allocating worker inbox\n");
+            exit(1);
+        }
+
+        w->wake_ev.type = NET_EVENT_WAKE;
+        w->wake_ev.fd = w->wakefd;
+        w->wake_ev.service = NULL;
+        w->wake_ev.client = NULL;
+        w->wake_ev.worker = w;
+        netEventAdd(w->epfd, &w->wake_ev);
+    }
+
+    // With SO_REUSEPORT each worker gets its own listening sockets for the
+    // sharded services and the kernel balances connections across them.
+    // Worker 0 replaces the main thread's sockets, the rest open clones.
+    if (!Modes.net_reuseport)
+        return pool;
+
+    for (i = 0; i < count; ++i) {
+        struct net_worker *w = &pool[i];
+        int nlisteners = 0;
+
+        for (s = Modes.services; s; s = s->next)
+            if (s->shard == kind)
+                nlisteners += s->listener_count;
+
+        if (!(w->listener_events = calloc(nlisteners ? nlisteners : 1, sizeof(struct net_event)))) {
+            fprintf(stderr, "Out of memory allocating worker listeners\n");
+            exit(1);
+        }
+
+        for (s = Modes.services; s; s = s->next) {
+            if (s->shard != kind)
+                continue;
+            for (j = 0; j < s->listener_count; ++j) {
+                struct net_event *ev = &w->listener_events[w->listener_count++];
+                int fd;
+
+                if (i == 0)
+                    epoll_ctl(Modes.epfd, EPOLL_CTL_DEL, s->listener_fds[j], NULL);
+                if ((fd = anetTcpServerClone(w->aneterr, s->listener_fds[j], i == 0)) == ANET_ERR) {
+                    fprintf(stderr, "Worker %d: can't open listener for %s: %s\n", i, s->descr, w->aneterr);
+                    exit(1);
+                }
+                if (i == 0)
+                    s->listener_fds[j] = fd;
+
+                anetNonBlock(w->aneterr, fd);
+                ev->type = NET_EVENT_LISTENER;
+                ev->fd = fd;
+                ev->service = s;
+                ev->client = NULL;
+                ev->worker = w;
+                netEventAdd(w->epfd, ev);
+            }
+        }
+    }
+
+    return pool;
+}
+
+static void netRunWorkers(struct net_worker *pool, int count) {
+    int i;
+
+    for (i = 0; i < count; ++i) {
+        if (pthread_create(&pool[i].thread, NULL, netWorkerMain, &pool[i]) != 0) {
+            fprintf(stderr, "Can't start worker %d\n", i);
+            exit(1);
+        }
+    }
+}
+
+static void netJoinWorkers(struct net_worker *pool, int count) {
+    uint64_t one = 1;
+    int i;
+
+    for (i = 0; i < count; ++i) {
+        if (write(pool[i].wakefd, &one, sizeof(one)) < 0)
+            fprintf(stderr, "Worker %d wakeup failed: %s\n", i, strerror(errno));
+    }
+
+    for (i = 0; i < count; ++i) {
+        struct net_worker *w = &pool[i];
+        struct net_worker_msg msg;
+
+        pthread_join(w->thread, NULL);
+
+        // release anything the worker never got round to
+        while (spscPop(&w->inbox, &msg) == 0) {
+            if (msg.type == NET_WORKER_SEGMENT)
+                netSegmentRelease(msg.seg);
+            else
+                close(msg.fd);
         }
+        spscFree(&w->inbox);
+        close(w->wakefd);
+        close(w->epfd);
+        free(w->listener_events);
+        free(w->latency);
     }
+
+    free(pool);
 }
 
+// Start the output worker and input reader threads. Called once, after the
+// command line has set up all the services.
+void netStartWorkers(void) {
+    sigset_t all, old;
 
+    if (Modes.net_latency && Modes.services &&
+        !(Modes.latency = calloc(Modes.services->id + 1, sizeof(struct net_latency)))) {
+        fprintf(stderr, "Out of memory allocating latency histograms\n");
+        exit(1);
+    }
+
+    if (Modes.net_workers)
+        Modes.workers = netCreateWorkers(NET_SHARD_OUTPUT, Modes.net_workers);
+
+    if (Modes.net_readers) {
+        Modes.readers = netCreateWorkers(NET_SHARD_INPUT, Modes.net_readers);
+
+        if (mpscInit(&Modes.fanout, MODES_NET_FANOUT_SIZE, sizeof(struct net_frame)) < 0) {
+            fprintf(stderr, "Out of memory allocating fanout ring\n");
+            exit(1);
+        }
+        if ((Modes.fanoutfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+            fprintf(stderr, "fanout eventfd: %s\n", strerror(errno));
+            exit(1);
+        }
+        Modes.fanout_ev.type = NET_EVENT_FANOUT;
+        Modes.fanout_ev.fd = Modes.fanoutfd;
+        Modes.fanout_ev.service = NULL;
+        Modes.fanout_ev.client = NULL;
+        Modes.fanout_ev.worker = NULL;
+        netEventAdd(Modes.epfd, &Modes.fanout_ev);
+    }
+
+    // Signals are for the main thread only
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    netRunWorkers(Modes.workers, Modes.net_workers);
+    netRunWorkers(Modes.readers, Modes.net_readers);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    // After the workers, which may have taken over listeners
+    if (Modes.net_uring)
+        netUringStart();
+}
 
+// Stop the worker threads, closing their clients, the resolver thread and
+// the io_uring. Modes.exit must already be set.
+void netStopWorkers(void) {
+    netStopResolver();
+    netUringStop();
+
+    if (Modes.net_readers) {
+        netJoinWorkers(Modes.readers, Modes.net_readers);
+        mpscFree(&Modes.fanout);
+        close(Modes.fanoutfd);
+        Modes.readers = NULL;
+        Modes.net_readers = 0;
+    }
 
+    if (Modes.net_workers) {
+        netJoinWorkers(Modes.workers, Modes.net_workers);
+        Modes.workers = NULL;
+        Modes.net_workers = 0;
+    }
+}
 
 //
 // =============================== Network IO ===========================
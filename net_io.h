@@ -20,14 +20,200 @@
 #ifndef DUMP1090_NETIO_H
 #define DUMP1090_NETIO_H
 
-#define MODES_CLIENT_BUF_SIZE 1024
+#define MODES_CLIENT_BUF_SIZE 4096
+#define MODES_CLIENT_BUF_MAX  (256*1024)
+#define NET_PEER_LEN          64
+#define NET_SEGMENT_MAX_FRAMES 160   // messages per output batch; the shortest Beast message is 11 bytes
+
+#include "ring.h"
+#include "readbuf.h"
+#include "beast_scan.h"
+#include "hist.h"
+#include "udp.h"
 
 // Describes a networking service (group of connections)
 
 struct client;
 struct net_service;
+struct net_filter;
+struct epoll_event;
+struct z_stream_s;
+struct net_inflate;
+struct net_udp_input;
+struct net_uring_io;
+struct uring;
+struct thin_table;
+
 typedef int (*read_fn)(struct client *, char *);
+typedef int (*frame_fn)(struct client *, const struct beast_frame *);
 typedef void (*heartbeat_fn)(struct net_service *);
+typedef void (*fanout_fn)(char *, int);
+
+struct net_worker;
+
+typedef enum {
+    NET_EVENT_LISTENER,
+    NET_EVENT_CLIENT,
+    NET_EVENT_WAKE,      // a worker's inbox has something in it
+    NET_EVENT_FANOUT,    // input reader threads have queued frames for the main thread
+    NET_EVENT_CONNECT,   // an outgoing connection attempt has completed or failed
+    NET_EVENT_RESOLVED,  // the resolver thread has finished looking up some names
+    NET_EVENT_DATAGRAM,  // an --inUdp socket has datagrams waiting
+    NET_EVENT_URING      // --io-uring: the ring has completions waiting
+} net_event_type_t;
+
+// Which pool of worker threads, if any, may take over a service's clients
+typedef enum {
+    NET_SHARD_NONE,
+    NET_SHARD_OUTPUT,    // output workers (--out-workers)
+    NET_SHARD_INPUT      // input reader threads (--in-readers)
+} net_shard_t;
+
+// Something registered with the event loop; epoll hands a pointer to this
+// back to us when the fd becomes ready
+struct net_event {
+    net_event_type_t type;
+    int fd;
+    struct net_service *service;
+    struct client *client;      // NULL for listeners
+    struct net_worker *worker;  // event loop that owns this, NULL for the main loop
+    struct net_connector *connector; // NET_EVENT_CONNECT only
+};
+
+// What to do when a client's output queue overflows its byte or time limit
+typedef enum {
+    NET_DROP_OLDEST,     // discard the oldest queued data that has not been started yet
+    NET_DROP_NEWEST,     // discard the data that would have been queued
+    NET_DROP_DISCONNECT  // close the connection
+} net_drop_policy_t;
+
+// One batch of output, shared by reference between every client it is
+// sent to. Freed when the last reference is released.
+struct net_segment {
+    atomic_int refcount;
+    int len;
+    int frames;          // messages in the batch, for the statistics
+    uint64_t created;    // time the batch was flushed (milliseconds)
+    uint64_t flushed;    // --latency: monotonic_usecs() when the batch was flushed
+    int stamped;         // --latency: messages with an ingress time
+    uint32_t ages[NET_SEGMENT_MAX_FRAMES]; // --latency: us from ingress to flush per message, UINT32_MAX if unknown
+    int compressed;      // 1 if this is a batch run through the writer's deflate stream
+    int keyframe;        // compressed: the stream was reset here, so a client may start with it
+    int more;            // flushed because the batch was full: more follows at once (MSG_MORE)
+    char data[];         // MODES_OUT_BUF_SIZE bytes
+};
+
+// A segment handed to the kernel by a MSG_ZEROCOPY send that has not been
+// reported complete yet
+struct net_zc_inflight {
+    uint32_t id;         // zerocopy notification id of the send
+    struct net_segment *seg;
+};
+
+// Why a client was closed, for the statistics
+typedef enum {
+    NET_CLOSE_PEER,      // the other end went away, or reading failed
+    NET_CLOSE_SEND,      // a send failed
+    NET_CLOSE_QUEUE,     // the output queue overflowed its byte limit
+    NET_CLOSE_STALE,     // the output queue overflowed its age limit
+    NET_CLOSE_LOCAL,     // we closed it (reset, shutdown, or a finished reply)
+    NET_CLOSE_REASONS
+} net_close_reason_t;
+
+// Classes of message an output over its --out-rate budget sheds, lowest
+// first: each class may only spend what the bucket holds above the share
+// kept for the classes above it
+typedef enum {
+    NET_CLASS_LOW,         // Mode A/C, DF11 all-call replies and anything unrecognised
+    NET_CLASS_SURV,        // DF0/4/5 and the other Mode S replies
+    NET_CLASS_ES,          // DF17/18 other than positions
+    NET_CLASS_POSITION,    // DF17/18 airborne and surface positions
+    NET_CLASSES
+} net_class_t;
+
+#define NET_RATE_BURST 1000   // ms worth of --out-rate a token bucket holds
+
+// Bump a counter that only one thread ever updates. Other threads may read
+// it at any time, but there's no locked read-modify-write on the hot path.
+#define NET_STAT_ADD(counter, n) \
+    atomic_store_explicit(&(counter), atomic_load_explicit(&(counter), memory_order_relaxed) + (n), memory_order_relaxed)
+#define NET_STAT_SET(counter, v) \
+    atomic_store_explicit(&(counter), (v), memory_order_relaxed)
+
+// Per-client counters. Updated only by the thread that owns the client and
+// summed up by the metrics endpoint when it is scraped. Every live client's
+// counters are on the Modes.stats_clients list; when the client closes they
+// are folded into its service's totals.
+struct net_client_stats {
+    struct net_client_stats *next;   // Modes.stats_clients, under Modes.stats_lock
+    struct net_client_stats *prev;
+    struct net_service *service;
+    char peer[NET_PEER_LEN];         // remote address
+    int thread;                      // owning thread: -1 main, else worker/reader id
+    net_shard_t pool;                // pool of the owning thread
+    net_close_reason_t close_reason;
+    atomic_ullong frames_in;
+    atomic_ullong bytes_in;
+    atomic_ullong frames_out;        // messages completely sent
+    atomic_ullong bytes_out;
+    atomic_ullong frames_dropped;    // messages discarded from or refused by the output queue
+    atomic_ullong backlog;           // bytes waiting in the output queue
+    atomic_ullong datagrams_in;      // --inUdp feeders: datagrams with a sequence header
+    atomic_ullong datagrams_lost;    // and the gaps in their sequence
+    atomic_ullong datagrams_late;    // and those that arrived out of order
+};
+
+// Forwarding latency of one output service, as seen by one thread.
+// Ingress is the kernel receive time where SO_TIMESTAMPING is available,
+// otherwise the time the input was read.
+struct net_latency {
+    struct hist wait;    // kernel receive -> read(): time spent before the event loop got to it
+    struct hist batch;   // read() -> flushWrites(): time spent waiting for the output batch to go
+    struct hist send;    // flushWrites() -> written to the subscriber's socket
+    struct hist total;   // ingress -> written to the subscriber's socket
+};
+
+// Per-service counters. The atomics are updated by the main thread only;
+// the rest are totals of closed clients, under Modes.stats_lock.
+struct net_service_stats {
+    atomic_ullong reconnects;        // outgoing connection attempts started
+    atomic_ullong frames_batched;    // messages written to output batches
+    atomic_ullong drops_idle;        // messages not batched as nobody was connected
+    atomic_ullong drops_oversize;    // messages too big for an output batch
+    atomic_ullong deflate_in;        // bytes of output batches compressed
+    atomic_ullong deflate_out;       // and what they compressed to
+    atomic_ullong udp_sent;          // --outUdp: datagrams sent, once per target
+    atomic_ullong udp_dropped;       // --outUdp: datagrams the socket refused
+    atomic_ullong udp_received;      // --inUdp: datagrams taken in
+    atomic_ullong udp_truncated;     // --inUdp: datagrams too big to take in, dropped
+    atomic_ullong frames_shed[NET_CLASSES]; // --out-rate: messages shed for lack of budget, by class
+    uint64_t accepted;               // clients ever attached
+    uint64_t frames_in;
+    uint64_t bytes_in;
+    uint64_t frames_out;
+    uint64_t bytes_out;
+    uint64_t frames_dropped;
+    uint64_t disconnects[NET_CLOSE_REASONS];
+};
+
+// What an output sends to its clients
+typedef enum {
+    NET_FORMAT_BEAST,    // Beast binary frames, passed through as received
+    NET_FORMAT_RAW,      // AVR raw: "*<hex>;" lines
+    NET_FORMAT_SBS,      // SBS/BaseStation: "MSG,..." lines
+    NET_FORMATS
+} net_format_t;
+
+// When an output sends its batch (--out-flush)
+typedef enum {
+    NET_FLUSH_LATENCY,     // at the end of every pass of the event loop, or at flush_size bytes
+    NET_FLUSH_THROUGHPUT,  // at flush_size bytes, or once the oldest message has waited flush_interval
+    NET_FLUSH_ADAPTIVE,    // like throughput, with the size set from the message rate to meet flush_interval
+    NET_FLUSH_POLICIES
+} net_flush_policy_t;
+
+#define NET_FLUSH_ADAPT_WINDOW 250   // ms over which adaptive outputs measure their rate
+#define NET_FLUSH_ADAPT_MIN    128   // adaptive batch size below which waiting isn't worth it
 
 typedef enum {
     READ_MODE_IGNORE,
@@ -36,20 +222,43 @@ typedef enum {
     READ_MODE_ASCII
 } read_mode_t;
 
+// Where a client is with stream compression. A compressed stream is the
+// marker 0x1a 'Z' followed by raw deflate data to the end of the
+// connection; inputs recognise the marker whatever their settings.
+typedef enum {
+    NET_COMPRESS_OFF,
+    NET_COMPRESS_WAITING,  // output: waiting for a segment its client can start decoding at
+    NET_COMPRESS_ON
+} net_compress_t;
+
+#define NET_COMPRESS_MARKER 'Z'  // 0x1a 'Z' starts a compressed stream; an output client asks with 0x1a '1' 'Z'
+
 // Describes one network service (a group of clients with common behaviour)
 struct net_service {
     struct net_service* next;
     const char *descr;
+    int id;              // creation order, for the statistics
+    char addr[NET_PEER_LEN]; // where it listens or connects to, for the statistics
     int listener_count;  // number of listeners
     int *listener_fds;   // listening FDs
+    struct net_event *listener_events; // event loop registrations, one per listener
 
-    int connections;     // number of active clients
+    atomic_int connections; // number of active clients, across all threads
+    atomic_ullong last_read; // mstime() when any client last read some data
+    net_shard_t shard;   // worker pool that may take over this service's clients
 
     struct net_writer *writer; // shared writer state
 
     const char *read_sep;      // hander details for input data
     read_mode_t read_mode;
     read_fn read_handler;
+    frame_fn frame_handler; // READ_MODE_BEAST: called with each complete frame
+    int request_compression; // inputs: ask the other end for a compressed stream (--in-compress)
+    int accept_compression;  // inputs: a 0x1a 'Z' switches to a compressed stream (--in-compress);
+                             // elsewhere it's just garbage to resync past
+    struct net_udp_input *udp_input; // --inUdp: the datagram socket, NULL for connection-based services
+
+    struct net_service_stats stats;
 };
 
 // Structure used to describe a networking client
@@ -57,27 +266,233 @@ struct client {
     struct client*  next;                // Pointer to next client
     int    fd;                           // File descriptor
     struct net_service *service;         // Service this client is part of
-    int    buflen;                       // Amount of data on buffer
-    char   buf[MODES_CLIENT_BUF_SIZE+1]; // Read buffer
+    int    epfd;                         // epoll instance of the event loop owning this client
+    struct net_event ev;                 // Event loop registration
+    struct readbuf rbuf;                 // Read buffer, allocated on first read and grown to fit bursts
     int    modeac_requested;             // 1 if this Beast output connection has asked for A/C
     int    verbatim_requested;           // 1 if this Beast output connection has asked for verbatim mode
     int    local_requested;              // 1 if this Beast output connection has asked for local-only mode
+    struct net_segment **sendq;          // Ring of segments waiting for the socket to become writable
+    int    sendq_size;                   // Capacity of sendq (power of two)
+    int    sendq_first;                  // Index of the oldest queued segment
+    int    sendq_count;                  // Number of queued segments
+    int    sendq_offset;                 // Bytes of the oldest segment already written
+    int    sendq_len;                    // Total unwritten bytes in the queue
+    int    want_write;                   // 1 if the event loop is watching for writability
+    int    close_when_drained;           // 1 to close the client once its output queue is empty
+    int    timestamping;                 // 1 if reads carry kernel receive timestamps
+    uint64_t ingress;                    // --latency/--record: monotonic_usecs() of the latest read
+    uint32_t ingress_wait;               // --latency: us the latest read's data waited in the kernel
+    uint32_t id;                         // Unique per connection, the input id written by --record
+    int    zerocopy;                     // 1 if sends use MSG_ZEROCOPY
+    uint32_t zc_next_id;                 // Notification id of the next zerocopy send
+    struct net_zc_inflight *zc_inflight; // Ring of segments pinned by zerocopy sends
+    int    zc_size;
+    int    zc_first;
+    int    zc_count;
+    net_compress_t compress;             // Output: compressed stream state
+    struct net_inflate *inflate;         // Input: decompressor once the stream turned compressed, else NULL
+    struct net_uring_io *uring;          // --io-uring: socket driven by the ring rather than epoll, else NULL
+    struct net_client_stats stats;       // Counters, see Modes.stats_clients
 };
 
 // Common writer state for all output sockets of one type
 struct net_writer {
     struct net_service *service; // owning service
-    void *data;          // shared write buffer, sized MODES_OUT_BUF_SIZE
+    struct net_segment *segment; // batch being built, sized MODES_OUT_BUF_SIZE
     int dataUsed;        // number of bytes of write buffer currently used
+    int frames;          // number of messages in the write buffer
+    uint64_t ingress[NET_SEGMENT_MAX_FRAMES];      // --latency: read time of each message, 0 if unknown
+    uint32_t ingress_wait[NET_SEGMENT_MAX_FRAMES]; // --latency: time each message waited in the kernel
     uint64_t lastWrite;  // time of last write to clients
     heartbeat_fn send_heartbeat; // function that queues a heartbeat if needed
+    net_format_t format; // encoding of the output
+    int queue_limit;     // max bytes queued per client
+    uint64_t queue_max_age; // max age (milliseconds) of queued data per client, 0 = no limit
+    net_drop_policy_t drop_policy; // what to do when a client exceeds the above
+    char *filter_spec;   // --out-filter given for this output, NULL = the default
+    struct net_filter *filter; // compiled filter, NULL = pass everything
+    int compress;        // compress the stream to every client (--out-compress), not only those asking
+    atomic_int compressed_clients; // clients receiving (or waiting for) the compressed stream
+    atomic_int compress_restart;   // a client is waiting: reset the stream at the next batch
+    struct z_stream_s *zstream;    // main thread: deflate state shared by all compressed clients
+    struct net_segment *zsegment;  // main thread: compressed copy of the batch being flushed
+    int batch_limit;     // most bytes in one batch
+    net_flush_policy_t flush_policy; // when to send the batch
+    int flush_size;      // send the batch once it holds this many bytes
+    uint64_t flush_interval; // throughput/adaptive: longest a message waits in the batch (ms)
+    int flush_urgent;    // send DF17/18 position messages at once, with whatever is batched
+    uint64_t batch_start; // mstime() when the first message of the batch was written
+    uint64_t adapt_start; // adaptive: start of the current rate measurement
+    uint64_t adapt_bytes; // adaptive: bytes flushed since then
+    double adapt_rate;    // adaptive: smoothed bytes per ms
+    int adapt_size;       // adaptive: batch size in use, 0 = flush every pass
+    uint64_t rate_bytes;  // --out-rate: bytes per second, 0 = unlimited
+    uint64_t rate_msgs;   // --out-rate-msgs: messages per second, 0 = unlimited
+    double rate_byte_tokens; // token buckets, refilled at those rates up to NET_RATE_BURST ms worth
+    double rate_msg_tokens;
+    uint64_t rate_refill; // monotonic_usecs() when the buckets were last refilled, 0 = not yet (start full)
+    uint64_t thin_interval; // --out-thin: ms per interval, 0 = send everything
+    int thin_limit;       // --out-thin-count: messages per aircraft and category per interval
+    struct thin_table *thin; // main thread: per-aircraft state, set up on first use
+    struct udp_sender *udp; // --outUdp: batches go out as datagrams instead of to clients
+};
+
+// A source of --inUdp datagrams, by address. It stands in for a
+// connection: its frames go to the service's frame handler with the
+// embedded client, which has no socket of its own but carries the input
+// id, the ingress time and the counters.
+#define NET_UDP_FEEDERS_MAX    256
+#define NET_UDP_FEEDER_TIMEOUT 600000 // ms of silence before a feeder is forgotten
+
+struct net_udp_feeder {
+    struct net_udp_feeder *next;     // most recently heard from first
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    uint64_t last_seen;              // mstime() of the latest datagram
+    struct udp_sequence seq;
+    struct client client;
+};
+
+// --inUdp: a datagram socket and the feeders heard on it. Main thread only.
+struct net_udp_input {
+    struct udp_receiver rx;
+    struct net_event ev;
+    struct net_udp_feeder *feeders;
+    int nfeeders;
+};
+
+// Message passed from the main thread to a worker's inbox
+typedef enum {
+    NET_WORKER_ADD_CLIENT,   // take over socket 'fd' as a client of 'service'
+    NET_WORKER_SEGMENT,      // send 'seg' to clients of 'service' (the message holds a reference)
+    NET_WORKER_RESET         // close any clients of 'service'
+} net_worker_msg_type_t;
+
+struct net_worker_msg {
+    net_worker_msg_type_t type;
+    int fd;
+    struct net_service *service;
+    struct net_segment *seg;
+};
+
+// An outgoing connection set up without blocking the event loop: the name
+// is looked up on the resolver thread, then the addresses are tried in
+// parallel, happy eyeballs style, alternating address families and
+// starting another attempt every MODES_NET_CONNECT_DELAY ms until one
+// becomes writable.
+#define NET_CONNECT_MAX_ADDRS 8
+#define NET_CONNECT_ADDR_LEN  64
+
+typedef enum {
+    NET_CONNECT_IDLE,
+    NET_CONNECT_RESOLVING,
+    NET_CONNECT_CONNECTING,
+    NET_CONNECT_CONNECTED,      // done; the socket now belongs to a client of the service
+    NET_CONNECT_FAILED          // done; see err
+} net_connect_state_t;
+
+struct net_connector {
+    struct net_service *service;
+    char *host;
+    char port[8];
+    net_connect_state_t state;
+    unsigned generation;        // tells a stale lookup result from the current one
+    char addrs[NET_CONNECT_MAX_ADDRS][NET_CONNECT_ADDR_LEN];
+    int naddrs;
+    int next;                   // next address to try
+    int pending;                // attempts in flight
+    struct net_event attempts[NET_CONNECT_MAX_ADDRS];
+    uint64_t next_attempt;      // when to start another attempt alongside those in flight
+    uint64_t give_up;           // when to abandon the whole connection
+    char err[ANET_ERR_LEN];     // why it failed
+};
+
+struct net_resolve_msg {
+    struct net_connector *conn;
+    unsigned generation;
+    int naddrs;
+    char addrs[NET_CONNECT_MAX_ADDRS][NET_CONNECT_ADDR_LEN];
+    char err[128];
+};
+
+// The thread that runs blocking getaddrinfo() calls for the connectors
+struct net_resolver {
+    pthread_t thread;
+    int running;
+    int reqfd;                  // eventfd: requests queued
+    int donefd;                 // eventfd: results queued
+    struct net_event done_ev;
+    struct spsc_ring requests;  // struct net_resolve_msg, main thread -> resolver
+    struct spsc_ring results;   // struct net_resolve_msg, resolver -> main thread
+};
+
+// A framed input message on its way from a reader thread to the main thread
+#define NET_FRAME_MAX 63
+struct net_frame {
+    uint64_t ingress;           // --latency: when the reader read it
+    uint32_t ingress_wait;      // --latency: how long it waited in the kernel before that
+    uint8_t len;
+    char data[NET_FRAME_MAX];   // the raw (still escaped) frame, including the leading 0x1a
+};
+
+// A thread running its own event loop for a share of the output clients
+// (output workers) or the input clients (input readers)
+struct net_worker {
+    pthread_t thread;
+    net_shard_t pool;           // which pool this worker belongs to
+    int id;
+    int epfd;                   // this worker's epoll instance
+    int wakefd;                 // eventfd signalled when the inbox is refilled
+    struct net_event wake_ev;
+    struct spsc_ring inbox;     // main thread -> worker, net_worker_msg
+    struct client *clients;     // clients owned by this worker
+    atomic_int nclients;        // clients owned or being handed over
+    int wake_pending;           // main thread: inbox refilled since the last wakeup
+    int fanout_pending;         // worker: frames queued for the main thread since its last wakeup
+    struct net_event *listener_events; // SO_REUSEPORT listeners owned by this worker
+    int listener_count;
+    uint64_t inbox_drops;       // main thread: messages dropped because the inbox was full
+    struct net_latency *latency; // --latency: per service (by id), recorded by this worker
+    char aneterr[ANET_ERR_LEN];
 };
 
 struct net_service *serviceInit(const char *descr, struct net_writer *writer, heartbeat_fn hb_handler, read_mode_t mode, const char *sep, read_fn read_handler);
-struct client *serviceConnect(struct net_service *service, char *addr, int port);
+int serviceConnect(struct net_service *service, char *addr, int port);
+void netServiceReset(struct net_service *service);
+void netConnectorStart(struct net_connector *conn, struct net_service *service, char *host, int port);
+void netConnectorCancel(struct net_connector *conn);
+void netConnectorPoll(struct net_connector *conn, uint64_t now);
+uint64_t netConnectorDeadline(struct net_connector *conn, uint64_t deadline);
 void serviceListen(struct net_service *service, char *bind_addr, char *bind_ports);
+void serviceUdpOutput(struct net_service *service, const char *targets);
+void netUdpFlush(struct net_writer *writer);
+void serviceUdpInput(struct net_service *service, const char *bind_addr, const char *port);
 struct client *createSocketClient(struct net_service *service, int fd);
 struct client *createGenericClient(struct net_service *service, int fd);
+int parseDropPolicy(const char *name, net_drop_policy_t *policy);
+int parseOutputFormat(const char *name, net_format_t *format);
+int parseFlushPolicy(const char *name, net_flush_policy_t *policy);
+void netStartWorkers(void);
+void netStopWorkers(void);
+void netUringSubmit(void);
+int netFanoutPush(struct client *c, const char *data, int len);
+void netClientReply(struct client *c, const char *data, int len);
+void netCompressJoin(struct client *c);
+
+// The pieces of the event loop driven from net_io_ex.c. They are also
+// called directly by the microbenchmark and fuzz harnesses in bench/.
+void modesReadFromClient(struct client *c);
+void *prepareWrite(struct net_writer *writer, int len);
+void completeWrite(struct net_writer *writer, void *endptr);
+void flushWrites(struct net_writer *writer);
+int netFlushDue(struct net_writer *writer, uint64_t now);
+int netRateAdmit(struct net_writer *writer, net_class_t cls, int len, uint64_t now);
+void send_heartbeat(struct net_service *service);
+void netHandleEvents(struct epoll_event *events, int n);
+uint64_t netQueueDeadline(struct client *clients, uint64_t deadline);
+int netReapClients(struct client **clients, uint64_t now);
+void netWorkersWake(void);
 
 
 #endif
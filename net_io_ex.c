@@ -3,7 +3,6 @@
 #include "net_io.h"
 #include "beast-repeater.h"
 #include "util.h"
-#include "net_io.c"
 
 struct beastClient *beastClients;
 
@@ -12,63 +11,231 @@ void clientSendBuffer(struct client *c, char *buf, const int len) {
 	anetWrite(c->fd, buf, len);
 }
 
-struct net_service* makeBeastInputServiceEx(read_fn handler) {
-	return serviceInit("Beast TCP client input Ex", NULL, NULL, READ_MODE_BEAST, NULL,
-			handler);
+struct net_service* makeBeastInputServiceEx(frame_fn handler) {
+	struct net_service *service = serviceInit("Beast TCP client input Ex", NULL, NULL, READ_MODE_BEAST, NULL,
+			NULL);
+	service->frame_handler = handler;
+	service->request_compression = Modes.net_input_compress;
+	service->accept_compression = Modes.net_input_compress;
+	service->shard = NET_SHARD_INPUT;
+	return service;
 }
 
-struct net_service* makeBeastOutputServiceEx(void) {
-	return serviceInit("Beast TCP client output Ex", NULL, NULL, READ_MODE_IGNORE,
+struct net_service* makeBeastOutputServiceEx(struct net_writer *writer) {
+	return serviceInit("Beast TCP client output Ex", writer, NULL, READ_MODE_IGNORE,
 			NULL, NULL);
 }
 
-struct net_service* makeBeastServerInputServiceEx(read_fn handler)
+struct net_service* makeBeastServerInputServiceEx(frame_fn handler)
 {
-    return serviceInit("Beast TCP server input", NULL, NULL, READ_MODE_BEAST, NULL, handler);
+    struct net_service *service = serviceInit("Beast TCP server input", NULL, NULL, READ_MODE_BEAST, NULL, NULL);
+    service->frame_handler = handler;
+    service->accept_compression = Modes.net_input_compress;
+    service->shard = NET_SHARD_INPUT;
+    return service;
+}
+
+// Commands from an output server's clients: 0x1a '1' <c>. Only 'Z', asking
+// for the compressed stream, means anything to a repeater.
+static int handleBeastCommand(struct client *c, char *p) {
+    if (p[1] == NET_COMPRESS_MARKER)
+        netCompressJoin(c);
+    return 0;
 }
 
 struct net_service* makeBeastServerOutputServiceEx(struct net_writer *writer)
 {
-    return serviceInit("Beast TCP server output", writer, send_beast_heartbeat, READ_MODE_IGNORE, NULL, NULL);
+    struct net_service *service = serviceInit("Beast TCP server output", writer, send_heartbeat, READ_MODE_BEAST_COMMAND, NULL, handleBeastCommand);
+    service->shard = NET_SHARD_OUTPUT;
+    return service;
+}
+
+// Datagrams are read and framed on the main thread: there's one socket,
+// however many feeders are behind it
+struct net_service* makeBeastUdpInputServiceEx(frame_fn handler)
+{
+    struct net_service *service = serviceInit("Beast UDP input", NULL, NULL, READ_MODE_BEAST, NULL, NULL);
+    service->frame_handler = handler;
+    return service;
 }
 
-void writeBeastOutput(struct net_service *service, char *data, int len) {
+struct net_service* makeBeastUdpOutputServiceEx(struct net_writer *writer)
+{
+    return serviceInit("Beast UDP output", writer, send_heartbeat, READ_MODE_IGNORE, NULL, NULL);
+}
+
+// Answer one HTTP request on the metrics port. Anything but GET /metrics
+// (or /) gets a 404; the connection is closed after the reply either way.
+static int handleMetricsRequest(struct client *c, char *request) {
+    char header[256];
+    char *body, *reply;
+    size_t bodylen;
+    int hlen;
+
+    if (!strncmp(request, "GET /metrics ", 13) || !strncmp(request, "GET / ", 6)) {
+        body = metricsRender(&bodylen);
+        hlen = snprintf(header, sizeof(header),
+                        "HTTP/1.0 200 OK\r\n"
+                        "Content-Type: text/plain; version=0.0.4\r\n"
+                        "Content-Length: %zu\r\n"
+                        "Connection: close\r\n\r\n", bodylen);
+    } else {
+        body = strdup("Not found\n");
+        bodylen = body ? strlen(body) : 0;
+        hlen = snprintf(header, sizeof(header),
+                        "HTTP/1.0 404 Not Found\r\n"
+                        "Content-Type: text/plain\r\n"
+                        "Content-Length: %zu\r\n"
+                        "Connection: close\r\n\r\n", bodylen);
+    }
+
+    if (!body || !(reply = malloc(hlen + bodylen))) {
+        fprintf(stderr, "Out of memory answering a metrics request\n");
+        exit(1);
+    }
+    memcpy(reply, header, hlen);
+    memcpy(reply + hlen, body, bodylen);
+    netClientReply(c, reply, hlen + bodylen);
+    free(reply);
+    free(body);
+    return 0;
+}
+
+struct net_service* makeMetricsServiceEx(void)
+{
+    return serviceInit("Metrics HTTP", NULL, NULL, READ_MODE_ASCII, "\r\n\r\n", handleMetricsRequest);
+}
+
+// Returns 1 if the frame went into the output's batch, 0 if it was dropped
+int writeBeastOutput(struct net_service *service, char *data, int len) {
     char *buf;
     
-    if (!service) return;
+    if (!service) return 0;
     if (!service->writer)
-        return;
+        return 0;
     buf = prepareWrite(service->writer, len);
     if (!buf)
-        return;
+        return 0;
     memcpy(buf, data, len);
     completeWrite(service->writer, buf + len);
+    return 1;
 }
 
 void modesInitNetEx(void) {
     signal(SIGPIPE, SIG_IGN);
     Modes.clients = NULL;
     Modes.services = NULL;
+    Modes.fanout_handler = broadcastBeastMessage;
+    pthread_mutex_init(&Modes.stats_lock, NULL);
+    beastScanInit();
+
+    if ((Modes.epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        fprintf(stderr, "epoll_create1: %s\n", strerror(errno));
+        exit(1);
+    }
 }
 
-void modesNetPeriodicWorkEx(void) {
-    struct client *c, **prev;    
+// When an --inConnect input last delivered data (or connected)
+static uint64_t beastClientLastData(struct beastClient *bc) {
+    uint64_t last = atomic_load_explicit(&bc->serviceHandle->last_read, memory_order_relaxed);
+    return last > bc->connectedAt ? last : bc->connectedAt;
+}
+
+// Pick the next reconnect time: exponential backoff from
+// Modes.net_reconnect_min up to Modes.net_reconnect_max, with "equal
+// jitter" (half the delay is random) so that many clients cut off by the
+// same outage don't all come back in lockstep.
+static uint64_t beastClientBackoff(struct beastClient *bc, uint64_t now) {
+    uint64_t delay;
+
+    if (!bc->backoff)
+        bc->backoff = Modes.net_reconnect_min;
+    else if (bc->backoff < Modes.net_reconnect_max / 2)
+        bc->backoff *= 2;
+    else
+        bc->backoff = Modes.net_reconnect_max;
+
+    delay = bc->backoff / 2 + (uint64_t) random() % (bc->backoff / 2 + 1);
+    bc->reconnectTime = now + delay;
+    return delay;
+}
+
+// Work out how long the event loop may sleep before some timed work
+// (heartbeats, delayed flushes, reconnects) becomes due.
+// Returns milliseconds, or -1 if nothing is scheduled at all.
+int modesNetTimeoutEx(void) {
     struct net_service *s;
     struct beastClient *bc;
     uint64_t now = mstime();
-    int need_flush = 0;
-
-    // Accept new connections
-    modesAcceptClients();
+    uint64_t deadline = UINT64_MAX;
 
-    // Read from clients
-    for (c = Modes.clients; c; c = c->next) {
-        if (!c->service)
+    for (s = Modes.services; s; s = s->next) {
+        if (!s->writer)
             continue;
-        if (c->service->read_handler)
-            modesReadFromClient(c);
+        if (s->writer->dataUsed && s->writer->batch_start + s->writer->flush_interval < deadline)
+            deadline = s->writer->batch_start + s->writer->flush_interval;
+        if (Modes.net_heartbeat_interval &&
+            s->connections &&
+            s->writer->send_heartbeat &&
+            s->writer->lastWrite + Modes.net_heartbeat_interval < deadline)
+            deadline = s->writer->lastWrite + Modes.net_heartbeat_interval;
+    }
+
+    for (bc = beastClients; bc; bc = bc->next) {
+        if (bc->connector.state == NET_CONNECT_IDLE &&
+            !bc->serviceHandle->connections &&
+            bc->reconnectTime < deadline)
+            deadline = bc->reconnectTime;
+        if (bc->connected && bc->isInput && Modes.net_input_timeout &&
+            beastClientLastData(bc) + Modes.net_input_timeout < deadline)
+            deadline = beastClientLastData(bc) + Modes.net_input_timeout;
+        deadline = netConnectorDeadline(&bc->connector, deadline);
+    }
+
+    // Output queues that will go stale
+    deadline = netQueueDeadline(Modes.clients, deadline);
+
+    // The next frame of a replay, rounded up to a whole millisecond
+    if (Modes.replay && !Modes.replay->done) {
+        uint64_t due = replayDeadline(Modes.replay);
+        uint64_t us = monotonic_usecs();
+        uint64_t when = due > us ? now + (due - us + 999) / 1000 : now;
+        if (when < deadline)
+            deadline = when;
+    }
+
+    if (deadline == UINT64_MAX)
+        return -1;
+    if (deadline <= now)
+        return 0;
+    if (deadline - now > INT_MAX)
+        return INT_MAX;
+    return (int) (deadline - now);
+}
+
+// Wait up to timeout milliseconds (-1 = forever) for network activity,
+// then accept and read whatever is ready.
+void modesNetPollEx(int timeout) {
+    struct epoll_event events[64];
+    int n;
+
+    n = epoll_wait(Modes.epfd, events, 64, timeout);
+    if (n < 0) {
+        if (errno != EINTR) {
+            fprintf(stderr, "epoll_wait: %s\n", strerror(errno));
+            Modes.exit = 1;
+        }
+        return;
     }
 
+    netHandleEvents(events, n);
+}
+
+void modesNetPeriodicWorkEx(void) {
+    struct net_service *s;
+    struct beastClient *bc;
+    uint64_t now = mstime();
+
     // If we have generated no messages for a while, send
     // a heartbeat
     if (Modes.net_heartbeat_interval) {
@@ -82,110 +249,301 @@ void modesNetPeriodicWorkEx(void) {
         }
     }
 
-    // If we have data that has been waiting to be written for a while,
-    // write it now.
+    // Replayed frames that are due go out with this pass's output
+    if (Modes.replay)
+        replayPoll(Modes.replay, monotonic_usecs(), MODES_NET_FANOUT_BATCH, broadcastBeastMessage);
+
+    // Anything generated during this pass of the event loop is written
+    // out now rather than waiting for the buffer to fill, so each frame
+    // goes out as soon as the input it arrived on has been drained.
+    // Outputs that favour throughput keep batching until their deadline.
     for (s = Modes.services; s; s = s->next) {    	
-        if (s->writer &&
-            s->writer->dataUsed &&
-            (need_flush || (s->writer->lastWrite + Modes.net_output_flush_interval) <= now)) {
+        if (s->writer && netFlushDue(s->writer, now)) {
             flushWrites(s->writer);
         }
+        // UDP outputs send all of this pass's datagrams in one go
+        if (s->writer && s->writer->udp)
+            netUdpFlush(s->writer);
     }
 
-    // Unlink and free closed clients
-    for (prev = &Modes.clients, c = *prev; c; c = *prev) {
-        if (c->fd == -1) {
-            // Recently closed, prune from list
-            *prev = c->next;
-            printf("Connection lost with %p\n", c);
-            free(c);
-        } else {
-            prev = &c->next;
-        }
-    }
+    // Apply age limits to output queues that aren't moving, and unlink
+    // and free closed clients
+    netReapClients(&Modes.clients, now);
     //static struct beastClient* beastClients;
     //fprintf(stderr, "Chechking BEAST clients... %p\n", beastClients);
 
-    // Check input connections and reconnect
+    // Supervise the --inConnect/--outConnect connections. Connecting never
+    // blocks, so an unreachable peer doesn't hold up the other streams.
     for (bc = beastClients; bc; bc = bc->next) {
-    	if (!bc->clientHandle || !bc->serviceHandle->connections) {
-    		if (now >= bc->reconnectTime) {
-    			fprintf(stderr, "BEAST %s: connecting to %s:%d...\n", bc->isInput ? "INPUT" : "OUTPUT", bc->ipaddr, bc->ipport);			
-    			bc->clientHandle = serviceConnect(bc->serviceHandle, bc->ipaddr,
-    					bc->ipport);
-    			
-    			if (!bc->clientHandle) {
-    				fprintf(stderr, "Error establishing connection to %s:%d (%s). Reconnect after 10 seconds...\n", bc->ipaddr, bc->ipport, Modes.aneterr);
-    				bc->reconnectTime = now + RECONNECT_TIME_MS;
-    			} else {
-    				bc->reconnectTime = now;
-    				fprintf(stderr, "Connection established to %s:%d\n", bc->ipaddr, bc->ipport);
-    			}
+    	uint64_t delay;
+
+    	netConnectorPoll(&bc->connector, now);
+
+    	switch (bc->connector.state) {
+    	case NET_CONNECT_CONNECTED:
+    		bc->connector.state = NET_CONNECT_IDLE;
+    		bc->connected = true;
+    		bc->connectedAt = now;
+    		// an output has done its job once it's connected; an input
+    		// only once data arrives (see below)
+    		if (!bc->isInput)
+    			bc->backoff = 0;
+    		fprintf(stderr, "Connection established to %s:%d\n", bc->ipaddr, bc->ipport);
+    		break;
+
+    	case NET_CONNECT_FAILED:
+    		bc->connector.state = NET_CONNECT_IDLE;
+    		delay = beastClientBackoff(bc, now);
+    		fprintf(stderr, "Error establishing connection to %s:%d (%s). Reconnect after %.1f seconds...\n", bc->ipaddr, bc->ipport, bc->connector.err, delay / 1000.0);
+    		break;
+
+    	case NET_CONNECT_IDLE:
+    		if (bc->serviceHandle->connections) {
+    			if (!bc->isInput || !bc->connected)
+    				break;
+    			if (bc->backoff && atomic_load_explicit(&bc->serviceHandle->last_read, memory_order_relaxed) > bc->connectedAt)
+    				bc->backoff = 0;
+    			// Half-open connections never see EOF; don't wait for
+    			// keepalive if the feed has simply stopped
+    			if (Modes.net_input_timeout && now >= beastClientLastData(bc) + Modes.net_input_timeout) {
+    				fprintf(stderr, "BEAST INPUT: no data from %s:%d for %.1f seconds, reconnecting\n", bc->ipaddr, bc->ipport, (now - beastClientLastData(bc)) / 1000.0);
+    				netServiceReset(bc->serviceHandle);
+    				bc->connectedAt = now;
     			}
-    		} //else if (!bc->serviceHandle->connections) bc->clientHandle = NULL;
+    		} else if (bc->connected) {
+    			bc->connected = false;
+    			delay = beastClientBackoff(bc, now);
+    			fprintf(stderr, "BEAST %s: lost connection to %s:%d. Reconnect after %.1f seconds...\n", bc->isInput ? "INPUT" : "OUTPUT", bc->ipaddr, bc->ipport, delay / 1000.0);
+    		} else if (now >= bc->reconnectTime) {
+    			fprintf(stderr, "BEAST %s: connecting to %s:%d...\n", bc->isInput ? "INPUT" : "OUTPUT", bc->ipaddr, bc->ipport);
+    			netConnectorStart(&bc->connector, bc->serviceHandle, bc->ipaddr, bc->ipport);
+    		}
+    		break;
+
+    	default:
+    		break;
     	}
+    }
+
+    // Hand the flushed output and any new connections to the workers
+    netWorkersWake();
+
+    // --io-uring: and everything this pass prepared to the kernel, at once
+    netUringSubmit();
+}
+
+// A frame's other encodings, each worked out the first time an output in
+// that format with somebody connected wants it, then shared by all of them
+struct net_encoded {
+	const char *data;          // the Beast frame
+	int len;
+	int featured;              // ff is filled in
+	struct frame_features ff;
+	unsigned done;             // bit per format: textlen/text are filled in
+	int textlen[NET_FORMATS];  // 0 = the frame has no form in this format
+	char text[NET_FORMATS][ENCODE_MAX];
+};
+
+static const struct frame_features *frameFeatures(struct net_encoded *enc) {
+	if (!enc->featured) {
+		filterFeatures((const unsigned char *) enc->data, enc->len, &enc->ff);
+		enc->featured = 1;
+	}
+	return &enc->ff;
+}
+
+// DF17/18 airborne and surface positions: what --out-flush-urgent sends
+// without waiting for the batch
+static int isPositionFrame(const struct frame_features *ff) {
+	int tc;
+
+	if (!ff->modes || (ff->df != 17 && ff->df != 18))
+		return 0;
+	tc = ff->msg[4] >> 3;
+	return (tc >= 5 && tc <= 18) || (tc >= 20 && tc <= 22);
+}
+
+// --out-thin: whether an output has had enough of this aircraft's
+// messages of this kind for the current interval. A frame that may go
+// out is counted by thinCommit() only once it has. Outputs with nobody
+// connected keep no state.
+static int thinOutput(struct net_service *service, struct net_encoded *enc, struct thin_pass *pass) {
+	struct net_writer *writer = service->writer;
+	uint64_t now = mstime();
+
+	pass->slot = NULL;
+	if (!service->connections)
+		return 0;
+	if (!writer->thin) {
+		if (!(writer->thin = malloc(sizeof(*writer->thin))) ||
+		    thinInit(writer->thin, writer->thin_interval, writer->thin_limit, MODES_THIN_AIRCRAFT, now) < 0) {
+			fprintf(stderr, "Out of memory allocating the --out-thin table\n");
+			exit(1);
+		}
+	}
+	return thinCheck(writer->thin, frameFeatures(enc), now, pass);
+}
+
+// What an output over its --out-rate budget gives up first
+static net_class_t frameClass(const struct frame_features *ff) {
+	if (!ff->modes || ff->df == 11)
+		return NET_CLASS_LOW;
+	if (ff->df == 17 || ff->df == 18)
+		return isPositionFrame(ff) ? NET_CLASS_POSITION : NET_CLASS_ES;
+	return NET_CLASS_SURV;
+}
+
+// Whether an output's --out-rate budget has room for 'len' bytes of the
+// frame. Outputs with nobody connected spend nothing.
+static int rateAdmit(struct net_service *service, struct net_encoded *enc, int len) {
+	struct net_writer *writer = service->writer;
+
+	if ((!writer->rate_bytes && !writer->rate_msgs) || !service->connections)
+		return 1;
+	return netRateAdmit(writer, frameClass(frameFeatures(enc)), len, monotonic_usecs());
+}
+
+// Returns 1 if the frame went into the output's batch, 0 if it was dropped
+static int writeEncodedOutput(struct net_service *service, struct net_encoded *enc) {
+	net_format_t format = service->writer->format;
+	char *buf;
+	int len;
+
+	if (!service->connections) {
+		NET_STAT_ADD(service->stats.drops_idle, 1);
+		return 0;
+	}
+
+	if (!(enc->done & (1u << format))) {
+		enc->done |= 1u << format;
+		if (format == NET_FORMAT_RAW)
+			enc->textlen[format] = encodeAvr(frameFeatures(enc), enc->text[format]);
+		else
+			enc->textlen[format] = encodeSbs(&Modes.sbs, frameFeatures(enc), mstime(), enc->text[format]);
+	}
+	if (!(len = enc->textlen[format]) || !rateAdmit(service, enc, len))
+		return 0;
+
+	buf = prepareWrite(service->writer, len);
+	if (!buf)
+		return 0;
+	memcpy(buf, enc->text[format], len);
+	completeWrite(service->writer, buf + len);
+	return 1;
 }
 
 void broadcastBeastMessage(char* data, int len) {
 	
-	struct beastClient *c;
 	struct net_service *s;
-	
-	for (c = beastClients; c; c = c->next)
-		if (c->clientHandle && !c->isInput) clientSendBuffer(c->clientHandle, data, len);
-	
-	for (s = Modes.services; s; s = s->next) {			
-	       writeBeastOutput(s, data, len);
+	struct net_encoded enc;
+
+	uint64_t pass = ~(uint64_t) 0;
+
+	// Only the first copy of a frame heard by several receivers goes out
+	if (Modes.dedup_window && dedupCheck(&Modes.dedup, (unsigned char *) data, len, mstime()))
+		return;
+
+	enc.data = data;
+	enc.len = len;
+	enc.featured = 0;
+	enc.done = 0;
+
+	// Decide for every output filter at once
+	if (Modes.filters)
+		pass = filterEvaluate(Modes.filters, frameFeatures(&enc));
+
+	for (s = Modes.services; s; s = s->next) {
+		struct thin_pass thin;
+		int wrote;
+
+		if (!s->writer)
+			continue;
+		if (s->writer->filter && !(pass & ((uint64_t) 1 << s->writer->filter->id)))
+			continue;
+		if (s->writer->thin_interval && thinOutput(s, &enc, &thin))
+			continue;
+		if (s->writer->format == NET_FORMAT_BEAST)
+			wrote = rateAdmit(s, &enc, len) && writeBeastOutput(s, data, len);
+		else
+			wrote = writeEncodedOutput(s, &enc);
+		if (!wrote)
+			continue;
+
+		// Only frames that went out count against --out-thin
+		if (s->writer->thin_interval && s->writer->thin)
+			thinCommit(s->writer->thin, &thin);
+
+		// Only a position that just went into the batch sends it early
+		if (s->writer->flush_urgent && isPositionFrame(frameFeatures(&enc)))
+			flushWrites(s->writer);
 	}
 }
 
 
-int handleBeastMessage(struct client *c, char *p) {
-	
-	UNUSED(c);
-	//UNUSED(p);
-	
-    int dataLen = 2;
-    char* dataStart;
-    int msgLen = 0;
-    int  j;
-    char ch;
-    
-    
-    dataStart = p;
-    dataStart--;
-            
-    ch = *p++; /// Get the message type
-
-    switch(ch) {
-    case '1': msgLen = MODEAC_MSG_BYTES;
-    	break;
-    case '2': msgLen = MODES_SHORT_MSG_BYTES;
-    	break;
-    case '3': msgLen = MODES_LONG_MSG_BYTES;
-    	break;
-    case '5': msgLen = 21;
-    	break;    	 
-    }
-    
-    if (msgLen) {
-    	j = 0;
-    	while(j <= msgLen + 6) {
-    		ch = *p++;
-    		j++;
-    		dataLen++;
-    		if (0x1A == ch) {p++; dataLen++; }    		
-    	}
-    	    	
-    	broadcastBeastMessage(dataStart, dataLen);
-    }
-    return 0;
+int handleBeastMessage(struct client *c, const struct beast_frame *frame) {
+	if (Modes.capture)
+		captureFrame(Modes.capture, c->id, c->ingress, frame->raw, frame->raw_len);
+
+	// Frames read on an input reader thread go to the main thread for fan-out
+	if (c->ev.worker) {
+		netFanoutPush(c, frame->raw, frame->raw_len);
+	} else {
+		Modes.net_ingress = c->ingress;
+		Modes.net_ingress_wait = c->ingress_wait;
+		broadcastBeastMessage(frame->raw, frame->raw_len);
+		Modes.net_ingress = 0;
+	}
+	return 0;
+}
+
+// Compile the output filters, once all the options are known. Outputs
+// with no --out-filter of their own share the default filter, which is
+// only needed if some default differs from passing everything.
+void modesInitFiltersEx(void) {
+	struct net_service *s;
+	struct net_filter *shared = NULL;
+	char err[256];
+	int id = 0;
+
+	for (s = Modes.services; s; s = s->next) {
+		struct net_writer *w = s->writer;
+		const char *spec;
+
+		if (!w)
+			continue;
+
+		spec = w->filter_spec;
+		if (!spec) {
+			if (shared) {
+				w->filter = shared;
+				continue;
+			}
+			if (!Modes.net_output_filter && Modes.forward_mlat && Modes.mode_ac && !Modes.check_crc)
+				continue;
+			spec = Modes.net_output_filter ? Modes.net_output_filter : "";
+		}
+
+		if (id >= FILTER_MAX) {
+			fprintf(stderr, "Too many output filters (at most %d)\n", FILTER_MAX);
+			exit(1);
+		}
+		if (!(w->filter = filterCompile(spec, err, sizeof(err)))) {
+			fprintf(stderr, "Bad output filter '%s': %s\n", spec, err);
+			exit(1);
+		}
+		w->filter->id = id++;
+		w->filter->next = Modes.filters;
+		Modes.filters = w->filter;
+		if (!w->filter_spec)
+			shared = w->filter;
+	}
 }
 
 void freeBeastClients() {
 	
 struct beastClient *c, *p;
 for (c = beastClients; c; c = p) {
+	netConnectorCancel(&c->connector);
 	free(c->ipaddr);
 	p = c->next;
 	free(c);
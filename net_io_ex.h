@@ -6,31 +6,38 @@
 #include "beast-repeater.h"
 
 
-#define RECONNECT_TIME_MS 10000
-
 struct beastClient {
 	struct beastClient* next;
 	struct net_service* serviceHandle;
-	struct client* clientHandle;
+	struct net_connector connector;
 	char* ipaddr;
 	int ipport;
 	uint64_t reconnectTime;
+	uint64_t backoff;        // current reconnect delay before jitter, 0 after a good connection
+	uint64_t connectedAt;    // when the current connection was made
+	bool connected;          // a connection was made and hasn't been seen to drop yet
 	bool isInput;
 };
 
 extern struct beastClient *beastClients;
 
 void clientSendBuffer(struct client *c, char *buf, const int len);
-struct net_service* makeBeastInputServiceEx(read_fn handler);
-struct net_service* makeBeastOutputServiceEx(void);
-struct net_service* makeBeastServerInputServiceEx(read_fn handler);
+struct net_service* makeBeastInputServiceEx(frame_fn handler);
+struct net_service* makeBeastOutputServiceEx(struct net_writer *writer);
+struct net_service* makeBeastServerInputServiceEx(frame_fn handler);
 struct net_service* makeBeastServerOutputServiceEx(struct net_writer *writer);
-void writeBeastOutput(struct net_service *service, char *data, int len);
+struct net_service* makeBeastUdpInputServiceEx(frame_fn handler);
+struct net_service* makeBeastUdpOutputServiceEx(struct net_writer *writer);
+struct net_service* makeMetricsServiceEx(void);
+int writeBeastOutput(struct net_service *service, char *data, int len);
 void modesInitNetEx(void);
 void modesNetPeriodicWorkEx(void);
+int modesNetTimeoutEx(void);
+void modesNetPollEx(int timeout);
 
 void broadcastBeastMessage(char* data, int len);
-int handleBeastMessage(struct client *c, char *p);
+int handleBeastMessage(struct client *c, const struct beast_frame *frame);
+void modesInitFiltersEx(void);
 void freeBeastClients();
 struct beastClient* newBeastClient();
 
@@ -0,0 +1,131 @@
+// Part of dump1090, a Mode S message decoder for RTLSDR devices.
+//
+// readbuf.c: growable circular read buffers for network clients
+//
+// This file is free software: you may copy, redistribute and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation, either version 2 of the License, or (at your
+// option) any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#define _GNU_SOURCE // memfd_create
+
+#include "readbuf.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+// Map 'size' bytes of fresh shared memory twice in a row. Returns NULL if
+// that isn't possible here
+static char *mirrorMap(size_t size)
+{
+#ifdef MFD_CLOEXEC
+    char *base, *p;
+    int fd;
+
+    if ((fd = memfd_create("beast-readbuf", MFD_CLOEXEC)) < 0)
+        return NULL;
+    if (ftruncate(fd, size) < 0) {
+        close(fd);
+        return NULL;
+    }
+
+    // reserve the whole range first so the two halves end up adjacent
+    base = mmap(NULL, 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+
+    p = mmap(base, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0);
+    if (p != MAP_FAILED)
+        p = mmap(base + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0);
+
+    // the mappings keep the memory alive
+    close(fd);
+
+    if (p == MAP_FAILED) {
+        munmap(base, 2 * size);
+        return NULL;
+    }
+    return base;
+#else
+    (void) size;
+    return NULL;
+#endif
+}
+
+static void release(struct readbuf *rb)
+{
+    if (!rb->base)
+        return;
+    if (rb->mirrored)
+        munmap(rb->base, 2 * rb->size);
+    else
+        free(rb->base);
+}
+
+int readbufReserve(struct readbuf *rb, size_t want)
+{
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    size_t size = page;
+    char *base;
+    int mirrored = 1;
+
+    if (rb->base && rb->size > want)
+        return 0;
+
+    while (size <= want)
+        size <<= 1;
+
+    if (!(base = mirrorMap(size))) {
+        mirrored = 0;
+        if (!(base = malloc(size)))
+            return -1;
+    }
+
+    // the unread data is contiguous in either layout
+    if (rb->base && rb->len)
+        memcpy(base, rb->base + rb->head, rb->len);
+    release(rb);
+
+    rb->base = base;
+    rb->size = size;
+    rb->head = 0;
+    rb->mirrored = mirrored;
+    return 0;
+}
+
+void readbufFree(struct readbuf *rb)
+{
+    release(rb);
+    rb->base = NULL;
+    rb->size = rb->head = rb->len = 0;
+}
+
+void readbufConsume(struct readbuf *rb, size_t n)
+{
+    rb->len -= n;
+
+    if (rb->mirrored) {
+        rb->head = (rb->head + n) & (rb->size - 1);
+    } else {
+        // no second mapping to wrap into: shift what's left down
+        if (rb->len)
+            memmove(rb->base, rb->base + rb->head + n, rb->len);
+        rb->head = 0;
+    }
+
+    // an empty ring may as well start from the top
+    if (!rb->len)
+        rb->head = 0;
+}
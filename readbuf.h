@@ -0,0 +1,66 @@
+// Part of dump1090, a Mode S message decoder for RTLSDR devices.
+//
+// readbuf.h: growable circular read buffers for network clients
+//
+// This file is free software: you may copy, redistribute and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation, either version 2 of the License, or (at your
+// option) any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef DUMP1090_READBUF_H
+#define DUMP1090_READBUF_H
+
+#include <stddef.h>
+
+// A ring buffer mapped twice, back to back, so that base[i] and
+// base[i + size] are the same byte. Both the unread data and the free
+// space are then always contiguous however they wrap, so data can be read
+// straight into the ring and parsed in place, and consuming it is just
+// moving the head - nothing is ever shifted down with memmove.
+//
+// If the double mapping can't be set up the buffer falls back to a plain
+// allocation that is compacted after each read, like the old fixed buffer.
+struct readbuf {
+    char *base;         // NULL until first used
+    size_t size;        // capacity, a power of two and a multiple of the page size
+    size_t head;        // offset of the first unread byte, < size
+    size_t len;         // bytes of unread data
+    int mirrored;       // 1 if base maps the ring twice
+};
+
+// Make sure the buffer can hold at least 'want' bytes (plus one spare byte
+// for NUL termination), keeping any unread data. Returns 0, or -1 if out
+// of memory
+int readbufReserve(struct readbuf *rb, size_t want);
+void readbufFree(struct readbuf *rb);
+
+// Start of the unread data
+static inline char *readbufData(struct readbuf *rb)
+{
+    return rb->base + rb->head;
+}
+
+// Where new data goes, and how much room there is there. One byte is
+// always kept free so the data can be NUL terminated in place.
+static inline char *readbufTail(struct readbuf *rb)
+{
+    return rb->base + (rb->mirrored ? (rb->head + rb->len) & (rb->size - 1) : rb->head + rb->len);
+}
+
+static inline size_t readbufSpace(struct readbuf *rb)
+{
+    return rb->size - rb->len - 1;
+}
+
+// Drop 'n' bytes from the start of the unread data
+void readbufConsume(struct readbuf *rb, size_t n);
+
+#endif
@@ -0,0 +1,149 @@
+// Part of dump1090, a Mode S message decoder for RTLSDR devices.
+//
+// ring.c: lock-free bounded queues for passing work between threads
+//
+// This file is free software: you may copy, redistribute and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation, either version 2 of the License, or (at your
+// option) any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "ring.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static size_t roundUpPow2(size_t n)
+{
+    size_t p = 1;
+    while (p < n)
+        p <<= 1;
+    return p;
+}
+
+int spscInit(struct spsc_ring *ring, size_t capacity, size_t elem_size)
+{
+    capacity = roundUpPow2(capacity);
+
+    if (!(ring->slots = malloc(capacity * elem_size)))
+        return -1;
+
+    ring->mask = capacity - 1;
+    ring->elem_size = elem_size;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    return 0;
+}
+
+void spscFree(struct spsc_ring *ring)
+{
+    free(ring->slots);
+    ring->slots = NULL;
+}
+
+int spscPush(struct spsc_ring *ring, const void *elem)
+{
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    if (tail - head > ring->mask)
+        return -1;
+
+    memcpy(ring->slots + (tail & ring->mask) * ring->elem_size, elem, ring->elem_size);
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    return 0;
+}
+
+int spscPop(struct spsc_ring *ring, void *elem)
+{
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+    if (head == tail)
+        return -1;
+
+    memcpy(elem, ring->slots + (head & ring->mask) * ring->elem_size, ring->elem_size);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return 0;
+}
+
+int mpscInit(struct mpsc_ring *ring, size_t capacity, size_t elem_size)
+{
+    size_t i;
+
+    capacity = roundUpPow2(capacity);
+
+    if (!(ring->slots = malloc(capacity * elem_size)))
+        return -1;
+    if (!(ring->seq = malloc(capacity * sizeof(atomic_size_t)))) {
+        free(ring->slots);
+        return -1;
+    }
+
+    // slot i is free for whoever claims position i
+    for (i = 0; i < capacity; ++i)
+        atomic_init(&ring->seq[i], i);
+
+    ring->mask = capacity - 1;
+    ring->elem_size = elem_size;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    return 0;
+}
+
+void mpscFree(struct mpsc_ring *ring)
+{
+    free(ring->slots);
+    free(ring->seq);
+    ring->slots = NULL;
+    ring->seq = NULL;
+}
+
+int mpscPush(struct mpsc_ring *ring, const void *elem)
+{
+    size_t pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t seq;
+
+    for (;;) {
+        seq = atomic_load_explicit(&ring->seq[pos & ring->mask], memory_order_acquire);
+        if (seq == pos) {
+            // slot is free; try to claim it
+            if (atomic_compare_exchange_weak_explicit(&ring->tail, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+            // pos was reloaded by the failed exchange
+        } else if ((ptrdiff_t) (seq - pos) < 0) {
+            // slot still holds data from the previous lap: full
+            return -1;
+        } else {
+            // another producer got there first
+            pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        }
+    }
+
+    memcpy(ring->slots + (pos & ring->mask) * ring->elem_size, elem, ring->elem_size);
+    atomic_store_explicit(&ring->seq[pos & ring->mask], pos + 1, memory_order_release);
+    return 0;
+}
+
+int mpscPop(struct mpsc_ring *ring, void *elem)
+{
+    size_t pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t seq = atomic_load_explicit(&ring->seq[pos & ring->mask], memory_order_acquire);
+
+    if (seq != pos + 1)
+        return -1;
+
+    memcpy(elem, ring->slots + (pos & ring->mask) * ring->elem_size, ring->elem_size);
+    // free the slot for the producer one lap ahead
+    atomic_store_explicit(&ring->seq[pos & ring->mask], pos + ring->mask + 1, memory_order_release);
+    atomic_store_explicit(&ring->head, pos + 1, memory_order_relaxed);
+    return 0;
+}
@@ -0,0 +1,70 @@
+// Part of dump1090, a Mode S message decoder for RTLSDR devices.
+//
+// ring.h: lock-free bounded queues for passing work between threads
+//
+// This file is free software: you may copy, redistribute and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation, either version 2 of the License, or (at your
+// option) any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef DUMP1090_RING_H
+#define DUMP1090_RING_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+// Single producer, single consumer ring of fixed-size elements.
+// The producer and consumer indexes live on separate cache lines so the
+// two threads don't fight over them.
+struct spsc_ring {
+    size_t mask;          // capacity - 1 (capacity is a power of two)
+    size_t elem_size;
+    char *slots;
+    _Alignas(64) atomic_size_t head; // next slot to read, owned by the consumer
+    _Alignas(64) atomic_size_t tail; // next slot to write, owned by the producer
+};
+
+// Set up a ring holding at least 'capacity' elements of 'elem_size' bytes.
+// Returns 0 on success, -1 if out of memory
+int spscInit(struct spsc_ring *ring, size_t capacity, size_t elem_size);
+void spscFree(struct spsc_ring *ring);
+
+// Producer side: copy one element in. Returns 0, or -1 if the ring is full
+int spscPush(struct spsc_ring *ring, const void *elem);
+
+// Consumer side: copy one element out. Returns 0, or -1 if the ring is empty
+int spscPop(struct spsc_ring *ring, void *elem);
+
+// Multiple producer, single consumer ring of fixed-size elements.
+// Each slot carries a sequence number saying whether it is free for the
+// producer whose turn it is, or holds data ready for the consumer, so
+// producers only contend on the tail index and never on each other's slots.
+struct mpsc_ring {
+    size_t mask;          // capacity - 1 (capacity is a power of two)
+    size_t elem_size;
+    char *slots;
+    atomic_size_t *seq;   // per-slot sequence numbers
+    _Alignas(64) atomic_size_t head; // next slot to read, owned by the consumer
+    _Alignas(64) atomic_size_t tail; // next slot to claim, shared by the producers
+};
+
+int mpscInit(struct mpsc_ring *ring, size_t capacity, size_t elem_size);
+void mpscFree(struct mpsc_ring *ring);
+
+// Producer side, safe from any thread: copy one element in.
+// Returns 0, or -1 if the ring is full
+int mpscPush(struct mpsc_ring *ring, const void *elem);
+
+// Consumer side, one thread only: copy one element out.
+// Returns 0, or -1 if the ring is empty
+int mpscPop(struct mpsc_ring *ring, void *elem);
+
+#endif
@@ -0,0 +1,198 @@
+// Part of dump1090, a Mode S message decoder for RTLSDR devices.
+//
+// thin.c: per-aircraft thinning of the messages sent to an output
+//
+// This file is free software: you may copy, redistribute and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation, either version 2 of the License, or (at your
+// option) any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "thin.h"
+#include "filter.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// How far to probe before evicting, as for the duplicate filter
+#define THIN_MAX_PROBE 32
+
+int thinInit(struct thin_table *table, uint64_t interval, int limit, size_t capacity, uint64_t now)
+{
+    size_t size = 1;
+
+    while (size < capacity)
+        size <<= 1;
+
+    if (!(table->slots = calloc(size, sizeof(struct thin_entry))))
+        return -1;
+    table->mask = size - 1;
+    table->epoch = now;
+    table->interval = interval < UINT32_MAX / 2 ? (uint32_t) interval : UINT32_MAX / 2;
+    table->limit = limit > 0 ? limit : 1;
+    table->passed = table->thinned = 0;
+    return 0;
+}
+
+void thinFree(struct thin_table *table)
+{
+    free(table->slots);
+    table->slots = NULL;
+}
+
+// FNV-1a over some bytes of the payload
+static uint32_t thinDigest(const unsigned char *p, int len)
+{
+    uint32_t h = 0x811c9dc5u;
+    int i;
+
+    for (i = 0; i < len; ++i)
+        h = (h ^ p[i]) * 0x01000193u;
+    return h;
+}
+
+// Sort a message into its category, and work out the part of its content
+// that matters when it changes: not what moves all the time (position,
+// speed), but what a display would want to hear about at once (a new
+// callsign or squawk, an emergency, a level change). Returns -1 for
+// messages that aren't thinned.
+static int thinCategory(const struct frame_features *ff, uint32_t *key)
+{
+    const unsigned char *msg = ff->msg;
+    const unsigned char *me = msg + 4;
+    int tc;
+
+    switch (ff->df) {
+    case 17:
+    case 18:
+        tc = me[0] >> 3;
+        if (tc >= 5 && tc <= 8) {
+            *key = tc;                  // surface: the movement field changes all the time
+            return (me[2] & 0x04) ? THIN_POSITION_ODD : THIN_POSITION_EVEN;
+        }
+        if ((tc >= 9 && tc <= 18) || (tc >= 20 && tc <= 22)) {
+            *key = me[0];               // type, surveillance status (alert, SPI) and antenna
+            return (me[2] & 0x04) ? THIN_POSITION_ODD : THIN_POSITION_EVEN;
+        }
+        if (tc == 19) {
+            *key = me[0] | (me[1] & 0xe0) << 8; // type and subtype
+            return THIN_VELOCITY;
+        }
+        *key = thinDigest(me, 7);
+        if (tc >= 1 && tc <= 4)
+            return THIN_IDENT;
+        if (tc == 28)
+            return THIN_STATUS;
+        if (tc == 29)
+            return THIN_TARGET;
+        if (tc == 31)
+            return THIN_OPSTATUS;
+        return THIN_ES_OTHER;
+
+    case 0:
+    case 4:
+    case 16:
+    case 20:
+        // flight status (or DF0/16's vertical status) and the altitude code
+        *key = (uint32_t) (msg[0] & 0x07) << 13 | (uint32_t) (msg[2] & 0x1f) << 8 | msg[3];
+        return THIN_ALTITUDE;
+
+    case 5:
+    case 21:
+        // flight status and the squawk
+        *key = (uint32_t) (msg[0] & 0x07) << 13 | (uint32_t) (msg[2] & 0x1f) << 8 | msg[3];
+        return THIN_SQUAWK;
+
+    case 11:
+        *key = msg[0] & 0x07;          // capability; the interrogator id varies
+        return THIN_ALLCALL;
+
+    default:
+        return -1;
+    }
+}
+
+// The aircraft's entry, set up afresh if it's new (or had gone silent)
+static struct thin_entry *thinLookup(struct thin_table *table, uint32_t addr, uint32_t now)
+{
+    struct thin_entry *victim = NULL, *oldest = NULL;
+    size_t i, idx;
+
+    // multiply-xorshift: ICAO addresses are handed out in blocks
+    idx = (size_t) (((uint64_t) addr * 0x9e3779b97f4a7c15ULL) >> 32) & table->mask;
+
+    for (i = 0; i < THIN_MAX_PROBE; ++i) {
+        struct thin_entry *e = &table->slots[(idx + i) & table->mask];
+        int live = e->addr && now - e->seen < THIN_EXPIRE;
+
+        if (live && e->addr == (addr | THIN_USED)) {
+            e->seen = now;
+            return e;
+        }
+
+        if (!e->addr) {
+            if (!victim)
+                victim = e;
+            break;
+        }
+
+        if (!live && !victim)
+            victim = e;
+        if (!oldest || (uint32_t) (now - e->seen) > (uint32_t) (now - oldest->seen))
+            oldest = e;
+    }
+
+    if (!victim)
+        victim = oldest;
+    memset(victim, 0, sizeof(*victim));
+    victim->addr = addr | THIN_USED;
+    victim->seen = now;
+    return victim;
+}
+
+int thinCheck(struct thin_table *table, const struct frame_features *ff, uint64_t now, struct thin_pass *pass)
+{
+    struct thin_slot *slot;
+    uint32_t key, t;
+    int cat;
+
+    pass->slot = NULL;
+    if (!ff->modes || !ff->has_addr || (cat = thinCategory(ff, &key)) < 0)
+        return 0;
+
+    t = (uint32_t) (now - table->epoch);
+    slot = &thinLookup(table, ff->addr, t)->slots[cat];
+
+    if (slot->count && t - slot->start >= table->interval)
+        slot->count = 0;
+    if (!slot->count)
+        slot->start = t;
+
+    if (slot->count < table->limit || slot->key != key) {
+        pass->slot = slot;
+        pass->key = key;
+        return 0;
+    }
+
+    ++table->thinned;
+    return 1;
+}
+
+void thinCommit(struct thin_table *table, const struct thin_pass *pass)
+{
+    struct thin_slot *slot = pass->slot;
+
+    if (slot) {
+        slot->key = pass->key;
+        if (slot->count < UINT16_MAX)
+            slot->count++;
+    }
+    ++table->passed;
+}
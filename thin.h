@@ -0,0 +1,94 @@
+// Part of dump1090, a Mode S message decoder for RTLSDR devices.
+//
+// thin.h: per-aircraft thinning of the messages sent to an output
+//
+// This file is free software: you may copy, redistribute and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation, either version 2 of the License, or (at your
+// option) any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef DUMP1090_THIN_H
+#define DUMP1090_THIN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct frame_features;
+
+// What an aircraft's messages are counted by. Even and odd CPR positions
+// are separate so that both halves of a pair keep going out.
+typedef enum {
+    THIN_POSITION_EVEN,  // DF17/18 airborne and surface positions
+    THIN_POSITION_ODD,
+    THIN_VELOCITY,       // DF17/18 TC 19
+    THIN_IDENT,          // DF17/18 TC 1-4: callsign and category
+    THIN_STATUS,         // DF17/18 TC 28: emergency and squawk
+    THIN_TARGET,         // DF17/18 TC 29: target state
+    THIN_OPSTATUS,       // DF17/18 TC 31: operational status
+    THIN_ES_OTHER,       // any other DF17/18
+    THIN_ALTITUDE,       // DF0/4/16/20: altitude replies
+    THIN_SQUAWK,         // DF5/21: identity replies
+    THIN_ALLCALL,        // DF11
+    THIN_CATEGORIES
+} thin_category_t;
+
+// Where one category of one aircraft is within its interval. Times are
+// milliseconds since the table was set up, modulo 2^32.
+struct thin_slot {
+    uint32_t start;     // when the current interval began
+    uint32_t key;       // digest of the content that, when it changes, always passes
+    uint16_t count;     // messages passed in the current interval, 0 = none yet
+};
+
+struct thin_entry {
+    uint32_t addr;      // ICAO address | THIN_USED, 0 = never used
+    uint32_t seen;      // latest message from the aircraft
+    struct thin_slot slots[THIN_CATEGORIES];
+};
+
+#define THIN_USED   0x80000000u
+#define THIN_EXPIRE 60000       // ms of silence after which an aircraft counts as new again
+
+// An open-addressing table by ICAO address, probed linearly over a bounded
+// distance like the duplicate filter's. Silent aircraft count as free.
+struct thin_table {
+    struct thin_entry *slots;
+    size_t mask;        // capacity - 1 (capacity is a power of two)
+    uint64_t epoch;     // mstime() when set up
+    uint32_t interval;  // milliseconds per interval
+    int limit;          // messages per aircraft and category per interval
+    uint64_t passed;
+    uint64_t thinned;
+};
+
+// Set up a table passing 'limit' messages per aircraft and category every
+// 'interval' ms, with room for at least 'capacity' aircraft.
+// Returns 0 on success, -1 if out of memory
+int thinInit(struct thin_table *table, uint64_t interval, int limit, size_t capacity, uint64_t now);
+void thinFree(struct thin_table *table);
+
+// A frame thinCheck() let through, to be counted once it has really gone
+// out: other limits may still drop it, and a dropped frame mustn't use up
+// the aircraft's allowance
+struct thin_pass {
+    struct thin_slot *slot; // NULL if the frame isn't counted per aircraft
+    uint32_t key;
+};
+
+// Returns 1 if the frame should be left out, 0 if it may go out: always
+// for an aircraft's first message, for content that changed, and for
+// frames that aren't Mode S from a known address. For 0, *pass is filled
+// in for thinCommit(), which must come before the next thinCheck() on the
+// table. Not thread safe.
+int thinCheck(struct thin_table *table, const struct frame_features *ff, uint64_t now, struct thin_pass *pass);
+void thinCommit(struct thin_table *table, const struct thin_pass *pass);
+
+#endif
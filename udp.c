@@ -0,0 +1,308 @@
+// Part of dump1090, a Mode S message decoder for RTLSDR devices.
+//
+// udp.c: Beast over UDP datagrams
+//
+// This file is free software: you may copy, redistribute and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation, either version 2 of the License, or (at your
+// option) any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#define _GNU_SOURCE // sendmmsg, recvmmsg
+
+#include "udp.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/uio.h>
+
+#define UDP_SOCKBUF (1024 * 1024)
+
+static int udpIsMulticast(const struct sockaddr_storage *ss)
+{
+    if (ss->ss_family == AF_INET)
+        return IN_MULTICAST(ntohl(((const struct sockaddr_in *) ss)->sin_addr.s_addr));
+    return IN6_IS_ADDR_MULTICAST(&((const struct sockaddr_in6 *) ss)->sin6_addr);
+}
+
+// Resolve one "host:port" into the next target slot
+static int udpAddTarget(struct udp_sender *u, const char *target, char *err, size_t errlen)
+{
+    struct addrinfo hints, *res;
+    char host[256];
+    const char *colon = strrchr(target, ':');
+    size_t hostlen;
+    int rv;
+
+    if (!colon || colon == target || !colon[1]) {
+        snprintf(err, errlen, "'%s' is not host:port", target);
+        return -1;
+    }
+    hostlen = colon - target;
+    if (target[0] == '[' && colon[-1] == ']') {
+        ++target;
+        hostlen -= 2;
+    }
+    if (hostlen >= sizeof(host)) {
+        snprintf(err, errlen, "host name too long in '%s'", target);
+        return -1;
+    }
+    memcpy(host, target, hostlen);
+    host[hostlen] = 0;
+
+    if (u->ntargets == UDP_MAX_TARGETS) {
+        snprintf(err, errlen, "at most %d targets", UDP_MAX_TARGETS);
+        return -1;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    if ((rv = getaddrinfo(host, colon + 1, &hints, &res)) != 0) {
+        snprintf(err, errlen, "%s: %s", host, gai_strerror(rv));
+        return -1;
+    }
+    if (u->ntargets && res->ai_family != u->targets[0].ss_family) {
+        snprintf(err, errlen, "%s: all targets must be IPv4 or all IPv6", host);
+        freeaddrinfo(res);
+        return -1;
+    }
+    memcpy(&u->targets[u->ntargets], res->ai_addr, res->ai_addrlen);
+    u->target_lens[u->ntargets] = res->ai_addrlen;
+    u->ntargets++;
+    freeaddrinfo(res);
+    return 0;
+}
+
+int udpSenderOpen(struct udp_sender *u, const char *spec, int ttl, char *err, size_t errlen)
+{
+    char *copy, *p, *next;
+    int i, sndbuf = UDP_SOCKBUF;
+
+    memset(u, 0, sizeof(*u));
+    u->fd = -1;
+
+    if (!(copy = strdup(spec))) {
+        snprintf(err, errlen, "out of memory");
+        return -1;
+    }
+    for (p = copy; p && *p; p = next) {
+        if ((next = strchr(p, ',')))
+            *next++ = 0;
+        if (udpAddTarget(u, p, err, errlen) < 0) {
+            free(copy);
+            return -1;
+        }
+    }
+    free(copy);
+    if (!u->ntargets) {
+        snprintf(err, errlen, "no targets");
+        return -1;
+    }
+
+    if ((u->fd = socket(u->targets[0].ss_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+        snprintf(err, errlen, "socket: %s", strerror(errno));
+        return -1;
+    }
+    setsockopt(u->fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+    for (i = 0; i < u->ntargets; ++i) {
+        if (!udpIsMulticast(&u->targets[i]))
+            continue;
+        if (u->targets[0].ss_family == AF_INET)
+            setsockopt(u->fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+        else
+            setsockopt(u->fd, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, &ttl, sizeof(ttl));
+        break;
+    }
+    return 0;
+}
+
+void udpSenderClose(struct udp_sender *u)
+{
+    if (u->fd >= 0)
+        close(u->fd);
+    u->fd = -1;
+}
+
+void udpSenderQueue(struct udp_sender *u, const char *data, int len)
+{
+    unsigned char *buf;
+
+    if (len > UDP_PAYLOAD_MAX - UDP_HEADER_LEN)
+        len = UDP_PAYLOAD_MAX - UDP_HEADER_LEN;
+    if (u->pending == UDP_BATCH)
+        udpSenderFlush(u);
+
+    buf = u->bufs[u->pending];
+    buf[0] = UDP_MAGIC0;
+    buf[1] = UDP_MAGIC1;
+    buf[2] = UDP_VERSION;
+    buf[3] = 0;
+    buf[4] = u->seq >> 24;
+    buf[5] = u->seq >> 16;
+    buf[6] = u->seq >> 8;
+    buf[7] = u->seq;
+    memcpy(buf + UDP_HEADER_LEN, data, len);
+    u->lens[u->pending++] = UDP_HEADER_LEN + len;
+    u->seq++;
+}
+
+void udpSenderFlush(struct udp_sender *u)
+{
+    struct mmsghdr msgs[UDP_BATCH * UDP_MAX_TARGETS];
+    struct iovec iov[UDP_BATCH];
+    int i, t, n = 0, done = 0, rv;
+
+    if (!u->pending)
+        return;
+
+    memset(msgs, 0, sizeof(msgs[0]) * u->pending * u->ntargets);
+    for (i = 0; i < u->pending; ++i) {
+        iov[i].iov_base = u->bufs[i];
+        iov[i].iov_len = u->lens[i];
+        for (t = 0; t < u->ntargets; ++t, ++n) {
+            msgs[n].msg_hdr.msg_name = &u->targets[t];
+            msgs[n].msg_hdr.msg_namelen = u->target_lens[t];
+            msgs[n].msg_hdr.msg_iov = &iov[i];
+            msgs[n].msg_hdr.msg_iovlen = 1;
+        }
+    }
+
+    // A datagram a target can't take now is lost rather than held back:
+    // later data matters more, and receivers see the gap in the sequence
+    while (done < n) {
+        rv = sendmmsg(u->fd, msgs + done, n - done, 0);
+        if (rv > 0) {
+            done += rv;
+            u->sent += rv;
+            continue;
+        }
+        if (rv < 0 && errno == EINTR)
+            continue;
+        if (rv < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            // this one (say, an unreachable target) fails; try the rest
+            ++done;
+            ++u->dropped;
+            continue;
+        }
+        u->dropped += n - done;
+        break;
+    }
+    u->pending = 0;
+}
+
+int udpReceiverOpen(struct udp_receiver *u, const char *bind_addr, const char *port, char *err, size_t errlen)
+{
+    struct addrinfo hints, *res, *ai;
+    int rv, rcvbuf = UDP_SOCKBUF, one = 1;
+
+    memset(u, 0, sizeof(*u));
+    u->fd = -1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_PASSIVE;
+    if ((rv = getaddrinfo(bind_addr, port, &hints, &res)) != 0) {
+        snprintf(err, errlen, "%s: %s", bind_addr ? bind_addr : "*", gai_strerror(rv));
+        return -1;
+    }
+
+    for (ai = res; ai; ai = ai->ai_next) {
+        if ((u->fd = socket(ai->ai_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+            continue;
+        setsockopt(u->fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(u->fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        close(u->fd);
+        u->fd = -1;
+    }
+    if (u->fd < 0)
+        snprintf(err, errlen, "can't bind %s:%s: %s", bind_addr ? bind_addr : "*", port, strerror(errno));
+    freeaddrinfo(res);
+    if (u->fd < 0)
+        return -1;
+
+    // a burst from many feeders shouldn't overflow while the event loop
+    // is busy with something else
+    setsockopt(u->fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    return 0;
+}
+
+void udpReceiverClose(struct udp_receiver *u)
+{
+    if (u->fd >= 0)
+        close(u->fd);
+    u->fd = -1;
+}
+
+int udpReceive(struct udp_receiver *u)
+{
+    struct mmsghdr msgs[UDP_RECV_BATCH];
+    struct iovec iov[UDP_RECV_BATCH];
+    int i, n;
+
+    memset(msgs, 0, sizeof(msgs));
+    for (i = 0; i < UDP_RECV_BATCH; ++i) {
+        iov[i].iov_base = u->bufs[i];
+        iov[i].iov_len = UDP_DATAGRAM_MAX;
+        msgs[i].msg_hdr.msg_name = &u->from[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(u->from[i]);
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    do {
+        n = recvmmsg(u->fd, msgs, UDP_RECV_BATCH, MSG_DONTWAIT, NULL);
+    } while (n < 0 && errno == EINTR);
+
+    for (i = 0; i < n; ++i) {
+        u->lens[i] = (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) ? -1 : (int) msgs[i].msg_len;
+        u->fromlens[i] = msgs[i].msg_hdr.msg_namelen;
+    }
+    return n;
+}
+
+int udpParseHeader(const unsigned char *data, int len, uint32_t *seq)
+{
+    if (len < UDP_HEADER_LEN || data[0] != UDP_MAGIC0 || data[1] != UDP_MAGIC1 || data[2] != UDP_VERSION)
+        return 0;
+    *seq = (uint32_t) data[4] << 24 | (uint32_t) data[5] << 16 | (uint32_t) data[6] << 8 | data[7];
+    return UDP_HEADER_LEN;
+}
+
+void udpSequenceTrack(struct udp_sequence *s, uint32_t seq)
+{
+    int32_t gap = (int32_t) (seq - s->next);
+
+    s->received++;
+    if (!s->started || gap > UDP_SEQ_WINDOW || gap < -UDP_SEQ_WINDOW) {
+        // the first datagram, or the sender started again from scratch
+        s->started = 1;
+        s->next = seq + 1;
+        return;
+    }
+
+    if (gap >= 0) {
+        s->lost += gap;
+        s->next = seq + 1;
+    } else {
+        s->late++;
+        if (s->lost)
+            s->lost--;
+    }
+}
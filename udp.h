@@ -0,0 +1,111 @@
+// Part of dump1090, a Mode S message decoder for RTLSDR devices.
+//
+// udp.h: Beast over UDP datagrams
+//
+// This file is free software: you may copy, redistribute and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation, either version 2 of the License, or (at your
+// option) any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef DUMP1090_UDP_H
+#define DUMP1090_UDP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+// Each datagram is an 8-byte header followed by complete Beast frames
+// (or whole lines, for the text formats); a frame never spans datagrams.
+//
+//   'B' 'U'         magic (neither byte is 0x1a, so plain Beast can't
+//                   start this way)
+//   version         UDP_VERSION
+//   flags           0
+//   sequence        uint32, big endian: +1 per datagram from a sender,
+//                   so receivers can tell what was lost
+#define UDP_MAGIC0 'B'
+#define UDP_MAGIC1 'U'
+#define UDP_VERSION 1
+#define UDP_HEADER_LEN 8
+#define UDP_PAYLOAD_MAX 1452    // fits a 1500 byte MTU under IPv6 and UDP headers
+#define UDP_MAX_TARGETS 16
+#define UDP_BATCH 32            // datagrams handed to one sendmmsg()
+#define UDP_DATAGRAM_MAX 9216   // biggest datagram taken in (jumbo frames); longer ones are dropped
+#define UDP_RECV_BATCH 32       // datagrams taken from one recvmmsg()
+#define UDP_SEQ_WINDOW 4096     // a sequence jump bigger than this is a restarted sender, not loss
+
+// Sends datagrams to a multicast group or a list of unicast addresses,
+// queueing them so that a burst goes out in one system call
+struct udp_sender {
+    int fd;
+    int ntargets;
+    struct sockaddr_storage targets[UDP_MAX_TARGETS];
+    socklen_t target_lens[UDP_MAX_TARGETS];
+    uint32_t seq;           // sequence number of the next datagram
+    int pending;            // datagrams queued in bufs
+    int lens[UDP_BATCH];
+    unsigned char bufs[UDP_BATCH][UDP_PAYLOAD_MAX];
+    uint64_t sent;          // datagrams sent, counted once per target
+    uint64_t dropped;       // and refused by the socket
+};
+
+// Resolve "host:port[,host:port...]" (IPv6 hosts in brackets) and open a
+// socket for them; multicast groups get the given TTL. All targets must be
+// the same address family.
+// Returns 0, or -1 with a message in err
+int udpSenderOpen(struct udp_sender *u, const char *spec, int ttl, char *err, size_t errlen);
+void udpSenderClose(struct udp_sender *u);
+
+// Queue one datagram's payload (at most UDP_PAYLOAD_MAX - UDP_HEADER_LEN
+// bytes), sending the queue first if it is full
+void udpSenderQueue(struct udp_sender *u, const char *data, int len);
+
+// Send everything queued to every target. Datagrams the socket won't take
+// are dropped
+void udpSenderFlush(struct udp_sender *u);
+
+// Takes datagrams from a bound socket, a batch at a time
+struct udp_receiver {
+    int fd;
+    int lens[UDP_RECV_BATCH];   // length of each datagram received, -1 if it was truncated
+    struct sockaddr_storage from[UDP_RECV_BATCH];
+    socklen_t fromlens[UDP_RECV_BATCH];
+    unsigned char bufs[UDP_RECV_BATCH][UDP_DATAGRAM_MAX];
+};
+
+// Bind a socket to bind_addr:port.
+// Returns 0, or -1 with a message in err
+int udpReceiverOpen(struct udp_receiver *u, const char *bind_addr, const char *port, char *err, size_t errlen);
+void udpReceiverClose(struct udp_receiver *u);
+
+// Take up to UDP_RECV_BATCH waiting datagrams without blocking.
+// Returns how many, or -1 with errno set (EAGAIN if none were waiting)
+int udpReceive(struct udp_receiver *u);
+
+// Where the Beast data starts in a datagram: after the header, with *seq
+// set, or at 0 for a datagram without one (plain Beast from some other
+// sender)
+int udpParseHeader(const unsigned char *data, int len, uint32_t *seq);
+
+// What the sequence numbers from one sender say about loss. A datagram
+// that turns up after later ones was counted as lost when the later one
+// arrived; it is taken off again and counted as late instead.
+struct udp_sequence {
+    int started;
+    uint32_t next;          // sequence number expected next
+    uint64_t received;      // datagrams with a header
+    uint64_t lost;          // gaps in the sequence
+    uint64_t late;          // datagrams that arrived out of order
+};
+
+void udpSequenceTrack(struct udp_sequence *s, uint32_t seq);
+
+#endif
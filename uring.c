@@ -0,0 +1,272 @@
+// Part of dump1090, a Mode S message decoder for RTLSDR devices.
+//
+// uring.c: a minimal io_uring ring, driven through the raw system calls
+//
+// This file is free software: you may copy, redistribute and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation, either version 2 of the License, or (at your
+// option) any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "uring.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+// The ring indexes are shared with the kernel: the head we consume from
+// and the tail we produce to are published with release stores, the
+// kernel's with acquire loads
+#define URING_LOAD(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define URING_STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+static int uringSetup(unsigned entries, struct io_uring_params *p)
+{
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uringEnter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int uringRegister(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+int uringOpen(struct uring *u, unsigned entries, char *err, size_t errlen)
+{
+    struct io_uring_params p;
+    size_t cq_len;
+    char *ring;
+
+    memset(u, 0, sizeof(*u));
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = entries * 4;
+
+    if ((u->fd = uringSetup(entries, &p)) < 0) {
+        snprintf(err, errlen, "io_uring_setup: %s", strerror(errno));
+        return -1;
+    }
+    if (!(p.features & IORING_FEAT_NODROP) || !(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        snprintf(err, errlen, "kernel io_uring is too old");
+        close(u->fd);
+        return -1;
+    }
+
+    u->ring_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (cq_len > u->ring_map_len)
+        u->ring_map_len = cq_len;
+    u->ring_map = mmap(NULL, u->ring_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->ring_map == MAP_FAILED) {
+        snprintf(err, errlen, "mmap of the io_uring rings: %s", strerror(errno));
+        close(u->fd);
+        return -1;
+    }
+
+    u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        snprintf(err, errlen, "mmap of the io_uring entries: %s", strerror(errno));
+        munmap(u->ring_map, u->ring_map_len);
+        close(u->fd);
+        return -1;
+    }
+
+    ring = u->ring_map;
+    u->sq_entries = p.sq_entries;
+    u->sq_head = (unsigned *) (ring + p.sq_off.head);
+    u->sq_tail = (unsigned *) (ring + p.sq_off.tail);
+    u->sq_mask = (unsigned *) (ring + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *) (ring + p.sq_off.array);
+    u->sq_flags = (unsigned *) (ring + p.sq_off.flags);
+    u->sq_local_tail = *u->sq_tail;
+    u->cq_head = (unsigned *) (ring + p.cq_off.head);
+    u->cq_tail = (unsigned *) (ring + p.cq_off.tail);
+    u->cq_mask = (unsigned *) (ring + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *) (ring + p.cq_off.cqes);
+    return 0;
+}
+
+void uringClose(struct uring *u)
+{
+    if (u->br) {
+        struct io_uring_buf_reg reg;
+
+        memset(&reg, 0, sizeof(reg));
+        reg.bgid = URING_BUFFER_GROUP;
+        uringRegister(u->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+        munmap(u->br, u->buf_count * sizeof(struct io_uring_buf));
+        munmap(u->bufs, (size_t) u->buf_count * u->buf_size);
+    }
+    munmap(u->sqes, u->sqes_len);
+    munmap(u->ring_map, u->ring_map_len);
+    close(u->fd);
+    u->fd = -1;
+}
+
+int uringSetupBuffers(struct uring *u, unsigned count, unsigned size, char *err, size_t errlen)
+{
+    struct io_uring_buf_reg reg;
+    unsigned i;
+
+    u->br = mmap(NULL, count * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    u->bufs = mmap(NULL, (size_t) count * size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (u->br == MAP_FAILED || u->bufs == MAP_FAILED) {
+        snprintf(err, errlen, "out of memory for receive buffers");
+        if (u->br != MAP_FAILED)
+            munmap(u->br, count * sizeof(struct io_uring_buf));
+        if (u->bufs != MAP_FAILED)
+            munmap(u->bufs, (size_t) count * size);
+        u->br = NULL;
+        u->bufs = NULL;
+        return -1;
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t) (uintptr_t) u->br;
+    reg.ring_entries = count;
+    reg.bgid = URING_BUFFER_GROUP;
+    if (uringRegister(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        snprintf(err, errlen, "registering receive buffers: %s", strerror(errno));
+        munmap(u->br, count * sizeof(struct io_uring_buf));
+        munmap(u->bufs, (size_t) count * size);
+        u->br = NULL;
+        u->bufs = NULL;
+        return -1;
+    }
+
+    u->buf_count = count;
+    u->buf_size = size;
+    u->br_tail = 0;
+    for (i = 0; i < count; ++i)
+        uringRecycleBuffer(u, i);
+    return 0;
+}
+
+void uringRecycleBuffer(struct uring *u, unsigned bid)
+{
+    struct io_uring_buf *buf = &u->br->bufs[u->br_tail & (u->buf_count - 1)];
+
+    buf->addr = (uint64_t) (uintptr_t) uringBuffer(u, bid);
+    buf->len = u->buf_size;
+    buf->bid = (uint16_t) bid;
+    URING_STORE(&u->br->tail, (uint16_t) ++u->br_tail);
+}
+
+int uringRegisterEventfd(struct uring *u, int efd)
+{
+    return uringRegister(u->fd, IORING_REGISTER_EVENTFD, &efd, 1);
+}
+
+struct io_uring_sqe *uringGetSqe(struct uring *u)
+{
+    struct io_uring_sqe *sqe;
+    unsigned idx;
+
+    if (u->sq_local_tail - URING_LOAD(u->sq_head) >= u->sq_entries) {
+        if (uringSubmit(u) < 0)
+            return NULL;
+        if (u->sq_local_tail - URING_LOAD(u->sq_head) >= u->sq_entries)
+            return NULL;
+    }
+
+    idx = u->sq_local_tail & *u->sq_mask;
+    sqe = &u->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[idx] = idx;
+    u->sq_local_tail++;
+    u->to_submit++;
+    return sqe;
+}
+
+int uringSubmit(struct uring *u)
+{
+    int n;
+
+    if (!u->to_submit)
+        return 0;
+
+    URING_STORE(u->sq_tail, u->sq_local_tail);
+    do {
+        n = uringEnter(u->fd, u->to_submit, 0, 0);
+    } while (n < 0 && errno == EINTR);
+    u->enters++;
+    if (n < 0)
+        return -1;
+    u->to_submit -= n;
+    return n;
+}
+
+struct io_uring_cqe *uringPeek(struct uring *u)
+{
+    unsigned head = *u->cq_head;
+
+    if (head == URING_LOAD(u->cq_tail)) {
+        if (!(URING_LOAD(u->sq_flags) & IORING_SQ_CQ_OVERFLOW))
+            return NULL;
+        uringEnter(u->fd, 0, 0, IORING_ENTER_GETEVENTS);
+        u->enters++;
+        if (head == URING_LOAD(u->cq_tail))
+            return NULL;
+    }
+    return &u->cqes[head & *u->cq_mask];
+}
+
+void uringSeen(struct uring *u)
+{
+    URING_STORE(u->cq_head, *u->cq_head + 1);
+}
+
+void uringPrepAcceptMultishot(struct io_uring_sqe *sqe, int fd, uint64_t user_data)
+{
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = user_data;
+}
+
+void uringPrepRecvMultishot(struct io_uring_sqe *sqe, int fd, uint64_t user_data)
+{
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = user_data;
+}
+
+void uringPrepSendmsg(struct io_uring_sqe *sqe, int fd, const struct msghdr *msg, int flags, uint64_t user_data)
+{
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t) (uintptr_t) msg;
+    sqe->len = 1;
+    sqe->msg_flags = (uint32_t) flags;
+    sqe->user_data = user_data;
+}
+
+void uringPrepCancelFd(struct io_uring_sqe *sqe, int fd, uint64_t user_data)
+{
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = fd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = user_data;
+}
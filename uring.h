@@ -0,0 +1,92 @@
+// Part of dump1090, a Mode S message decoder for RTLSDR devices.
+//
+// uring.h: a minimal io_uring ring, driven through the raw system calls
+//
+// This file is free software: you may copy, redistribute and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation, either version 2 of the License, or (at your
+// option) any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef DUMP1090_URING_H
+#define DUMP1090_URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+struct msghdr;
+
+// One submission/completion queue pair, used by a single thread, with an
+// optional ring of provided buffers that multishot receives fill in
+struct uring {
+    int fd;
+    unsigned sq_entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array, *sq_flags;
+    unsigned sq_local_tail;     // tail including entries not yet submitted
+    unsigned to_submit;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *ring_map;             // both rings, in one mapping
+    size_t ring_map_len, sqes_len;
+
+    struct io_uring_buf_ring *br; // provided buffers, group URING_BUFFER_GROUP
+    unsigned char *bufs;
+    unsigned buf_count;         // a power of two
+    unsigned buf_size;
+    unsigned br_tail;
+
+    uint64_t enters;            // io_uring_enter() calls, for the statistics
+};
+
+#define URING_BUFFER_GROUP 0
+
+// Set up a ring with room for 'entries' submissions and four times as many
+// completions. Returns 0, or -1 with a message in err (the kernel may not
+// have io_uring, or not let us use it)
+int uringOpen(struct uring *u, unsigned entries, char *err, size_t errlen);
+void uringClose(struct uring *u);
+
+// Register 'count' buffers of 'size' bytes for multishot receives.
+// Returns 0, or -1 with a message in err
+int uringSetupBuffers(struct uring *u, unsigned count, unsigned size, char *err, size_t errlen);
+
+// The data of a provided buffer, and giving it back once it's been used
+static inline unsigned char *uringBuffer(struct uring *u, unsigned bid)
+{
+    return u->bufs + (size_t) bid * u->buf_size;
+}
+void uringRecycleBuffer(struct uring *u, unsigned bid);
+
+// Have the kernel signal an eventfd whenever completions are posted
+int uringRegisterEventfd(struct uring *u, int efd);
+
+// A cleared submission queue entry, submitting what is queued first if the
+// ring is full. NULL only if that submission failed
+struct io_uring_sqe *uringGetSqe(struct uring *u);
+
+// Hand everything queued to the kernel in one system call.
+// Returns the number submitted, or -1 with errno set
+int uringSubmit(struct uring *u);
+
+// The next completion, or NULL if there are none. The entry stays valid
+// until uringSeen(). Completions the kernel had to hold back because the
+// queue was full are fetched here too
+struct io_uring_cqe *uringPeek(struct uring *u);
+void uringSeen(struct uring *u);
+
+// Preparing the operations the network code uses
+void uringPrepAcceptMultishot(struct io_uring_sqe *sqe, int fd, uint64_t user_data);
+void uringPrepRecvMultishot(struct io_uring_sqe *sqe, int fd, uint64_t user_data);
+void uringPrepSendmsg(struct io_uring_sqe *sqe, int fd, const struct msghdr *msg, int flags, uint64_t user_data);
+void uringPrepCancelFd(struct io_uring_sqe *sqe, int fd, uint64_t user_data);
+
+#endif
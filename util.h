@@ -25,6 +25,9 @@
 /* Returns system time in milliseconds */
 uint64_t mstime(void);
 
+/* Returns a monotonic clock in microseconds */
+uint64_t monotonic_usecs(void);
+
 /* Returns the time elapsed, in nanoseconds, from t1 to t2,
  * where t1 and t2 are 12MHz counters.
  */